@@ -1,4 +1,6 @@
 #include <SDL2/SDL.h>
+#include <algorithm>
+#include <cmath>
 #include <complex>
 #include <iostream>
 #include <immintrin.h>
@@ -7,105 +9,266 @@ const int SCREEN_WIDTH = 800;
 const int SCREEN_HEIGHT = 600;
 const int MAX_ITER = 1000;
 
-struct Color {
-    uint8_t r, g, b;
-};
+// Every iteration count 0 .. MAX_ITER to an RGBA pixel, worked out once at startup so drawing
+// a pixel is a lookup instead of three sin() calls
+Uint32 palette[MAX_ITER + 1];
 
-// Maps an iteration to a color
-Color getColor(int iter) {
-    if (iter == MAX_ITER) {
-        return {0, 0, 0};
-    } else {
+void buildPalette() {
+    for (int iter = 0; iter <= MAX_ITER; iter++) {
+        if (iter == MAX_ITER) {
+            palette[iter] = 0xFF;
+            continue;
+        }
         double t = static_cast<double>(iter) / MAX_ITER;
-        uint8_t r = static_cast<uint8_t>(128.0 + 127.0 * sin(6.28318 * t + 0));
-        uint8_t g = static_cast<uint8_t>(128.0 + 127.0 * sin(6.28318 * t + 2.09439)); // 2π/3 phase shift
-        uint8_t b = static_cast<uint8_t>(128.0 + 127.0 * sin(6.28318 * t + 4.18879)); // 4π/3 phase shift
-        return {r, g, b};
+        Uint32 r = static_cast<uint8_t>(128.0 + 127.0 * sin(6.28318 * t + 0));
+        Uint32 g = static_cast<uint8_t>(128.0 + 127.0 * sin(6.28318 * t + 2.09439)); // 2π/3 phase shift
+        Uint32 b = static_cast<uint8_t>(128.0 + 127.0 * sin(6.28318 * t + 4.18879)); // 4π/3 phase shift
+        palette[iter] = (r << 24) | (g << 16) | (b << 8) | 0xFF;
     }
 }
 
 // Calculates if a complex number c is in MB set and returns number of iters before leaving set
 int mandelbrot(std::complex<double> c) {
+    // Main cardioid and period 2 bulb are in the set, no need to iterate them at all
+    double xq = c.real() - 0.25;
+    double q = xq * xq + c.imag() * c.imag();
+    if (q * (q + xq) <= 0.25 * c.imag() * c.imag() || std::norm(c + 1.0) <= 0.0625) return MAX_ITER;
+
     std::complex<double> z = 0;
     int iter = 0;
 
+    // Brent style cycle detection: remember z every so often (doubling the gap each time) and if
+    // the orbit lands back on it, it is stuck in a cycle and will never escape
+    std::complex<double> saved = 0;
+    int window = 8;
+    int untilSave = window;
+
     while (std::norm(z) <= 4.0 && iter < MAX_ITER) {
         z = z * z + c;
         iter++;
+
+        if (std::norm(z - saved) < 1e-28) return MAX_ITER;
+        if (--untilSave == 0) {
+            window *= 2;
+            untilSave = window;
+            saved = z;
+        }
     }
 
     return iter;
 }
 
-// Defining 64-bit double AVX registers, so each ymm register can fit 4 of them at once to do SIMD
-__m256d _zr, _zi, _ca, _cb, _a, _b, _zr2, _zi2, _two, _four, _mask1;
-
-// 64-bit integer AVX registers
-__m256i _n, _iter, _mask2, _c, _one;
-
-// Calc c in MB set using AVX256 intrinsics, doing 4 different cs at once 
-void mandelbrotAVX(double offsetX, double offsetY, double zoom, const int max_iterations, Uint32* pixels, int bytesPerRow) {
-    _four = _mm256_set1_pd(4.0);
-    _two = _mm256_set1_pd(2.0);
-    _one = _mm256_set1_epi64x(1);
-    for (int i = 0; i < SCREEN_HEIGHT; i++) {
-        for (int j = 0; j < SCREEN_WIDTH; j += 4) {
-            // Init registers for max iterations for comparison
-            _iter = _mm256_set1_epi64x(max_iterations);
-            
-            // Init c and z registers
-            _ca = _mm256_set_pd(
-                (j + 3 - SCREEN_WIDTH / 2.0) * 4.0 / (SCREEN_WIDTH * zoom) + offsetX,
-                (j + 2 - SCREEN_WIDTH / 2.0) * 4.0 / (SCREEN_WIDTH * zoom) + offsetX,
-                (j + 1 - SCREEN_WIDTH / 2.0) * 4.0 / (SCREEN_WIDTH * zoom) + offsetX,
-                (j + 0 - SCREEN_WIDTH / 2.0) * 4.0 / (SCREEN_WIDTH * zoom) + offsetX
-            );
+const double ESCAPE_RADIUS = 2.0;
+
+// AVX2 register types and the handful of operations the kernel needs, so one template covers
+// 4 doubles or 8 floats per register. Counts live in integer lanes as wide as the reals, so the
+// compare masks can be used on them directly.
+struct Double4 {
+    using Real = __m256d;
+    using Count = __m256i; // 64 bit counts
+    static const int LANES = 4;
+    static constexpr double CYCLE_EPSILON2 = 1e-28; // how close a cycle has to come back, squared
+
+    static Real set1(double x) { return _mm256_set1_pd(x); }
+    static Real ramp(double first) { return _mm256_set_pd(first + 3, first + 2, first + 1, first); }
+    static Real add(Real a, Real b) { return _mm256_add_pd(a, b); }
+    static Real sub(Real a, Real b) { return _mm256_sub_pd(a, b); }
+    static Real mul(Real a, Real b) { return _mm256_mul_pd(a, b); }
+    static Real fmadd(Real a, Real b, Real c) { return _mm256_fmadd_pd(a, b, c); }
+    static Real lessThan(Real a, Real b) { return _mm256_cmp_pd(a, b, _CMP_LT_OQ); }
+    static Real lessEqual(Real a, Real b) { return _mm256_cmp_pd(a, b, _CMP_LE_OQ); }
+    static Real either(Real a, Real b) { return _mm256_or_pd(a, b); }
+
+    static Count counts(int n) { return _mm256_set1_epi64x(n); }
+    static Count mask(Real m) { return _mm256_castpd_si256(m); }
+    static Count greater(Count a, Count b) { return _mm256_cmpgt_epi64(a, b); }
+    static Count minus(Count a, Count b) { return _mm256_sub_epi64(a, b); }
+
+    // Look up all 4 colors at once (lane 0 is the leftmost pixel)
+    static void colors(Count n, Uint32* out) {
+        __m128i colors = _mm256_i64gather_epi32(reinterpret_cast<const int*>(palette), n, 4);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(out), colors);
+    }
+};
 
-            _cb = _mm256_set1_pd((i - SCREEN_HEIGHT / 2.0) * 4.0 / (SCREEN_HEIGHT * zoom) + offsetY);
-            _zr = _mm256_setzero_pd();
-            _zi = _mm256_setzero_pd();
+struct Float8 {
+    using Real = __m256;
+    using Count = __m256i; // 32 bit counts
+    static const int LANES = 8;
+    static constexpr double CYCLE_EPSILON2 = 1e-12; // floats round off way before 1e-28
 
-            _n = _mm256_setzero_si256(); // Init iterations count
+    static Real set1(double x) { return _mm256_set1_ps(static_cast<float>(x)); }
+    static Real ramp(double first) {
+        float f = static_cast<float>(first);
+        return _mm256_set_ps(f + 7, f + 6, f + 5, f + 4, f + 3, f + 2, f + 1, f);
+    }
+    static Real add(Real a, Real b) { return _mm256_add_ps(a, b); }
+    static Real sub(Real a, Real b) { return _mm256_sub_ps(a, b); }
+    static Real mul(Real a, Real b) { return _mm256_mul_ps(a, b); }
+    static Real fmadd(Real a, Real b, Real c) { return _mm256_fmadd_ps(a, b, c); }
+    static Real lessThan(Real a, Real b) { return _mm256_cmp_ps(a, b, _CMP_LT_OQ); }
+    static Real lessEqual(Real a, Real b) { return _mm256_cmp_ps(a, b, _CMP_LE_OQ); }
+    static Real either(Real a, Real b) { return _mm256_or_ps(a, b); }
+
+    static Count counts(int n) { return _mm256_set1_epi32(n); }
+    static Count mask(Real m) { return _mm256_castps_si256(m); }
+    static Count greater(Count a, Count b) { return _mm256_cmpgt_epi32(a, b); }
+    static Count minus(Count a, Count b) { return _mm256_sub_epi32(a, b); }
+
+    static void colors(Count n, Uint32* out) {
+        __m256i colors = _mm256_i32gather_epi32(reinterpret_cast<const int*>(palette), n, 4);
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(out), colors);
+    }
+};
 
-            for (int iter = 0; iter < MAX_ITER; iter++) {
-                _zr2 = _mm256_mul_pd(_zr, _zr);
-                _zi2 = _mm256_mul_pd(_zi, _zi);
+// One row of the screen at height y, pixel j at x = offsetX + (j - SCREEN_WIDTH / 2) * dx.
+//   L       Double4 or Float8
+//   UNROLL  vectors iterated side by side, so their multiplies overlap instead of each waiting on
+//           its own last result
+//   CAP     iteration limit known at compile time, 0 takes maxIter at runtime instead
+// The palette only goes up to MAX_ITER, so neither can be more than that.
+template <typename L, int UNROLL, int CAP>
+void mandelbrotRow(double offsetX, double y, double dx, int maxIter, Uint32* out) {
+    using Real = typename L::Real;
+    using Count = typename L::Count;
+    const int STRIDE = L::LANES * UNROLL;
+    static_assert(SCREEN_WIDTH % STRIDE == 0, "rows have to split into whole groups of vectors");
+
+    const int limit = CAP > 0 ? CAP : maxIter;
+    const Count iterLimit = L::counts(limit);
+    const Real two = L::set1(2.0);
+    const Real escape = L::set1(ESCAPE_RADIUS * ESCAPE_RADIUS);
+    const Real cycleTolerance = L::set1(L::CYCLE_EPSILON2);
+
+    // Everything that used to be divided out per vector: x is one fma off the column number, which
+    // stays a small exact integer so there is no drift over the row
+    const Real left = L::set1(offsetX);
+    const Real step = L::set1(dx);
+    const Real advance = L::set1(L::LANES);
+    const Real cb = L::set1(y);
+    const Real cb2 = L::mul(cb, cb);
+    Real column = L::ramp(-SCREEN_WIDTH / 2);
+
+    for (int j = 0; j < SCREEN_WIDTH; j += STRIDE) {
+        Real ca[UNROLL], zr[UNROLL], zi[UNROLL], savedr[UNROLL], savedi[UNROLL];
+        Count n[UNROLL];
+
+        for (int u = 0; u < UNROLL; ++u) {
+            ca[u] = L::fmadd(column, step, left);
+            column = L::add(column, advance);
+            zr[u] = zi[u] = savedr[u] = savedi[u] = L::set1(0.0);
+
+            // c in the main cardioid or the period 2 bulb is in the set for sure, so those lanes
+            // start at max iterations and the mask below never lets them count
+            Real xq = L::sub(ca[u], L::set1(0.25));
+            Real q = L::fmadd(xq, xq, cb2);
+            Real cardioid = L::lessEqual(L::mul(q, L::add(q, xq)), L::mul(L::set1(0.25), cb2));
+            Real xb = L::add(ca[u], L::set1(1.0));
+            Real bulb = L::lessEqual(L::fmadd(xb, xb, cb2), L::set1(0.0625));
+            n[u] = _mm256_blendv_epi8(L::counts(0), iterLimit, L::mask(L::either(cardioid, bulb)));
+        }
 
-                _a = _mm256_sub_pd(_zr2, _zi2);
-                _a = _mm256_add_pd(_a, _ca);
+        // Brent cycle detection, save z every so often and watch for the orbit to come back to it
+        int window = 8;
+        int untilSave = window;
+
+        for (int iter = 0; iter < limit; iter++) {
+            Count anyActive = L::counts(0);
+            for (int u = 0; u < UNROLL; ++u) {
+                Real zr2 = L::mul(zr[u], zr[u]);
+                Real zi2 = L::mul(zi[u], zi[u]);
+                Real zri = L::mul(zr[u], zi[u]);
+                Real inside = L::lessThan(L::add(zr2, zi2), escape);
+                zr[u] = L::add(L::sub(zr2, zi2), ca[u]);
+                zi[u] = L::fmadd(two, zri, cb);
+
+                // Active lanes are all ones, so taking the mask away adds 1 to them
+                Count active = _mm256_and_si256(L::greater(iterLimit, n[u]), L::mask(inside));
+                n[u] = L::minus(n[u], active);
+                anyActive = _mm256_or_si256(anyActive, active);
+            }
+            if (_mm256_testz_si256(anyActive, anyActive)) break;
+
+            // Lanes whose orbit landed back on the saved point are stuck in a cycle, jump them to max iterations
+            for (int u = 0; u < UNROLL; ++u) {
+                Real dr = L::sub(zr[u], savedr[u]);
+                Real di = L::sub(zi[u], savedi[u]);
+                Real periodic = L::lessThan(L::fmadd(dr, dr, L::mul(di, di)), cycleTolerance);
+                n[u] = _mm256_blendv_epi8(n[u], iterLimit, L::mask(periodic));
+            }
 
-                _b = _mm256_mul_pd(_zr, _zi);
-                _b = _mm256_fmadd_pd(_two, _b, _cb); // mult b and 2 then add with cb
+            if (--untilSave == 0) {
+                window *= 2;
+                untilSave = window;
+                for (int u = 0; u < UNROLL; ++u) {
+                    savedr[u] = zr[u];
+                    savedi[u] = zi[u];
+                }
+            }
+        }
 
-                _zr = _a;
-                _zi = _b;
+        for (int u = 0; u < UNROLL; ++u) L::colors(n[u], out + j + u * L::LANES);
+    }
+}
 
-                _a = _mm256_add_pd(_zr2, _zi2);
-                _mask1 = _mm256_cmp_pd(_a, _four, _CMP_LT_OQ);
+using RowKernel = void (*)(double offsetX, double y, double dx, int maxIter, Uint32* out);
 
-                _mask2 = _mm256_cmpgt_epi64(_iter, _n);
-                _mask2 = _mm256_and_si256(_mask2, _mm256_castpd_si256(_mask1));
+// Every version built ahead of time. pickKernel takes the first one that fits the frame, so the ones
+// with the iteration count baked in go before the runtime ones. One vector at a time: iterating two
+// side by side came out slower here, the pair keeps going until the slower of the two is done.
+struct RowKernelInfo {
+    const char* name;
+    bool floatLanes;
+    int cap; // 0 for any maxIter
+    RowKernel run;
+};
 
-                _c = _mm256_and_si256(_one, _mask2);
-                _n = _mm256_add_epi64(_n, _c);
+const RowKernelInfo ROW_KERNELS[] = {
+    {"float x8, capped at MAX_ITER", true, MAX_ITER, mandelbrotRow<Float8, 1, MAX_ITER>},
+    {"double x4, capped at MAX_ITER", false, MAX_ITER, mandelbrotRow<Double4, 1, MAX_ITER>},
+    {"float x8", true, 0, mandelbrotRow<Float8, 1, 0>},
+    {"double x4", false, 0, mandelbrotRow<Double4, 1, 0>},
+};
 
-                if (_mm256_testz_si256(_mask2, _mask2)) break;
-            }
+// Floats are good enough while neighbouring pixels are at least this many float ulps apart (same
+// rule as MBKernels.h)
+const double FLOAT_MIN_ULPS_PER_PIXEL = 1024.0;
+
+const RowKernelInfo& pickKernel(double pixelSpacing, double extent, int maxIter) {
+    double floatUlp = std::max(extent, 2.0) * 1.1920929e-07; // FLT_EPSILON around the biggest coordinate
+    bool floatFits = pixelSpacing >= FLOAT_MIN_ULPS_PER_PIXEL * floatUlp;
+    for (const RowKernelInfo& kernel : ROW_KERNELS) {
+        if (kernel.floatLanes && !floatFits) continue;
+        if (kernel.cap != 0 && kernel.cap != maxIter) continue;
+        return kernel;
+    }
+    // The last one always fits
+    return ROW_KERNELS[sizeof(ROW_KERNELS) / sizeof(ROW_KERNELS[0]) - 1];
+}
 
-            Color color1 = getColor(int(_n[3]));
-            Color color2 = getColor(int(_n[2]));
-            Color color3 = getColor(int(_n[1]));
-            Color color4 = getColor(int(_n[0]));
+// Whole screen, a row at a time through whichever specialized kernel fits the view
+void mandelbrotAVX(double offsetX, double offsetY, double zoom, const int max_iterations, Uint32* pixels, int bytesPerRow) {
+    // Steps between pixels, worked out once instead of dividing them out for every vector
+    const double stepX = 4.0 / (SCREEN_WIDTH * zoom);
+    const double stepY = 4.0 / (SCREEN_HEIGHT * zoom);
+    double extent = std::max(std::abs(offsetX), std::abs(offsetY)) + 2.0 / zoom;
+
+    const RowKernelInfo& kernel = pickKernel(std::min(stepX, stepY), extent, max_iterations);
+    static const RowKernelInfo* last = nullptr;
+    if (&kernel != last) {
+        std::cout << "Using the " << kernel.name << " kernel" << std::endl;
+        last = &kernel;
+    }
 
-            pixels[i * (bytesPerRow / 4) + j + 0] = (color1.r << 24) | (color1.g << 16) | (color1.b << 8) | 0xFF;
-            pixels[i * (bytesPerRow / 4) + j + 1] = (color2.r << 24) | (color2.g << 16) | (color2.b << 8) | 0xFF;
-            pixels[i * (bytesPerRow / 4) + j + 2] = (color3.r << 24) | (color3.g << 16) | (color3.b << 8) | 0xFF;
-            pixels[i * (bytesPerRow / 4) + j + 3] = (color4.r << 24) | (color4.g << 16) | (color4.b << 8) | 0xFF;
-        }
+    for (int i = 0; i < SCREEN_HEIGHT; i++) {
+        double y = (i - SCREEN_HEIGHT / 2) * stepY + offsetY;
+        kernel.run(offsetX, y, stepX, max_iterations, pixels + i * (bytesPerRow / 4));
     }
 }
 
 int main() {
+    buildPalette();
+
     // Init SDL2
     if (SDL_Init(SDL_INIT_VIDEO) < 0) {
         std::cerr << "SDL could not start! Error: " << SDL_GetError() << std::endl;
@@ -148,12 +311,23 @@ int main() {
     bool quit = false;
     SDL_Event e;
 
+    // View the texture was last drawn with, nothing to recompute while it stays the same
+    bool drawn = false;
+    double drawnZoom = zoom;
+    double drawnOffsetX = offsetX;
+    double drawnOffsetY = offsetY;
+    bool repaint = false;
+
     // Main loop
     while (!quit) {
-        // Handle events
-        while (SDL_PollEvent(&e) != 0) {
+        // Handle events, when the frame is up to date just sleep until the next one comes in
+        bool upToDate = drawn && zoom == drawnZoom && offsetX == drawnOffsetX && offsetY == drawnOffsetY;
+        int pending = upToDate ? SDL_WaitEvent(&e) : SDL_PollEvent(&e);
+        for (; pending != 0; pending = SDL_PollEvent(&e)) {
             if (e.type == SDL_QUIT) {
                 quit = true;
+            } else if (e.type == SDL_WINDOWEVENT) {
+                repaint = true;
             } else if (e.type == SDL_KEYDOWN) {
                 switch (e.key.keysym.sym) {
                     case SDLK_UP:
@@ -185,16 +359,29 @@ int main() {
             }
         }
 
-        // Lock texture for manipulation
-        void* pixels;
-        int bytesPerRow;
-        SDL_LockTexture(texture, NULL, &pixels, &bytesPerRow);
+        if (quit) break;
 
-        // Draw mandelbrot and manipulate pixels directly using SIMD
-        Uint32* pixelData = static_cast<Uint32*>(pixels);
-        mandelbrotAVX(offsetX, offsetY, zoom, MAX_ITER, pixelData, bytesPerRow);
+        bool viewChanged = !drawn || zoom != drawnZoom || offsetX != drawnOffsetX || offsetY != drawnOffsetY;
+        if (!viewChanged && !repaint) continue;
+        repaint = false;
 
-        SDL_UnlockTexture(texture);
+        if (viewChanged) {
+            // Lock texture for manipulation
+            void* pixels;
+            int bytesPerRow;
+            SDL_LockTexture(texture, NULL, &pixels, &bytesPerRow);
+
+            // Draw mandelbrot and manipulate pixels directly using SIMD
+            Uint32* pixelData = static_cast<Uint32*>(pixels);
+            mandelbrotAVX(offsetX, offsetY, zoom, MAX_ITER, pixelData, bytesPerRow);
+
+            SDL_UnlockTexture(texture);
+
+            drawn = true;
+            drawnZoom = zoom;
+            drawnOffsetX = offsetX;
+            drawnOffsetY = offsetY;
+        }
 
         // Clear screen
         SDL_SetRenderDrawColor(renderer, 0x00, 0x00, 0x00, 0xFF);
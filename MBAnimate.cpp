@@ -0,0 +1,662 @@
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+#include "MBBigFixed.h"
+#include "MBImageWriter.h"
+#include "MBKernels.h"
+#include "MBPalette.h"
+#include "MBRender.h"
+#include "MBThreadPool.h"
+
+/*
+    Zoom videos. Takes a path of keyframes (frame number, center, zoom, iterations) and writes
+    every frame in between, zoom going exponentially from one keyframe to the next.
+
+    Computing every frame from scratch is a waste: at 60 fps each frame is only a couple of
+    percent deeper than the last, so nearly all of it was already computed one frame ago, just a
+    bit smaller. Instead, while the center stays put the frames come out of an exponential map:
+    rings around the center, each one a fixed factor smaller than the one before,
+        ring k has half size r_k = r_0 * exp(-2k / longer side of the frame in pixels)
+    and each sampled at the same number of points. Every frame is then the rings from its border
+    down to about a pixel from the center, interpolated, and going one frame deeper only needs
+    the handful of new rings at the inside. Near the center the rings are far denser than the
+    pixels, which is the price, but over a whole video it comes out at a small fraction of the
+    points a frame by frame render needs (it says how much at the end).
+
+    The rings are rectangles with the frame's shape instead of circles, so each side is a straight
+    row of equally spaced points and goes through the same kernels as everything else (SIMD,
+    double-double, perturbation). Ring k is then exactly the border of the frame you get at zoom
+    r_0 / r_k times the first one, which is also what makes getting from pixels to rings easy.
+
+    Three things overlap: the pool computes the rings frame N+1 needs while the colorizing of
+    frame N (interpolating out of the rings it took a snapshot of) runs on it too, and a writer
+    thread compresses and saves frame N - 1.
+
+    Segments where the center moves get rendered frame by frame (--direct does every frame that
+    way, to compare).
+
+    g++ -O2 -o MBAnimate MBAnimate.cpp -pthread -lz
+    ./MBAnimate --center -0.743643887037158704752191506114774 0.131825904205311970493132056385139 --zoom 1 1e10 --frames 600 --out frames/f
+    ffmpeg -framerate 60 -i frames/f%05d.png zoom.mp4
+*/
+
+const int LOOKUP_BLOCK = 16;      // rows per colorize task, and columns done together (see colorizeFromRings)
+const int WRITE_QUEUE_FRAMES = 2; // colorized frames waiting for the writer before the pipeline waits
+
+struct Keyframe {
+    int frame = 0;
+    BigFixed x, y;
+    double zoom = 1.0;
+    int maxIter = 1000;
+};
+
+struct Options {
+    int width = 1280;
+    int height = 720;
+    std::string path;
+    // Path given on the command line instead: one zoom from the first to the last frame
+    const char* centerX = "-0.5";
+    const char* centerY = "0";
+    double zoomFrom = 1.0;
+    double zoomTo = 1e6;
+    int frames = 300;
+    int iterFrom = 1000;
+    int iterTo = -1; // same as iterFrom
+    int threads = 0; // 0: one per core
+    PaletteScheme scheme = PaletteScheme::Sine;
+    bool perturbation = true;
+    bool direct = false;
+    std::string out;
+};
+
+void printUsage(const char* program) {
+    std::cerr << "usage: " << program << " --out PREFIX|FILE.raw|- [options]\n"
+              << "  --size W H         frame size in pixels (1280 720)\n"
+              << "  --path FILE        keyframes, one per line: frame centerX centerY zoom iterations\n"
+              << "or a single zoom:\n"
+              << "  --center X Y       center, any number of digits (-0.5 0)\n"
+              << "  --zoom FROM TO     zoom of the first and last frame (1 1e6)\n"
+              << "  --frames N         how many frames (300)\n"
+              << "  --iter FROM [TO]   max iterations at the first and last frame (1000)\n"
+              << "and:\n"
+              << "  --palette NAME     sine, fire or gray (sine)\n"
+              << "  --threads N        worker threads (one per core)\n"
+              << "  --double-double    double-double instead of perturbation for deep zooms\n"
+              << "  --direct           compute every frame from scratch instead of through the exponential map\n"
+              << "PREFIX gets PREFIX00000.png, PREFIX00001.png... A .raw file or - (stdout) gets every frame\n"
+              << "as RGBA bytes one after the other, for ffmpeg -f rawvideo -pix_fmt rgba -s WxH -i -" << std::endl;
+}
+
+// False (after saying why) if the command line doesnt make sense
+bool parseOptions(int argc, char** argv, Options& options) {
+    for (int a = 1; a < argc; ++a) {
+        std::string arg = argv[a];
+        // How many values the option takes, checked before anything reads them
+        auto values = [&](int n) {
+            if (a + n < argc) return true;
+            std::cerr << arg << " needs " << n << " value" << (n > 1 ? "s" : "") << std::endl;
+            return false;
+        };
+
+        if (arg == "--size") {
+            if (!values(2)) return false;
+            options.width = std::atoi(argv[++a]);
+            options.height = std::atoi(argv[++a]);
+        } else if (arg == "--path") {
+            if (!values(1)) return false;
+            options.path = argv[++a];
+        } else if (arg == "--center") {
+            if (!values(2)) return false;
+            options.centerX = argv[++a];
+            options.centerY = argv[++a];
+        } else if (arg == "--zoom") {
+            if (!values(2)) return false;
+            options.zoomFrom = std::atof(argv[++a]);
+            options.zoomTo = std::atof(argv[++a]);
+        } else if (arg == "--frames") {
+            if (!values(1)) return false;
+            options.frames = std::atoi(argv[++a]);
+        } else if (arg == "--iter") {
+            if (!values(1)) return false;
+            options.iterFrom = std::atoi(argv[++a]);
+            // The second value is optional
+            if (a + 1 < argc && argv[a + 1][0] != '-') options.iterTo = std::atoi(argv[++a]);
+        } else if (arg == "--palette") {
+            if (!values(1)) return false;
+            std::string name = argv[++a];
+            bool found = false;
+            for (int k = 0; k < PALETTE_SCHEME_COUNT && !found; ++k) {
+                options.scheme = static_cast<PaletteScheme>(k);
+                found = name == paletteSchemeName(options.scheme);
+            }
+            if (!found) {
+                std::cerr << "unknown palette " << name << std::endl;
+                return false;
+            }
+        } else if (arg == "--threads") {
+            if (!values(1)) return false;
+            options.threads = std::atoi(argv[++a]);
+        } else if (arg == "--double-double") {
+            options.perturbation = false;
+        } else if (arg == "--direct") {
+            options.direct = true;
+        } else if (arg == "--out") {
+            if (!values(1)) return false;
+            options.out = argv[++a];
+        } else {
+            std::cerr << "unknown option " << arg << std::endl;
+            return false;
+        }
+    }
+
+    if (options.out.empty()) {
+        std::cerr << "no --out given" << std::endl;
+        return false;
+    }
+    if (options.width <= 0 || options.height <= 0 || options.threads < 0) {
+        std::cerr << "size has to be positive" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+// Keyframes in frame order, from the --path file or the single zoom options. False after saying
+// why if they dont make sense.
+bool loadKeyframes(const Options& options, std::vector<Keyframe>& keys) {
+    if (options.path.empty()) {
+        Keyframe first, last;
+        if (!BigFixed::parse(options.centerX, first.x) || !BigFixed::parse(options.centerY, first.y)) {
+            std::cerr << "center has to be two decimal numbers" << std::endl;
+            return false;
+        }
+        last.x = first.x;
+        last.y = first.y;
+        first.zoom = options.zoomFrom;
+        last.zoom = options.zoomTo;
+        first.maxIter = options.iterFrom;
+        last.maxIter = options.iterTo > 0 ? options.iterTo : options.iterFrom;
+        last.frame = std::max(options.frames - 1, 0);
+        keys = {first, last};
+    } else {
+        std::ifstream file(options.path);
+        if (!file) {
+            std::cerr << "cant read " << options.path << std::endl;
+            return false;
+        }
+        std::string line;
+        for (int number = 1; std::getline(file, line); ++number) {
+            if (line.empty() || line[0] == '#') continue;
+            std::istringstream words(line);
+            std::string x, y;
+            Keyframe key;
+            if (!(words >> key.frame >> x >> y >> key.zoom >> key.maxIter) || !BigFixed::parse(x.c_str(), key.x) ||
+                !BigFixed::parse(y.c_str(), key.y)) {
+                std::cerr << options.path << ":" << number << ": want frame centerX centerY zoom iterations" << std::endl;
+                return false;
+            }
+            keys.push_back(key);
+        }
+        std::stable_sort(keys.begin(), keys.end(), [](const Keyframe& a, const Keyframe& b) { return a.frame < b.frame; });
+    }
+
+    if (keys.empty()) {
+        std::cerr << "no keyframes" << std::endl;
+        return false;
+    }
+    for (size_t k = 0; k < keys.size(); ++k) {
+        if (!(keys[k].zoom > 0.0 && keys[k].zoom <= MAX_ZOOM) || keys[k].maxIter <= 0 || keys[k].frame < 0) {
+            std::cerr << "keyframe zooms have to be between 0 and 1e100, iterations and frame numbers positive" << std::endl;
+            return false;
+        }
+        if (k > 0 && keys[k].frame == keys[k - 1].frame) {
+            std::cerr << "two keyframes for frame " << keys[k].frame << std::endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+// Index of the keyframe the segment holding frame starts at (the last one past the end)
+size_t segmentOf(const std::vector<Keyframe>& keys, int frame) {
+    size_t s = 0;
+    while (s + 2 < keys.size() && keys[s + 1].frame <= frame) ++s;
+    return s;
+}
+
+// True if the segment starting at keyframe s keeps the center in one place
+bool fixedCenter(const std::vector<Keyframe>& keys, size_t s) {
+    return s + 1 >= keys.size() || (keys[s].x == keys[s + 1].x && keys[s].y == keys[s + 1].y);
+}
+
+// Where frame looks: log of the zoom and the iterations go in a straight line between keyframes,
+// and so does the center (if it moves at all)
+View frameView(const std::vector<Keyframe>& keys, int frame, int width, int height) {
+    size_t s = segmentOf(keys, frame);
+    const Keyframe& a = keys[s];
+    const Keyframe& b = keys[std::min(s + 1, keys.size() - 1)];
+    double t = b.frame > a.frame ? std::min(std::max(static_cast<double>(frame - a.frame) / (b.frame - a.frame), 0.0), 1.0) : 0.0;
+
+    View view;
+    view.width = width;
+    view.height = height;
+    view.zoom = std::exp(std::log(a.zoom) + t * (std::log(b.zoom) - std::log(a.zoom)));
+    view.maxIter = static_cast<int>(std::lround(a.maxIter + t * (b.maxIter - a.maxIter)));
+    if (fixedCenter(keys, s)) {
+        view.setCenter(a.x, a.y);
+    } else {
+        BigFixed tt(t);
+        view.setCenter(a.x + (b.x - a.x) * tt, a.y + (b.y - a.y) * tt);
+    }
+    return view;
+}
+
+// Iterations for a view at zoom in the segment starting at keyframe s, the same straight line in
+// log zoom frameView uses
+int iterationsAt(const std::vector<Keyframe>& keys, size_t s, double zoom) {
+    const Keyframe& a = keys[s];
+    const Keyframe& b = keys[std::min(s + 1, keys.size() - 1)];
+    if (a.zoom == b.zoom) return std::max(a.maxIter, b.maxIter);
+    double t = std::min(std::max((std::log(zoom) - std::log(a.zoom)) / (std::log(b.zoom) - std::log(a.zoom)), 0.0), 1.0);
+    return static_cast<int>(std::lround(a.maxIter + t * (b.maxIter - a.maxIter)));
+}
+
+using Ring = std::vector<uint32_t>;
+
+// Rings k .. k + rings.size() - 1 of an exponential map, as they were when a frame started. Keeps
+// them alive while that frame colorizes, whatever the map drops in the meantime.
+struct RingSnapshot {
+    int first = 0;
+    std::vector<std::shared_ptr<const Ring>> rings;
+};
+
+/*
+    Rings around one center, see the top of the file. A ring is perimeter() counts going round
+    clockwise from the top left corner: the top side left to right (width points), the right side
+    downwards (height), the bottom right to left (width), the left side upwards (height). Each
+    side leaves out the corner it ends on, since that is where the next one starts.
+*/
+class ExpMap {
+public:
+    ExpMap(const View& frame, const RenderSettings& settings)
+        : base(frame), settings(settings), ringStep(2.0 / std::max(frame.width, frame.height)),
+          // Pixels get to about one pixel from the center before the rings run out
+          span(static_cast<int>(std::ceil(std::log(std::max(frame.width, frame.height) / 2.0) / ringStep)) + 1) {}
+
+    int perimeter() const { return 2 * (base.width + base.height); }
+    double step() const { return ringStep; }
+    // Rings a frame spans beyond the one at its border
+    int ringSpan() const { return span; }
+    bool centeredOn(const View& view) const { return view.centerX == base.centerX && view.centerY == base.centerY; }
+
+    // Ring index (not rounded) that is exactly the border of a frame at zoom
+    double outerRing(double zoom) const { return std::log(zoom / base.zoom) / ringStep; }
+
+    double ringZoom(int k) const { return base.zoom * std::exp(k * ringStep); }
+
+    // The frame ring k is the border of, at maxIter iterations
+    View ringView(int k, int maxIter) const {
+        View view = base;
+        view.zoom = ringZoom(k);
+        view.maxIter = maxIter;
+        return view;
+    }
+
+    // Makes sure rings first .. last are there, computing the missing ones at maxIter (on the
+    // pool) and dropping the ones outside. Returns how many points it computed.
+    uint64_t update(ThreadPool& pool, int first, int last, int maxIter) {
+        while (!rings.empty() && firstRing < first) {
+            rings.pop_front();
+            ++firstRing;
+        }
+        while (!rings.empty() && firstRing + static_cast<int>(rings.size()) - 1 > last) rings.pop_back();
+        if (rings.empty()) firstRing = first;
+
+        // What is missing at the outside and at the inside
+        std::vector<int> missing;
+        for (int k = first; k < firstRing; ++k) missing.push_back(k);
+        for (int k = firstRing + static_cast<int>(rings.size()); k <= last; ++k) missing.push_back(k);
+        if (missing.empty()) return 0;
+
+        auto [lowest, highest] = std::minmax_element(missing.begin(), missing.end());
+        // Precision has to be good enough for the deepest of them, which is good enough for the
+        // rest. Perturbation needs its series checked against the widest one though: a skip that
+        // holds for the inner rings can be off for pixels further out.
+        FrameKernel iterate = iterateFor(ringView(*highest, maxIter), settings);
+        if (iterate.perturbed) iterate.reference = referenceFor(ringView(*lowest, maxIter));
+
+        std::vector<std::shared_ptr<Ring>> computed(missing.size());
+        for (auto& ring : computed) ring = std::make_shared<Ring>(static_cast<size_t>(perimeter()));
+        int w = base.width, h = base.height;
+
+        pool.parallelFor(static_cast<int>(missing.size()) * 4, [&](int task) {
+            View view = ringView(missing[task / 4], maxIter);
+            uint32_t* out = computed[task / 4]->data();
+            switch (task % 4) {
+                case 0: iterate(view, 0, 0, 0, 1, w, out); break;
+                case 1: iterate(view, 0, w, 1, 0, h, out + w); break;
+                case 2: iterate(view, h, w, 0, -1, w, out + w + h); break;
+                case 3: iterate(view, h, 0, -1, 0, h, out + 2 * w + h); break;
+            }
+        });
+
+        // Outside ones go on the front, innermost of them first, inside ones on the back
+        for (size_t m = missing.size(); m-- > 0;) {
+            if (missing[m] < firstRing) rings.push_front(computed[m]);
+        }
+        for (size_t m = 0; m < missing.size(); ++m) {
+            if (missing[m] >= firstRing) rings.push_back(computed[m]);
+        }
+        firstRing = std::min(firstRing, first);
+        return static_cast<uint64_t>(missing.size()) * perimeter();
+    }
+
+    RingSnapshot snapshot() const {
+        RingSnapshot shot;
+        shot.first = firstRing;
+        shot.rings.assign(rings.begin(), rings.end());
+        return shot;
+    }
+
+private:
+    View base; // center, frame size, and the zoom ring 0 is the border of
+    RenderSettings settings;
+    double ringStep;
+    int span;
+    int firstRing = 0;
+    std::deque<std::shared_ptr<const Ring>> rings;
+};
+
+// Where every pixel of a frame lands in the map, the same for every frame of that size: how many
+// rings in from the frame's border (in 256ths of a ring), and where along the perimeter (the
+// point before it, the one after it, and how far between the two in 256ths). Worked out once so
+// colorizing a frame is nothing but lookups.
+struct RingLookup {
+    std::vector<int> depth;
+    std::vector<int> before, after;
+    std::vector<uint8_t> between;
+
+    RingLookup(int width, int height, double ringStep, int span)
+        : depth(static_cast<size_t>(width) * height), before(depth.size()), after(depth.size()), between(depth.size()) {
+        int perimeter = 2 * (width + height);
+        double halfW = width / 2.0, halfH = height / 2.0;
+        for (int i = 0; i < height; ++i) {
+            for (int j = 0; j < width; ++j) {
+                // Pixel as a fraction of the frame's half size, so the border is at 1
+                double u = (j - halfW) / halfW;
+                double v = (i - halfH) / halfH;
+                bool vertical = std::abs(v) >= std::abs(u); // on the top or bottom side
+                double rho = vertical ? std::abs(v) : std::abs(u);
+                size_t at = static_cast<size_t>(i) * width + j;
+                double rings = rho > 0.0 ? std::min(-std::log(rho) / ringStep, span - 1.0) : span - 1.0;
+                depth[at] = static_cast<int>(rings * 256.0);
+                if (rho == 0.0) continue;
+                // Same point scaled out onto the ring, then how far round it is
+                u /= rho;
+                v /= rho;
+                double t;
+                if (vertical && v < 0.0) {
+                    t = (u + 1.0) / 2.0 * width;
+                } else if (!vertical && u > 0.0) {
+                    t = width + (v + 1.0) / 2.0 * height;
+                } else if (vertical) {
+                    t = width + height + (1.0 - u) / 2.0 * width;
+                } else {
+                    t = 2.0 * width + height + (1.0 - v) / 2.0 * height;
+                }
+                int t0 = std::min(static_cast<int>(t), perimeter - 1);
+                before[at] = t0;
+                after[at] = t0 + 1 == perimeter ? 0 : t0 + 1;
+                between[at] = static_cast<uint8_t>(std::min((t - t0) * 256.0, 255.0));
+            }
+        }
+    }
+};
+
+// a and b mixed a * (256 - f) + b * f, per channel
+inline uint32_t mix(uint32_t a, uint32_t b, uint32_t f) {
+    const uint32_t low = 0x00FF00FF;
+    uint32_t lo = ((a & low) * (256 - f) + (b & low) * f) >> 8;
+    uint32_t hi = (((a >> 8) & low) * (256 - f) + ((b >> 8) & low) * f) >> 8;
+    return (lo & low) | ((hi & low) << 8);
+}
+
+// Colors rows first .. last of frame out of the snapshot, outer being the frame's border ring:
+// bilinear between the two rings around each pixel and the two points either side of it on them
+void colorizeFromRings(const RingSnapshot& shot, const RingLookup& lookup, double outer, int width, const Palette& palette,
+                       int first, int last, uint32_t* pixels) {
+    uint32_t top = static_cast<uint32_t>(palette.maxIter);
+    const uint32_t* lut = palette.colors.data();
+    auto color = [&](const uint32_t* ring, int t) { return lut[ring[t] < top ? ring[t] : top]; };
+    int lastRing = static_cast<int>(shot.rings.size()) - 1;
+    std::vector<const uint32_t*> rings(shot.rings.size());
+    for (size_t k = 0; k < rings.size(); ++k) rings[k] = shot.rings[k]->data();
+    // Ring index relative to the snapshot is whole + (fraction + depth) / 256
+    int whole = static_cast<int>(std::floor(outer)) - shot.first;
+    int fraction = static_cast<int>((outer - std::floor(outer)) * 256.0);
+
+    // A few columns at a time rather than whole rows: on the left and right of the frame every
+    // pixel along a row is another ring, and whole rows would go through all of them (megabytes)
+    // before coming back to the first
+    for (int left = 0; left < width; left += LOOKUP_BLOCK) {
+        int right = std::min(left + LOOKUP_BLOCK, width);
+        for (int i = first; i < last; ++i) {
+            for (int j = left; j < right; ++j) {
+                size_t at = static_cast<size_t>(i) * width + j;
+                int k = fraction + lookup.depth[at];
+                uint32_t fk = static_cast<uint32_t>(k & 255);
+                const uint32_t* a = rings[std::min(whole + (k >> 8), lastRing)];
+                const uint32_t* b = rings[std::min(whole + (k >> 8) + 1, lastRing)];
+
+                int t0 = lookup.before[at], t1 = lookup.after[at];
+                uint32_t ft = lookup.between[at];
+                pixels[at] = mix(mix(color(a, t0), color(a, t1), ft), mix(color(b, t0), color(b, t1), ft), fk);
+            }
+        }
+    }
+}
+
+// Saves finished frames on its own thread, so compressing one overlaps with computing the next.
+// Holds at most WRITE_QUEUE_FRAMES, after that put waits for the writer to catch up.
+class FrameWriter {
+public:
+    FrameWriter(const std::string& out, int width, int height) : out(out), width(width), height(height) {
+        bool stream = out == "-" || (out.size() >= 4 && out.compare(out.size() - 4, 4, ".raw") == 0);
+        if (stream) {
+            FILE* file = out == "-" ? stdout : std::fopen(out.c_str(), "wb");
+            if (file) raw.reset(new RawWriter(file, width));
+            ok = raw != nullptr;
+        }
+        thread = std::thread(&FrameWriter::run, this);
+    }
+
+    ~FrameWriter() { finish(); }
+
+    // False once a frame couldnt be written (or the output couldnt be opened)
+    bool good() const { return ok; }
+
+    void put(int frame, std::vector<uint32_t> pixels) {
+        std::unique_lock<std::mutex> lock(m);
+        roomCv.wait(lock, [&] { return queue.size() < WRITE_QUEUE_FRAMES; });
+        queue.push_back({frame, std::move(pixels)});
+        queueCv.notify_one();
+    }
+
+    // Writes whatever is still queued, false if any frame couldnt be written
+    bool finish() {
+        {
+            std::lock_guard<std::mutex> lock(m);
+            stopping = true;
+        }
+        queueCv.notify_one();
+        if (thread.joinable()) thread.join();
+        if (raw) {
+            ok = raw->finish() && ok;
+            raw.reset();
+        }
+        return ok;
+    }
+
+private:
+    struct Pending {
+        int frame;
+        std::vector<uint32_t> pixels;
+    };
+
+    void run() {
+        while (true) {
+            Pending next;
+            {
+                std::unique_lock<std::mutex> lock(m);
+                queueCv.wait(lock, [&] { return stopping || !queue.empty(); });
+                if (queue.empty()) return;
+                next = std::move(queue.front());
+                queue.pop_front();
+            }
+            roomCv.notify_one();
+            if (!ok) continue;
+
+            if (raw) {
+                ok = raw->writeRows(next.pixels.data(), height, width * 4);
+                if (!ok) std::cerr << "writing " << out << " failed" << std::endl;
+            } else {
+                char name[16];
+                std::snprintf(name, sizeof(name), "%05d.png", next.frame);
+                std::string path = out + name;
+                auto writer = openImageWriter(path, width, height);
+                ok = writer && writer->writeRows(next.pixels.data(), height, width * 4) && writer->finish();
+                if (!ok) std::cerr << "writing " << path << " failed" << std::endl;
+            }
+        }
+    }
+
+    std::string out;
+    int width, height;
+    std::unique_ptr<ImageWriter> raw; // every frame into one file
+    std::atomic<bool> ok{true};
+    std::deque<Pending> queue;
+    std::mutex m;
+    std::condition_variable queueCv, roomCv;
+    bool stopping = false;
+    std::thread thread;
+};
+
+int main(int argc, char** argv) {
+    Options options;
+    std::vector<Keyframe> keys;
+    if (!parseOptions(argc, argv, options) || !loadKeyframes(options, keys)) {
+        printUsage(argv[0]);
+        return 1;
+    }
+    int width = options.width, height = options.height;
+    int frames = keys.back().frame + 1;
+
+    RenderSettings settings;
+    settings.perturbation = options.perturbation;
+
+    int threads = options.threads > 0 ? options.threads : std::max(1u, std::thread::hardware_concurrency());
+    // The main thread helps out in parallelFor
+    ThreadPool pool(threads - 1);
+    FrameWriter writer(options.out, width, height);
+    if (!writer.good()) {
+        std::cerr << "cant create " << options.out << std::endl;
+        return 1;
+    }
+
+    // Everything that goes out to the writer is a frame being colorized on the pool right now
+    struct InFlight {
+        int frame = -1;
+        std::shared_ptr<ThreadPool::Job> job;
+        std::vector<uint32_t> pixels;
+        RingSnapshot rings;        // exponential map frames
+        IterationBuffer iters;     // direct ones
+        Palette palette;
+    };
+    InFlight current;
+    std::unique_ptr<ExpMap> map;
+    std::unique_ptr<RingLookup> lookup;
+    uint64_t computed = 0;
+
+    // Progress goes to stderr, stdout may be the video
+    std::cerr << "Rendering " << frames << " frames of " << width << "x" << height << " with the " << activeKernel().name
+              << " kernel on " << threads << " threads" << std::endl;
+
+    // Waits for the frame in flight and hands it to the writer
+    auto retire = [&]() {
+        if (current.frame < 0) return;
+        pool.wait(current.job);
+        writer.put(current.frame, std::move(current.pixels));
+        current.frame = -1;
+    };
+
+    ColorizeFn colorizeRun = activeColorize();
+    for (int frame = 0; frame < frames && writer.good(); ++frame) {
+        View view = frameView(keys, frame, width, height);
+        size_t segment = segmentOf(keys, frame);
+
+        InFlight next;
+        next.frame = frame;
+        next.pixels.resize(static_cast<size_t>(width) * height);
+        next.palette.scheme = options.scheme;
+        next.palette.update(view.maxIter);
+
+        if (!options.direct && fixedCenter(keys, segment)) {
+            // The last frame only holds on to its snapshot, so the map can go. The lookup only
+            // depends on the frame size and stays.
+            if (!map || !map->centeredOn(view)) map.reset(new ExpMap(view, settings));
+            if (!lookup) lookup.reset(new RingLookup(width, height, map->step(), map->ringSpan()));
+            // Rings from the frame's border down to the middle, while the last frame colorizes
+            double outer = map->outerRing(view.zoom);
+            int first = static_cast<int>(std::floor(outer));
+            int last = first + map->ringSpan() + 1;
+            computed += map->update(pool, first, last, iterationsAt(keys, segment, map->ringZoom(last)));
+            retire();
+
+            next.rings = map->snapshot();
+            current = std::move(next);
+            InFlight* f = &current;
+            RingLookup* table = lookup.get();
+            int blocks = (height + LOOKUP_BLOCK - 1) / LOOKUP_BLOCK;
+            current.job = pool.submit(blocks, [=](int block) {
+                colorizeFromRings(f->rings, *table, outer, width, f->palette, block * LOOKUP_BLOCK,
+                                  std::min((block + 1) * LOOKUP_BLOCK, height), f->pixels.data());
+            });
+        } else {
+            renderFrame(pool, settings, view, next.iters);
+            computed += static_cast<uint64_t>(width) * height;
+            retire();
+            current = std::move(next);
+            InFlight* f = &current;
+            int bands = (height + BAND_ROWS - 1) / BAND_ROWS;
+            current.job = pool.submit(bands, [=](int band) {
+                for (int i = band * BAND_ROWS; i < std::min((band + 1) * BAND_ROWS, height); ++i) {
+                    colorizeRun(f->iters.row(i), width, f->palette.colors.data(), f->palette.maxIter, f->pixels.data() + static_cast<size_t>(i) * width);
+                }
+            });
+        }
+
+        if (frame % 10 == 0) std::cerr << "\rframe " << frame << " / " << frames << std::flush;
+    }
+    retire();
+
+    if (!writer.finish()) {
+        std::cerr << "\nwriting " << options.out << " failed" << std::endl;
+        return 1;
+    }
+    double pixels = static_cast<double>(width) * height * frames;
+    std::cerr << "\rWrote " << frames << " frames, computed " << computed << " points for " << static_cast<uint64_t>(pixels)
+              << " pixels (" << computed / pixels << " per pixel)" << std::endl;
+    return 0;
+}
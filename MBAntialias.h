@@ -0,0 +1,117 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <vector>
+#include "MBPalette.h"
+#include "MBRender.h"
+
+/*
+    Adaptive supersampling. Rendering 4x4 times the pixels and scaling down costs 16 times the
+    work everywhere, but almost all of a picture is smooth bands where every sample of a pixel
+    comes out the same color anyway. Only pixels the boundary of the set runs through actually
+    alias, so only those get the extra samples:
+        - a neighbour's count has a color more than AA_COLOR_STEP away in any channel (or one is
+          inside and the other isnt), the boundary or a filament passes between the two. Going
+          by the colors rather than the counts themselves, since deep down neighbours are dozens
+          of counts apart that all look the same with the palette spread over maxIter.
+        - with distance estimates (see iterateRunSmooth), the set is closer than
+          AA_DISTANCE_PIXELS. That catches filaments thin enough to slip between the pixel
+          centers, which the counts alone never see.
+    Flagged pixels next to each other are one row of samples per sub row, so the kernels still
+    get long runs to fill their lanes with.
+*/
+
+const int AA_COLOR_STEP = 16;
+const double AA_DISTANCE_PIXELS = 1.0;
+const int AA_MAX_SAMPLES = 8; // per axis, 64 samples per pixel is way past where anyone can tell
+
+// Largest difference between the channels of two colors
+inline int colorStep(uint32_t a, uint32_t b) {
+    int step = 0;
+    for (int shift = 0; shift < 32; shift += 8) {
+        step = std::max(step, std::abs(static_cast<int>((a >> shift) & 0xFF) - static_cast<int>((b >> shift) & 0xFF)));
+    }
+    return step;
+}
+
+// Whether pixel j of row needs more than one sample. above / below are the rows around it,
+// nullptr at the top and bottom of the image. distance is row's distance estimates or nullptr,
+// and distanceLimit the closest the set can be without flagging, both in the units of x and y.
+inline bool needsSupersampling(const uint32_t* above, const uint32_t* row, const uint32_t* below, const float* distance,
+                               double distanceLimit, int j, int width, const Palette& palette) {
+    uint32_t maxIter = static_cast<uint32_t>(palette.maxIter);
+    uint32_t n = std::min(row[j], maxIter);
+    auto differs = [&](uint32_t other) {
+        other = std::min(other, maxIter);
+        return ((n == maxIter) != (other == maxIter)) || colorStep(palette.colors[n], palette.colors[other]) > AA_COLOR_STEP;
+    };
+    if (j > 0 && differs(row[j - 1])) return true;
+    if (j + 1 < width && differs(row[j + 1])) return true;
+    if (above && differs(above[j])) return true;
+    if (below && differs(below[j])) return true;
+    return distance && distance[j] > 0.0f && distance[j] < distanceLimit;
+}
+
+// Redoes the pixels of row i that need it (see needsSupersampling) with samples x samples points
+// each, spread evenly over the pixel, and puts the average of their colors in pixels. sampler has
+// to be good for samples times the view's resolution (iterateFor on a view that much bigger).
+// smooth colors the samples by their smooth counts like colorizeSmooth does. Returns how many
+// pixels got redone.
+inline int antialiasRow(const FrameKernel& sampler, const View& view, int i, const uint32_t* above, const uint32_t* row,
+                        const uint32_t* below, const float* distance, const Palette& palette, bool smooth, int samples, uint32_t* pixels) {
+    int width = view.width;
+    double distanceLimit = AA_DISTANCE_PIXELS * std::min(view.stepX(), view.stepY());
+
+    std::vector<char> flagged(width);
+    for (int j = 0; j < width; ++j) flagged[j] = needsSupersampling(above, row, below, distance, distanceLimit, j, width, palette);
+
+    std::vector<uint32_t> counts, colors, sums;
+    std::vector<float> smoothCounts, distances;
+    double step = 1.0 / samples;
+    double first = step / 2 - 0.5; // offset of the first sample from the pixel center
+    int redone = 0;
+
+    for (int j = 0; j < width;) {
+        if (!flagged[j]) {
+            ++j;
+            continue;
+        }
+        int end = j;
+        while (end < width && flagged[end]) ++end;
+        int span = end - j;
+        int points = span * samples;
+
+        counts.resize(points);
+        colors.resize(points);
+        smoothCounts.resize(points);
+        distances.resize(points);
+        sums.assign(static_cast<size_t>(span) * 4, 0);
+
+        for (int s = 0; s < samples; ++s) {
+            double y = i + first + s * step;
+            if (smooth) {
+                sampler(view, y, j + first, 0, step, points, counts.data(), smoothCounts.data(), distances.data());
+                colorizeSmooth(smoothCounts.data(), points, palette.colors.data(), palette.maxIter, colors.data());
+            } else {
+                sampler(view, y, j + first, 0, step, points, counts.data());
+                colorizeScalar(counts.data(), points, palette.colors.data(), palette.maxIter, colors.data());
+            }
+            for (int k = 0; k < points; ++k) {
+                uint32_t* sum = &sums[static_cast<size_t>(k / samples) * 4];
+                for (int c = 0; c < 4; ++c) sum[c] += (colors[k] >> (8 * c)) & 0xFF;
+            }
+        }
+
+        uint32_t total = static_cast<uint32_t>(samples * samples);
+        for (int q = 0; q < span; ++q) {
+            uint32_t blended = 0;
+            for (int c = 0; c < 4; ++c) blended |= ((sums[static_cast<size_t>(q) * 4 + c] + total / 2) / total) << (8 * c);
+            pixels[j + q] = blended;
+        }
+        redone += span;
+        j = end;
+    }
+    return redone;
+}
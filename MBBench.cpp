@@ -0,0 +1,328 @@
+#include <algorithm>
+#include <chrono>
+#include <complex>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+#include "MBBigFixed.h"
+#include "MBKernels.h"
+#include "MBPerturbation.h"
+#include "MBRender.h"
+#include "MBThreadPool.h"
+
+/*
+    Benchmarks every kernel over a fixed set of views, headless, and prints the results as JSON
+    so runs can be compared against each other (and regressions caught).
+
+    For each view it times:
+      - naive: the very first version, std::complex one pixel at a time with no shortcuts. This
+        is what the "66x" in the README is against.
+      - every kernel this cpu can run, in each precision / flavour that makes sense at that zoom,
+        on one thread. The plain and interleaved ones also with Mariani-Silver (the -ms variants).
+      - the automatic pick (what MBThreads would use) on 1, 2, 4 ... all hardware threads
+
+    Each run repeats the frame until it has taken at least --min-time seconds and MIN_FRAMES
+    frames (or SLOW_RUN_FACTOR times --min-time, whichever comes first), then reports frame time
+    percentiles, Mpixels/s and iterations/s. Iterations are the counts the frame ends up with, so
+    pixels cut short by the cardioid check or cycle detection count as the iterations they stand for.
+
+    Before any of that it checks the series approximation against coefficients worked out by hand,
+    since a wrong series still renders fine and only shows up as a smaller skip.
+
+    g++ -O2 -o MBBench MBBench.cpp -pthread
+    ./MBBench > bench.json
+    ./MBBench --view deep-minibrot --kernel avx2 > deep.json     (only some of it)
+*/
+
+const int MIN_FRAMES = 3;
+const int MAX_FRAMES = 1000;
+const double SLOW_RUN_FACTOR = 5.0; // frames slower than this still count as a run after 1 or 2 of them
+
+struct BenchView {
+    const char* name;
+    const char* centerX;
+    const char* centerY;
+    double zoom;
+    int maxIter;
+};
+
+const BenchView BENCH_VIEWS[] = {
+    {"full-set", "-0.5", "0", 1.0, 1000},
+    {"seahorse-valley", "-0.7453", "0.1127", 650.0, 2000},
+    {"deep-minibrot", "-0.743643887037158704752191506114774", "0.131825904205311970493132056385139", 1e14, 5000},
+    {"all-interior", "-0.1225611668766536", "0.7448617666197442", 100.0, 1000}, // inside the period 3 bulb
+};
+
+struct Options {
+    int width = 800;
+    int height = 600;
+    double minTime = 0.5;
+    int maxThreads = 0; // 0: all of them
+    std::vector<std::string> views;   // empty: all of them
+    std::vector<std::string> kernels; // same, "naive" counts as a kernel here
+};
+
+bool wanted(const std::vector<std::string>& filter, const std::string& name) {
+    return filter.empty() || std::find(filter.begin(), filter.end(), name) != filter.end();
+}
+
+struct RunResult {
+    std::string view;
+    std::string kernel;
+    std::string variant;
+    int threads;
+    std::vector<double> frameMs; // sorted
+    double pixels;
+    double iterations;
+};
+
+// The original per pixel loop, kept exactly that simple on purpose
+int naiveMandelbrot(std::complex<double> c, int maxIter) {
+    std::complex<double> z = 0;
+    int iter = 0;
+    while (std::norm(z) <= 4.0 && iter < maxIter) {
+        z = z * z + c;
+        iter++;
+    }
+    return iter;
+}
+
+void renderNaive(const View& view, IterationBuffer& iters) {
+    for (int i = 0; i < view.height; ++i) {
+        for (int j = 0; j < view.width; ++j) {
+            iters.at(i, j) = naiveMandelbrot({view.pixelX(j), view.pixelY(i)}, view.maxIter);
+        }
+    }
+}
+
+// Whole frame with one particular kernel, bands of rows on the pool
+void renderWith(ThreadPool& pool, const FrameKernel& iterate, const View& view, IterationBuffer& iters) {
+    int bands = (view.height + BAND_ROWS - 1) / BAND_ROWS;
+    pool.parallelFor(bands, [&](int band) {
+        for (int i = band * BAND_ROWS; i < std::min((band + 1) * BAND_ROWS, view.height); ++i) {
+            computeRow(iterate, view, i, 0, view.width, iters.row(i));
+        }
+    });
+}
+
+// Same with Mariani-Silver, whose borders and small tiles hand the kernel lots of short runs
+void renderMarianiSilverWith(ThreadPool& pool, const FrameKernel& iterate, const View& view, IterationBuffer& iters) {
+    mandelbrotMarianiSilver(pool, iterate, view, iters, {0, 0, view.height, view.width});
+}
+
+/*
+    From z_0 = 0 and dz_0 = 0, two steps of dz_n+1 = 2 Z_n dz_n + dz_n^2 + dc give
+        dz_1 = dc,    dz_2 = (2c + 1) dc + dc^2
+    and a third adds 2 (2c + 1) dc^3. computeSeries scales dc by the view radius r, so after n
+    steps its terms should be A_k r^k. Returns false (and says what is off) if they arent.
+*/
+bool checkSeries() {
+    std::complex<double> c(-0.1, 0.65);
+    double radiusX = 1e-6, radiusY = 7.5e-7;
+    double r = std::hypot(radiusX, radiusY);
+    std::complex<double> a1 = 2.0 * c + 1.0;
+    struct Expected {
+        int steps, term;
+        std::complex<double> value;
+    };
+    const Expected expected[] = {
+        {2, 0, a1 * r}, {2, 1, r * r}, {2, 2, 0.0}, {3, 2, 2.0 * a1 * r * r * r},
+    };
+
+    bool ok = true;
+    for (const Expected& e : expected) {
+        BigFixed cx, cy;
+        BigFixed::parse("-0.1", cx);
+        BigFixed::parse("0.65", cy);
+        // One Z past the last step, the series never skips all the way to the end of the orbit
+        ReferenceOrbit ref = computeReferenceOrbit(cx, cy, e.steps + 1);
+        computeSeries(ref, radiusX, radiusY);
+        std::complex<double> term(ref.seriesRe[e.term], ref.seriesIm[e.term]);
+        double scale = std::pow(r, e.term + 1);
+        if (ref.skip != e.steps || std::abs(term - e.value) > 1e-12 * scale) {
+            std::cerr << "series check failed: A" << e.term + 1 << " after " << e.steps << " steps is " << term / scale << " (skip "
+                      << ref.skip << "), should be " << e.value / scale << std::endl;
+            ok = false;
+        }
+    }
+    return ok;
+}
+
+// Runs frame() until minTime has passed, in milliseconds per frame
+template <typename Frame>
+std::vector<double> timeFrames(double minTime, Frame frame) {
+    // Warm up run: first touch of the buffers, reference orbit, palette... none of that is the kernel
+    frame();
+
+    using Clock = std::chrono::steady_clock;
+    std::vector<double> times;
+    Clock::time_point start = Clock::now();
+    while (static_cast<int>(times.size()) < MAX_FRAMES) {
+        Clock::time_point before = Clock::now();
+        frame();
+        times.push_back(std::chrono::duration<double, std::milli>(Clock::now() - before).count());
+
+        double elapsed = std::chrono::duration<double>(Clock::now() - start).count();
+        bool enoughFrames = static_cast<int>(times.size()) >= MIN_FRAMES || elapsed >= SLOW_RUN_FACTOR * minTime;
+        if (enoughFrames && elapsed >= minTime) break;
+    }
+    std::sort(times.begin(), times.end());
+    return times;
+}
+
+double percentile(const std::vector<double>& sorted, double p) {
+    size_t rank = static_cast<size_t>(std::ceil(p / 100.0 * sorted.size()));
+    return sorted[std::min(std::max(rank, size_t(1)), sorted.size()) - 1];
+}
+
+double totalIterations(const IterationBuffer& iters) {
+    double sum = 0;
+    for (uint32_t count : iters.counts) sum += count;
+    return sum;
+}
+
+void printRun(FILE* out, const RunResult& run, double naiveMs, bool last) {
+    double totalMs = 0;
+    for (double t : run.frameMs) totalMs += t;
+    double meanMs = totalMs / run.frameMs.size();
+    double p50 = percentile(run.frameMs, 50);
+
+    std::fprintf(out, "    {\"view\": \"%s\", \"kernel\": \"%s\", \"variant\": \"%s\", \"threads\": %d, \"frames\": %zu,\n",
+                 run.view.c_str(), run.kernel.c_str(), run.variant.c_str(), run.threads, run.frameMs.size());
+    std::fprintf(out, "     \"mpixels_per_s\": %.3f, \"iterations_per_s\": %.4g,\n", run.pixels / (p50 * 1e3), run.iterations / (p50 * 1e-3));
+    std::fprintf(out, "     \"frame_ms\": {\"min\": %.3f, \"p50\": %.3f, \"p90\": %.3f, \"p99\": %.3f, \"mean\": %.3f}",
+                 run.frameMs.front(), p50, percentile(run.frameMs, 90), percentile(run.frameMs, 99), meanMs);
+    if (naiveMs > 0) std::fprintf(out, ",\n     \"speedup_vs_naive\": %.2f", naiveMs / p50);
+    std::fprintf(out, "}%s\n", last ? "" : ",");
+}
+
+bool parseOptions(int argc, char** argv, Options& options) {
+    for (int a = 1; a < argc; ++a) {
+        std::string arg = argv[a];
+        if (arg == "--size" && a + 2 < argc) {
+            options.width = std::atoi(argv[++a]);
+            options.height = std::atoi(argv[++a]);
+        } else if (arg == "--min-time" && a + 1 < argc) {
+            options.minTime = std::atof(argv[++a]);
+        } else if (arg == "--max-threads" && a + 1 < argc) {
+            options.maxThreads = std::atoi(argv[++a]);
+        } else if (arg == "--view" && a + 1 < argc) {
+            options.views.push_back(argv[++a]);
+        } else if (arg == "--kernel" && a + 1 < argc) {
+            options.kernels.push_back(argv[++a]);
+        } else {
+            std::cerr << "usage: " << argv[0] << " [--size W H] [--min-time SECONDS] [--max-threads N] [--view NAME] [--kernel NAME] > results.json\n"
+                      << "views: full-set seahorse-valley deep-minibrot all-interior, kernels: naive and the simd ones" << std::endl;
+            return false;
+        }
+    }
+    return options.width > 0 && options.height > 0 && options.maxThreads >= 0;
+}
+
+int main(int argc, char** argv) {
+    Options options;
+    if (!parseOptions(argc, argv, options)) return 1;
+    if (!checkSeries()) return 1;
+
+    int hardwareThreads = std::max(1u, std::thread::hardware_concurrency());
+    int maxThreads = options.maxThreads > 0 ? options.maxThreads : hardwareThreads;
+
+    // A pool of n - 1 workers plus the calling thread, which always helps out, is n threads
+    ThreadPool single(0);
+    std::vector<RunResult> runs;
+    std::vector<double> naiveMs;
+
+    for (const BenchView& bench : BENCH_VIEWS) {
+        if (!wanted(options.views, bench.name)) continue;
+
+        View view;
+        view.width = options.width;
+        view.height = options.height;
+        view.zoom = bench.zoom;
+        view.maxIter = bench.maxIter;
+        BigFixed centerX, centerY;
+        BigFixed::parse(bench.centerX, centerX);
+        BigFixed::parse(bench.centerY, centerY);
+        view.setCenter(centerX, centerY);
+
+        IterationBuffer iters;
+        iters.resize(view.width, view.height);
+        double pixels = static_cast<double>(view.width) * view.height;
+        bool deep = isDeep(view);
+
+        auto record = [&](const char* kernel, const std::string& variant, int threads, std::vector<double> times) {
+            std::cerr << bench.name << " " << kernel << " " << variant << " x" << threads << ": " << times[times.size() / 2] << " ms" << std::endl;
+            runs.push_back({bench.name, kernel, variant, threads, std::move(times), pixels, totalIterations(iters)});
+            naiveMs.push_back(-1);
+        };
+
+        // Doubles cant even resolve the deep view, timing the naive loop there means nothing
+        double naive = -1;
+        if (!deep && wanted(options.kernels, "naive")) {
+            record("naive", "double", 1, timeFrames(options.minTime, [&] { renderNaive(view, iters); }));
+            naive = percentile(runs.back().frameMs, 50);
+        }
+        size_t firstOfView = runs.size();
+
+        for (const Kernel& kernel : allKernels()) {
+            if (!kernelSupported(kernel) || !wanted(options.kernels, kernel.name)) continue;
+
+            std::vector<std::pair<std::string, FrameKernel>> variants;
+            FrameKernel k;
+            if (deep) {
+                k.perturbed = kernel.iteratePerturbed;
+                k.reference = referenceFor(view);
+                variants.emplace_back("perturbation", k);
+                k = FrameKernel();
+                k.doubleDouble = kernel.iterateDoubleDouble;
+                variants.emplace_back("double-double", k);
+            } else {
+                k.iterate = kernel.iterate;
+                variants.emplace_back("double", k);
+                k.iterate = kernel.iterateRefill;
+                variants.emplace_back("double-refill", k);
+                k.iterate = kernel.iterateInterleaved;
+                variants.emplace_back("double-interleaved", k);
+                k.iterate = kernel.iterateFloat;
+                variants.emplace_back("float", k);
+                k.iterate = kernel.iterateFloatRefill;
+                variants.emplace_back("float-refill", k);
+                k.iterate = kernel.iterateFloatInterleaved;
+                variants.emplace_back("float-interleaved", k);
+            }
+
+            for (const auto& variant : variants) {
+                record(kernel.name, variant.first, 1, timeFrames(options.minTime, [&] { renderWith(single, variant.second, view, iters); }));
+            }
+
+            // The plain and interleaved loops again on Mariani-Silver's short runs
+            if (!deep) {
+                for (const auto& variant : variants) {
+                    if (variant.first.find("refill") != std::string::npos) continue;
+                    record(kernel.name, variant.first + "-ms", 1,
+                           timeFrames(options.minTime, [&] { renderMarianiSilverWith(single, variant.second, view, iters); }));
+                }
+            }
+        }
+
+        // Whatever MBThreads would pick for this view, over more and more threads
+        RenderSettings settings;
+        for (int threads = 1; wanted(options.kernels, activeKernel().name); threads = std::min(threads * 2, maxThreads)) {
+            ThreadPool pool(threads - 1);
+            record(activeKernel().name, std::string("auto-") + iterateFor(view, settings).precision, threads,
+                   timeFrames(options.minTime, [&] { renderWith(pool, iterateFor(view, settings), view, iters); }));
+            if (threads == maxThreads) break;
+        }
+
+        for (size_t r = firstOfView; r < runs.size(); ++r) naiveMs[r] = naive;
+    }
+
+    std::printf("{\n  \"size\": [%d, %d],\n  \"active_kernel\": \"%s\",\n  \"hardware_threads\": %d,\n  \"runs\": [\n",
+                options.width, options.height, activeKernel().name, hardwareThreads);
+    for (size_t r = 0; r < runs.size(); ++r) printRun(stdout, runs[r], naiveMs[r], r + 1 == runs.size());
+    std::printf("  ]\n}\n");
+    return 0;
+}
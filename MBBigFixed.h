@@ -0,0 +1,202 @@
+#pragma once
+
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+
+/*
+    Fixed point number with a lot more bits than a double, for the few places that need them:
+    the view center and the perturbation reference orbit once we are zoomed in past what a double
+    can resolve.
+
+    Stored as two's complement in LIMBS 32 bit words, least significant first. The top word is
+    the integer part (so anything in +-2^31 fits), the rest is fraction. 15 fraction words are
+    480 bits, good down to about 1e-144, which leaves plenty of headroom at MAX_ZOOM.
+
+    Nothing clever: schoolbook multiply, no allocation, cheap to copy around inside a View.
+*/
+class BigFixed {
+public:
+    static constexpr int LIMBS = 16;
+    static constexpr int FRACTION_BITS = 32 * (LIMBS - 1);
+    // Past 10^-150 every bit of the fraction is gone, and anything past 10^10 overflows the
+    // integer part anyway. parse turns down exponents beyond this instead of looping over them.
+    static constexpr long MAX_DECIMAL_EXPONENT = 150;
+
+    BigFixed() = default;
+
+    // Exact, every double in range is a finite binary fraction
+    explicit BigFixed(double x) {
+        bool negative = x < 0;
+        x = std::fabs(x);
+
+        double whole = std::floor(x);
+        limbs[LIMBS - 1] = static_cast<uint32_t>(whole);
+        x -= whole;
+        for (int k = LIMBS - 2; k >= 0 && x != 0.0; --k) {
+            x *= 4294967296.0; // 2^32
+            whole = std::floor(x);
+            limbs[k] = static_cast<uint32_t>(whole);
+            x -= whole;
+        }
+
+        if (negative) negateInPlace();
+    }
+
+    // Decimal like "-0.743643887037158704752191506114774" (an exponent like "1.5e-7" is fine too),
+    // keeping every digit instead of going through a double. False if text is not a number, its
+    // integer part does not fit or its exponent is past MAX_DECIMAL_EXPONENT either way.
+    static bool parse(const char* text, BigFixed& out) {
+        const char* p = text;
+        bool negative = *p == '-';
+        if (*p == '-' || *p == '+') ++p;
+
+        uint64_t whole = 0;
+        const char* digits = p;
+        for (; *p >= '0' && *p <= '9'; ++p) {
+            whole = whole * 10 + (*p - '0');
+            if (whole >= 0x80000000u) return false;
+        }
+
+        // Fraction digits from the last one up: f = (digit + f) / 10
+        BigFixed fraction;
+        if (*p == '.') {
+            const char* first = ++p;
+            while (*p >= '0' && *p <= '9') ++p;
+            for (const char* d = p; d-- != first;) {
+                fraction.limbs[LIMBS - 1] = static_cast<uint32_t>(*d - '0');
+                fraction.divideSmall(10);
+            }
+            if (p == first && first - 1 == digits) return false; // just "."
+        } else if (p == digits) {
+            return false;
+        }
+
+        BigFixed result = fraction;
+        result.limbs[LIMBS - 1] = static_cast<uint32_t>(whole);
+
+        if (*p == 'e' || *p == 'E') {
+            char* end;
+            long exponent = std::strtol(p + 1, &end, 10);
+            if (end == p + 1 || exponent > MAX_DECIMAL_EXPONENT || exponent < -MAX_DECIMAL_EXPONENT) return false;
+            p = end;
+            for (; exponent < 0; ++exponent) result.divideSmall(10);
+            for (; exponent > 0; --exponent) {
+                result = result * BigFixed(10.0);
+                if (result.isNegative()) return false;
+            }
+        }
+        if (*p != '\0') return false;
+
+        out = negative ? -result : result;
+        return true;
+    }
+
+    bool isNegative() const { return (limbs[LIMBS - 1] & 0x80000000u) != 0; }
+
+    // Nearest double, more or less (the low words only matter once they are way below an ulp)
+    double toDouble() const {
+        if (isNegative()) return -(-*this).toDouble();
+
+        double result = 0.0;
+        for (int k = 0; k < LIMBS; ++k) {
+            result += std::ldexp(static_cast<double>(limbs[k]), 32 * k - FRACTION_BITS);
+        }
+        return result;
+    }
+
+    // Split into hi + lo doubles for the double-double kernels, about 106 bits worth
+    void toDoubleDouble(double& hi, double& lo) const {
+        hi = toDouble();
+        lo = (*this - BigFixed(hi)).toDouble();
+    }
+
+    // The raw words, least significant first, for saving a value to a file and getting it back bit for bit
+    void toWords(uint32_t* out) const {
+        for (int k = 0; k < LIMBS; ++k) out[k] = limbs[k];
+    }
+    static BigFixed fromWords(const uint32_t* words) {
+        BigFixed result;
+        for (int k = 0; k < LIMBS; ++k) result.limbs[k] = words[k];
+        return result;
+    }
+
+    BigFixed operator-() const {
+        BigFixed result = *this;
+        result.negateInPlace();
+        return result;
+    }
+
+    BigFixed operator+(const BigFixed& other) const {
+        BigFixed result;
+        uint64_t carry = 0;
+        for (int k = 0; k < LIMBS; ++k) {
+            uint64_t sum = static_cast<uint64_t>(limbs[k]) + other.limbs[k] + carry;
+            result.limbs[k] = static_cast<uint32_t>(sum);
+            carry = sum >> 32;
+        }
+        return result;
+    }
+
+    BigFixed operator-(const BigFixed& other) const { return *this + (-other); }
+
+    // Truncates whatever ends up below the last fraction word
+    BigFixed operator*(const BigFixed& other) const {
+        bool negative = isNegative() != other.isNegative();
+        BigFixed a = isNegative() ? -*this : *this;
+        BigFixed b = other.isNegative() ? -other : other;
+
+        // Full 2 * LIMBS word product, then keep the words that line up with our fixed point
+        uint32_t product[2 * LIMBS] = {};
+        for (int i = 0; i < LIMBS; ++i) {
+            if (a.limbs[i] == 0) continue;
+            uint64_t carry = 0;
+            for (int j = 0; j < LIMBS; ++j) {
+                uint64_t t = static_cast<uint64_t>(a.limbs[i]) * b.limbs[j] + product[i + j] + carry;
+                product[i + j] = static_cast<uint32_t>(t);
+                carry = t >> 32;
+            }
+            product[i + LIMBS] = static_cast<uint32_t>(carry);
+        }
+
+        BigFixed result;
+        for (int k = 0; k < LIMBS; ++k) {
+            result.limbs[k] = product[k + LIMBS - 1];
+        }
+        if (negative) result.negateInPlace();
+        return result;
+    }
+
+    BigFixed& operator+=(const BigFixed& other) { return *this = *this + other; }
+    BigFixed& operator-=(const BigFixed& other) { return *this = *this - other; }
+
+    bool operator==(const BigFixed& other) const {
+        for (int k = 0; k < LIMBS; ++k) {
+            if (limbs[k] != other.limbs[k]) return false;
+        }
+        return true;
+    }
+    bool operator!=(const BigFixed& other) const { return !(*this == other); }
+
+private:
+    // Only for non negative values
+    void divideSmall(uint32_t divisor) {
+        uint64_t remainder = 0;
+        for (int k = LIMBS - 1; k >= 0; --k) {
+            uint64_t current = (remainder << 32) | limbs[k];
+            limbs[k] = static_cast<uint32_t>(current / divisor);
+            remainder = current % divisor;
+        }
+    }
+
+    void negateInPlace() {
+        uint64_t carry = 1;
+        for (int k = 0; k < LIMBS; ++k) {
+            uint64_t sum = static_cast<uint64_t>(~limbs[k]) + carry;
+            limbs[k] = static_cast<uint32_t>(sum);
+            carry = sum >> 32;
+        }
+    }
+
+    uint32_t limbs[LIMBS] = {};
+};
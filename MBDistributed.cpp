@@ -0,0 +1,733 @@
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <exception>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include "MBBigFixed.h"
+#include "MBImageWriter.h"
+#include "MBIterationMap.h"
+#include "MBKernels.h"
+#include "MBPalette.h"
+#include "MBRender.h"
+#include "MBThreadPool.h"
+
+/*
+    One render spread over as many machines as you have. Same views and output as MBHeadless, but
+    the pixels get computed by worker processes that connect over TCP:
+
+        ./MBDistributed --coordinate 9000 --size 32768 32768 --zoom 1e6 --center ... --out poster.png
+        ./MBDistributed --worker coordinator-host:9000        (on every node, as many as you like)
+
+    The image is cut into the tiles of an iteration map (MBIterationMap.h). The coordinator sends
+    each worker the view, and for deep zooms the reference orbit it computed (so no worker has to
+    redo the BigFixed part), then keeps it fed with lists of tiles. Workers compute them on all
+    their cores and stream the counts back, tile by tile, straight into the mapped file.
+
+    Balancing is by measured cost, nothing is split up front:
+      - first the coordinator samples every tile on a 4x4 grid and sorts the tiles most expensive
+        first, so the run ends on cheap tiles instead of one node grinding the minibrot alone
+      - for every worker it measures how much of that sampled cost per second comes back, and
+        keeps LOOKAHEAD_SECONDS of it in flight. Faster nodes just end up with more tiles.
+      - tiles of a worker that goes away go back in the queue for the others
+
+    Workers can join at any time while a render runs. Both ends have to be little endian (x86,
+    ARM), the messages are the structs as they are in memory.
+
+    g++ -O2 -o MBDistributed MBDistributed.cpp -pthread -lz
+*/
+
+const uint32_t PROTOCOL_VERSION = 1;
+const char WORKER_MAGIC[8] = {'M', 'B', 'W', 'O', 'R', 'K', 'E', 'R'};
+const double LOOKAHEAD_SECONDS = 0.5; // of measured work each worker gets ahead of time
+const int COST_SAMPLES = 4;           // per tile side for the cost estimate
+// Biggest message a worker takes, the job with its reference orbit (16 bytes per iteration) being
+// the big one. The coordinator takes nothing bigger than a tile. Anything claiming more drops the
+// connection.
+const size_t MAX_JOB_BYTES = size_t(256) << 20;
+
+enum class Message : uint32_t { Hello = 1, Job = 2, Work = 3, Tile = 4 };
+enum class Precision : uint32_t { Plain = 0, DoubleDouble = 1, Perturbation = 2 };
+
+struct Options {
+    int width = 800;
+    int height = 600;
+    const char* centerX = "-0.5";
+    const char* centerY = "0";
+    double zoom = 1.0;
+    int maxIter = 1000;
+    int threads = 0; // 0: one per core
+    PaletteScheme scheme = PaletteScheme::Sine;
+    bool perturbation = true;
+    int port = 0;
+    std::string worker; // host:port to work for
+    std::string out;
+    std::string map;
+};
+
+void printUsage(const char* program) {
+    std::cerr << "usage: " << program << " --coordinate PORT --out FILE.png|FILE.raw and/or --map FILE.mbmap [view options]\n"
+              << "       " << program << " --worker HOST:PORT [--threads N]\n"
+              << "  --size W H         image size in pixels (800 600)\n"
+              << "  --center X Y       view center, any number of digits (-0.5 0)\n"
+              << "  --zoom Z           1 shows -2..2 on both axes (1)\n"
+              << "  --iter N           max iterations (1000)\n"
+              << "  --palette NAME     sine, fire or gray (sine)\n"
+              << "  --double-double    double-double instead of perturbation for deep zooms\n"
+              << "  --threads N        worker threads (one per core)" << std::endl;
+}
+
+bool parseOptions(int argc, char** argv, Options& options) {
+    for (int a = 1; a < argc; ++a) {
+        std::string arg = argv[a];
+        auto values = [&](int n) {
+            if (a + n < argc) return true;
+            std::cerr << arg << " needs " << n << " value" << (n > 1 ? "s" : "") << std::endl;
+            return false;
+        };
+
+        if (arg == "--size") {
+            if (!values(2)) return false;
+            options.width = std::atoi(argv[++a]);
+            options.height = std::atoi(argv[++a]);
+        } else if (arg == "--center") {
+            if (!values(2)) return false;
+            options.centerX = argv[++a];
+            options.centerY = argv[++a];
+        } else if (arg == "--zoom") {
+            if (!values(1)) return false;
+            options.zoom = std::atof(argv[++a]);
+        } else if (arg == "--iter") {
+            if (!values(1)) return false;
+            options.maxIter = std::atoi(argv[++a]);
+        } else if (arg == "--palette") {
+            if (!values(1)) return false;
+            std::string name = argv[++a];
+            bool found = false;
+            for (int k = 0; k < PALETTE_SCHEME_COUNT && !found; ++k) {
+                options.scheme = static_cast<PaletteScheme>(k);
+                found = name == paletteSchemeName(options.scheme);
+            }
+            if (!found) {
+                std::cerr << "unknown palette " << name << std::endl;
+                return false;
+            }
+        } else if (arg == "--threads") {
+            if (!values(1)) return false;
+            options.threads = std::atoi(argv[++a]);
+        } else if (arg == "--double-double") {
+            options.perturbation = false;
+        } else if (arg == "--coordinate") {
+            if (!values(1)) return false;
+            options.port = std::atoi(argv[++a]);
+        } else if (arg == "--worker") {
+            if (!values(1)) return false;
+            options.worker = argv[++a];
+        } else if (arg == "--out") {
+            if (!values(1)) return false;
+            options.out = argv[++a];
+        } else if (arg == "--map") {
+            if (!values(1)) return false;
+            options.map = argv[++a];
+        } else {
+            std::cerr << "unknown option " << arg << std::endl;
+            return false;
+        }
+    }
+
+    if ((options.port > 0) == !options.worker.empty()) {
+        std::cerr << "either --coordinate PORT or --worker HOST:PORT" << std::endl;
+        return false;
+    }
+    if (options.port > 0 && options.out.empty() && options.map.empty()) {
+        std::cerr << "no --out or --map file given" << std::endl;
+        return false;
+    }
+    if (options.width <= 0 || options.height <= 0 || options.maxIter <= 0 || options.threads < 0) {
+        std::cerr << "size and iterations have to be positive" << std::endl;
+        return false;
+    }
+    if (!(options.zoom > 0.0 && options.zoom <= MAX_ZOOM)) {
+        std::cerr << "zoom has to be between 0 and " << MAX_ZOOM << std::endl;
+        return false;
+    }
+    return true;
+}
+
+// Wire format: every message is a type, a payload length and the payload
+
+// Payload being put together, plain values appended in memory order
+struct Writer {
+    std::string bytes;
+
+    template <typename T>
+    void put(const T& value) { bytes.append(reinterpret_cast<const char*>(&value), sizeof(T)); }
+    template <typename T>
+    void put(const std::vector<T>& values) {
+        put(static_cast<uint32_t>(values.size()));
+        bytes.append(reinterpret_cast<const char*>(values.data()), values.size() * sizeof(T));
+    }
+};
+
+// Payload being taken apart, ok goes false on anything short
+struct Reader {
+    const std::string& bytes;
+    size_t at = 0;
+    bool ok = true;
+
+    template <typename T>
+    T get() {
+        T value = T();
+        if (at + sizeof(T) > bytes.size()) {
+            ok = false;
+            return value;
+        }
+        std::memcpy(&value, bytes.data() + at, sizeof(T));
+        at += sizeof(T);
+        return value;
+    }
+    template <typename T>
+    std::vector<T> getVector() {
+        uint32_t count = get<uint32_t>();
+        if (!ok || at + static_cast<size_t>(count) * sizeof(T) > bytes.size()) {
+            ok = false;
+            return {};
+        }
+        std::vector<T> values(count);
+        std::memcpy(values.data(), bytes.data() + at, count * sizeof(T));
+        at += count * sizeof(T);
+        return values;
+    }
+};
+
+bool sendAll(int fd, const void* data, size_t size) {
+    const char* at = static_cast<const char*>(data);
+    while (size > 0) {
+        ssize_t sent = send(fd, at, size, MSG_NOSIGNAL);
+        if (sent <= 0) return false;
+        at += sent;
+        size -= static_cast<size_t>(sent);
+    }
+    return true;
+}
+
+bool recvAll(int fd, void* data, size_t size) {
+    char* at = static_cast<char*>(data);
+    while (size > 0) {
+        ssize_t got = recv(fd, at, size, 0);
+        if (got <= 0) return false;
+        at += got;
+        size -= static_cast<size_t>(got);
+    }
+    return true;
+}
+
+bool sendMessage(int fd, Message type, const std::string& payload) {
+    uint32_t head[3] = {static_cast<uint32_t>(type), static_cast<uint32_t>(payload.size()), static_cast<uint32_t>(payload.size() >> 32)};
+    return sendAll(fd, head, sizeof(head)) && sendAll(fd, payload.data(), payload.size());
+}
+
+// False on a broken connection or a payload over maxBytes, which never gets allocated
+bool recvMessage(int fd, Message& type, std::string& payload, size_t maxBytes) {
+    uint32_t head[3];
+    if (!recvAll(fd, head, sizeof(head))) return false;
+    type = static_cast<Message>(head[0]);
+    uint64_t size = static_cast<uint64_t>(head[1]) | static_cast<uint64_t>(head[2]) << 32;
+    if (size > maxBytes) return false;
+    payload.resize(static_cast<size_t>(size));
+    return recvAll(fd, &payload[0], payload.size());
+}
+
+// Everything a worker needs to compute any pixel of the render
+struct Job {
+    View view;
+    int tileSize = ITERATION_MAP_TILE_SIZE;
+    Precision precision = Precision::Plain;
+    std::shared_ptr<const ReferenceOrbit> reference;
+};
+
+std::string encodeJob(const Job& job) {
+    Writer w;
+    w.put(static_cast<uint32_t>(job.view.width));
+    w.put(static_cast<uint32_t>(job.view.height));
+    w.put(static_cast<uint32_t>(job.view.maxIter));
+    w.put(static_cast<uint32_t>(job.tileSize));
+    w.put(job.view.zoom);
+    uint32_t words[2 * BigFixed::LIMBS];
+    job.view.centerX.toWords(words);
+    job.view.centerY.toWords(words + BigFixed::LIMBS);
+    w.put(words);
+    w.put(job.precision);
+    if (job.precision == Precision::Perturbation) {
+        const ReferenceOrbit& ref = *job.reference;
+        w.put(ref.re);
+        w.put(ref.im);
+        w.put(ref.centerX);
+        w.put(ref.centerY);
+        w.put(ref.skip);
+        w.put(ref.seriesRe);
+        w.put(ref.seriesIm);
+        w.put(ref.seriesRadius);
+    }
+    return w.bytes;
+}
+
+bool decodeJob(const std::string& payload, Job& job) {
+    Reader r{payload};
+    job.view.width = static_cast<int>(r.get<uint32_t>());
+    job.view.height = static_cast<int>(r.get<uint32_t>());
+    job.view.maxIter = static_cast<int>(r.get<uint32_t>());
+    job.tileSize = static_cast<int>(r.get<uint32_t>());
+    job.view.zoom = r.get<double>();
+    uint32_t words[2 * BigFixed::LIMBS];
+    for (uint32_t& word : words) word = r.get<uint32_t>();
+    job.view.setCenter(BigFixed::fromWords(words), BigFixed::fromWords(words + BigFixed::LIMBS));
+    job.precision = r.get<Precision>();
+    if (job.precision == Precision::Perturbation) {
+        auto ref = std::make_shared<ReferenceOrbit>();
+        ref->re = r.getVector<double>();
+        ref->im = r.getVector<double>();
+        ref->centerX = r.get<double>();
+        ref->centerY = r.get<double>();
+        ref->skip = r.get<int>();
+        ref->seriesRe = r.getVector<double>();
+        ref->seriesIm = r.getVector<double>();
+        ref->seriesRadius = r.get<double>();
+        job.reference = ref;
+        r.ok = r.ok && ref->re.size() == ref->im.size() && !ref->re.empty();
+    }
+    return r.ok && job.view.width > 0 && job.view.height > 0 && job.view.maxIter > 0 && job.tileSize > 0;
+}
+
+// The kernel a job was set up for, the same on every node
+FrameKernel kernelFor(const Job& job) {
+    FrameKernel iterate;
+    if (job.precision == Precision::Perturbation) {
+        iterate.perturbed = activeKernel().iteratePerturbed;
+        iterate.reference = job.reference;
+        iterate.precision = "perturbation";
+    } else if (job.precision == Precision::DoubleDouble) {
+        iterate.doubleDouble = activeKernel().iterateDoubleDouble;
+        iterate.precision = "double-double";
+    } else {
+        iterate = iterateFor(job.view, RenderSettings());
+    }
+    return iterate;
+}
+
+// Counts of tile (tx, ty) of the job's map, rows past the image left as they are
+void computeTile(const FrameKernel& iterate, const Job& job, int tx, int ty, uint32_t* out) {
+    int t = job.tileSize;
+    int columns = std::min(t, job.view.width - tx * t);
+    int rows = std::min(t, job.view.height - ty * t);
+    for (int r = 0; r < rows; ++r) computeRow(iterate, job.view, ty * t + r, tx * t, columns, out + r * t);
+}
+
+// Worker side
+
+int connectTo(const std::string& address) {
+    size_t colon = address.rfind(':');
+    if (colon == std::string::npos) return -1;
+    std::string host = address.substr(0, colon);
+    std::string port = address.substr(colon + 1);
+
+    addrinfo hints = {};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    addrinfo* found = nullptr;
+    if (getaddrinfo(host.c_str(), port.c_str(), &hints, &found) != 0) return -1;
+
+    int fd = -1;
+    for (addrinfo* a = found; a && fd < 0; a = a->ai_next) {
+        fd = socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+        if (fd >= 0 && connect(fd, a->ai_addr, a->ai_addrlen) != 0) {
+            close(fd);
+            fd = -1;
+        }
+    }
+    freeaddrinfo(found);
+    return fd;
+}
+
+int runWorker(const Options& options) {
+    int fd = connectTo(options.worker);
+    if (fd < 0) {
+        std::cerr << "Cant connect to " << options.worker << std::endl;
+        return 1;
+    }
+    int yes = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+
+    int threads = options.threads > 0 ? options.threads : std::max(1u, std::thread::hardware_concurrency());
+    // The main thread only reads the socket, every task is on the pool
+    ThreadPool pool(threads);
+
+    Writer hello;
+    hello.put(WORKER_MAGIC);
+    hello.put(PROTOCOL_VERSION);
+    hello.put(static_cast<uint32_t>(threads));
+    if (!sendMessage(fd, Message::Hello, hello.bytes)) return 1;
+
+    Message type;
+    std::string payload;
+    Job job;
+    if (!recvMessage(fd, type, payload, MAX_JOB_BYTES) || type != Message::Job || !decodeJob(payload, job)) {
+        std::cerr << "Coordinator sent no job we understand" << std::endl;
+        close(fd);
+        return 1;
+    }
+    FrameKernel iterate = kernelFor(job);
+    int tilesX = (job.view.width + job.tileSize - 1) / job.tileSize;
+    std::cout << "Working on " << job.view.width << "x" << job.view.height << " (" << iterate.precision << ") with the "
+              << activeKernel().name << " kernel on " << threads << " threads" << std::endl;
+
+    std::mutex sending;
+    std::atomic<bool> failed{false};
+    std::vector<std::shared_ptr<ThreadPool::Job>> running;
+    uint64_t tilesDone = 0;
+
+    // The main thread keeps reading work lists while the pool computes the ones before
+    while (!failed && recvMessage(fd, type, payload, MAX_JOB_BYTES) && type == Message::Work) {
+        Reader r{payload};
+        std::vector<uint32_t> tiles = r.getVector<uint32_t>();
+        if (!r.ok || tiles.empty()) break; // an empty list means the render is done
+
+        running.erase(std::remove_if(running.begin(), running.end(), [](const std::shared_ptr<ThreadPool::Job>& j) { return j->done(); }),
+                      running.end());
+        tilesDone += tiles.size();
+        running.push_back(pool.submit(static_cast<int>(tiles.size()), [&, tiles](int k) {
+            auto start = std::chrono::steady_clock::now();
+            Writer result;
+            result.put(tiles[k]);
+            result.put(uint64_t(0)); // compute time, filled in below
+            size_t countsAt = result.bytes.size();
+            result.bytes.resize(countsAt + static_cast<size_t>(job.tileSize) * job.tileSize * sizeof(uint32_t));
+            computeTile(iterate, job, tiles[k] % tilesX, tiles[k] / tilesX, reinterpret_cast<uint32_t*>(&result.bytes[countsAt]));
+
+            uint64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+            std::memcpy(&result.bytes[sizeof(uint32_t)], &ns, sizeof(ns));
+            std::lock_guard<std::mutex> lock(sending);
+            if (!failed && !sendMessage(fd, Message::Tile, result.bytes)) failed = true;
+        }));
+    }
+    for (auto& j : running) pool.wait(j);
+    close(fd);
+
+    std::cout << "Done, " << tilesDone << " tiles" << std::endl;
+    return failed ? 1 : 0;
+}
+
+// Coordinator side
+
+// Tiles still to hand out, most expensive first, and what is left overall
+class TileQueue {
+public:
+    TileQueue(std::vector<uint32_t> order, std::vector<double> cost) : order(order.begin(), order.end()), cost(std::move(cost)),
+                                                                      remaining(static_cast<int>(this->cost.size())) {}
+
+    // Tiles worth about budget of estimated cost (at least one), empty once everything is handed
+    // out. Blocks while the queue is empty but tiles are still out, as they might come back.
+    std::vector<uint32_t> take(double budget) {
+        std::unique_lock<std::mutex> lock(m);
+        cv.wait(lock, [&] { return !order.empty() || remaining == 0; });
+        return takeLocked(budget);
+    }
+
+    // Same without the waiting, empty if there is nothing to hand out right now
+    std::vector<uint32_t> tryTake(double budget) {
+        std::lock_guard<std::mutex> lock(m);
+        return takeLocked(budget);
+    }
+
+    // Tiles a worker had when it went away, first in line again
+    void giveBack(const std::vector<uint32_t>& tiles) {
+        std::lock_guard<std::mutex> lock(m);
+        for (auto it = tiles.rbegin(); it != tiles.rend(); ++it) order.push_front(*it);
+        cv.notify_all();
+    }
+
+    void finished() {
+        std::lock_guard<std::mutex> lock(m);
+        if (--remaining == 0) cv.notify_all();
+    }
+
+    // Tiles still not back, after waiting up to seconds for that to reach 0
+    int waitDone(double seconds) {
+        std::unique_lock<std::mutex> lock(m);
+        cv.wait_for(lock, std::chrono::duration<double>(seconds), [&] { return remaining == 0; });
+        return remaining;
+    }
+
+    double costOf(uint32_t tile) const { return cost[tile]; }
+
+private:
+    std::vector<uint32_t> takeLocked(double budget) {
+        std::vector<uint32_t> tiles;
+        double taken = 0;
+        while (!order.empty() && (tiles.empty() || taken < budget)) {
+            taken += cost[order.front()];
+            tiles.push_back(order.front());
+            order.pop_front();
+        }
+        return tiles;
+    }
+
+    std::deque<uint32_t> order;
+    std::vector<double> cost;
+    int remaining;
+    std::mutex m;
+    std::condition_variable cv;
+};
+
+// Sampled cost of every tile: COST_SAMPLES^2 pixels each, iterations plus one per pixel for the
+// overhead of getting it started
+std::vector<double> estimateCosts(ThreadPool& pool, const FrameKernel& iterate, const Job& job, int tilesX, int tilesY) {
+    std::vector<double> cost(static_cast<size_t>(tilesX) * tilesY);
+    int t = job.tileSize;
+    int step = std::max(1, t / COST_SAMPLES);
+    pool.parallelFor(static_cast<int>(cost.size()), [&](int index) {
+        int tx = index % tilesX, ty = index / tilesX;
+        int columns = std::min(t, job.view.width - tx * t);
+        int rows = std::min(t, job.view.height - ty * t);
+        uint32_t counts[COST_SAMPLES];
+        double sum = 0;
+        for (int r = step / 2; r < rows; r += step) {
+            int count = std::min(COST_SAMPLES, (columns - step / 2 + step - 1) / step);
+            iterate(job.view, ty * t + r, tx * t + step / 2, 0, step, count, counts);
+            for (int k = 0; k < count; ++k) sum += counts[k] + 1.0;
+        }
+        cost[index] = sum * (static_cast<double>(rows) * columns) / (COST_SAMPLES * COST_SAMPLES);
+    });
+    return cost;
+}
+
+// One worker connection, from its hello until the render is done or it goes away. Tiles it had
+// go back in the queue. inFlight is the caller's so they still do if this throws.
+void serveWorkerTiles(int fd, const std::string& job, TileQueue& queue, IterationMap& map, std::deque<uint32_t>& inFlight) {
+    int yes = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+
+    // Hello is way smaller than a tile, and a tile is all a worker ever sends back
+    size_t tileBytes = static_cast<size_t>(map.tileSize()) * map.tileSize() * sizeof(uint32_t);
+    size_t maxMessage = sizeof(uint32_t) + sizeof(uint64_t) + tileBytes;
+
+    Message type;
+    std::string payload;
+    if (!recvMessage(fd, type, payload, maxMessage) || type != Message::Hello) return;
+    Reader hello{payload};
+    char magic[8];
+    for (char& c : magic) c = hello.get<char>();
+    uint32_t version = hello.get<uint32_t>();
+    int threads = static_cast<int>(hello.get<uint32_t>());
+    if (!hello.ok || std::memcmp(magic, WORKER_MAGIC, sizeof(magic)) != 0 || version != PROTOCOL_VERSION || threads <= 0) return;
+    if (!sendMessage(fd, Message::Job, job)) return;
+
+    using Clock = std::chrono::steady_clock;
+    Clock::time_point start = Clock::now();
+    double inFlightCost = 0;
+    double doneCost = 0;
+    int received = 0;
+
+    while (true) {
+        // Keep LOOKAHEAD_SECONDS of its measured speed queued on the worker, and at least a couple
+        // of tiles per thread (which is all it gets until there is a measurement)
+        double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+        double budget = received > threads ? doneCost / seconds * LOOKAHEAD_SECONDS : 0;
+        if (inFlight.size() < static_cast<size_t>(2 * threads) || inFlightCost < budget) {
+            // Only wait for tiles others might give back once this one has nothing left to do
+            double want = std::max(budget - inFlightCost, 0.0);
+            std::vector<uint32_t> tiles = inFlight.empty() ? queue.take(want) : queue.tryTake(want);
+            if (!tiles.empty() || inFlight.empty()) {
+                Writer work;
+                work.put(tiles);
+                if (!sendMessage(fd, Message::Work, work.bytes) || tiles.empty()) break; // empty: render done
+                for (uint32_t tile : tiles) {
+                    inFlight.push_back(tile);
+                    inFlightCost += queue.costOf(tile);
+                }
+                continue;
+            }
+        }
+
+        if (!recvMessage(fd, type, payload, maxMessage) || type != Message::Tile) break;
+        Reader r{payload};
+        uint32_t tile = r.get<uint32_t>();
+        r.get<uint64_t>(); // compute time, the wall clock rate above is what counts for balancing
+        auto it = std::find(inFlight.begin(), inFlight.end(), tile);
+        if (!r.ok || it == inFlight.end() || payload.size() != r.at + tileBytes) break;
+
+        int tx = static_cast<int>(tile % map.tilesX()), ty = static_cast<int>(tile / map.tilesX());
+        std::memcpy(map.tile(tx, ty), payload.data() + r.at, tileBytes);
+        map.markTileDone(tx, ty);
+        inFlight.erase(it);
+        inFlightCost -= queue.costOf(tile);
+        doneCost += queue.costOf(tile);
+        ++received;
+        queue.finished();
+    }
+}
+
+// Whatever goes wrong with one worker (a peer lying about sizes, running out of memory) only
+// ends that connection, the render carries on with the others
+void serveWorker(int fd, const std::string& job, TileQueue& queue, IterationMap& map) {
+    std::deque<uint32_t> inFlight;
+    try {
+        serveWorkerTiles(fd, job, queue, map, inFlight);
+    } catch (const std::exception& e) {
+        std::cerr << "Dropped a worker: " << e.what() << std::endl;
+    }
+
+    if (!inFlight.empty()) {
+        std::cerr << "Lost a worker, " << inFlight.size() << " of its tiles go to the others" << std::endl;
+        queue.giveBack(std::vector<uint32_t>(inFlight.begin(), inFlight.end()));
+    }
+    close(fd);
+}
+
+int runCoordinator(const Options& options) {
+    View view;
+    view.width = options.width;
+    view.height = options.height;
+    view.zoom = options.zoom;
+    view.maxIter = options.maxIter;
+    BigFixed centerX, centerY;
+    if (!BigFixed::parse(options.centerX, centerX) || !BigFixed::parse(options.centerY, centerY)) {
+        std::cerr << "center has to be two decimal numbers" << std::endl;
+        return 1;
+    }
+    view.setCenter(centerX, centerY);
+
+    RenderSettings settings;
+    settings.perturbation = options.perturbation;
+    FrameKernel iterate = iterateFor(view, settings);
+
+    Job job;
+    job.view = view;
+    job.precision = iterate.perturbed ? Precision::Perturbation : iterate.doubleDouble ? Precision::DoubleDouble : Precision::Plain;
+    job.reference = iterate.reference;
+    std::string jobMessage = encodeJob(job);
+    if (jobMessage.size() > MAX_JOB_BYTES) {
+        std::cerr << "reference orbit too big to send to the workers, use fewer iterations" << std::endl;
+        return 1;
+    }
+
+    // The tiles get assembled in an iteration map. Without --map it is a file nobody can see
+    // (unlinked right away), only there so the image never has to fit in memory.
+    std::string mapPath = options.map.empty() ? options.out + ".part" : options.map;
+    std::unique_ptr<IterationMap> map = IterationMap::create(mapPath, view, iterate.precision, job.tileSize);
+    if (!map) {
+        std::cerr << "cant create " << mapPath << std::endl;
+        return 1;
+    }
+    if (options.map.empty()) unlink(mapPath.c_str());
+
+    int threads = options.threads > 0 ? options.threads : std::max(1u, std::thread::hardware_concurrency());
+    ThreadPool pool(threads - 1);
+
+    int tilesX = map->tilesX(), tilesY = map->tilesY();
+    std::vector<double> cost = estimateCosts(pool, iterate, job, tilesX, tilesY);
+    std::vector<uint32_t> order(cost.size());
+    for (size_t t = 0; t < order.size(); ++t) order[t] = static_cast<uint32_t>(t);
+    std::stable_sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) { return cost[a] > cost[b]; });
+    TileQueue queue(order, cost);
+
+    int listener = socket(AF_INET, SOCK_STREAM, 0);
+    int yes = 1;
+    setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+    sockaddr_in address = {};
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_ANY);
+    address.sin_port = htons(static_cast<uint16_t>(options.port));
+    if (listener < 0 || bind(listener, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0 || listen(listener, SOMAXCONN) != 0) {
+        std::cerr << "Cant listen on port " << options.port << ": " << std::strerror(errno) << std::endl;
+        return 1;
+    }
+    std::cout << "Rendering " << view.width << "x" << view.height << " (" << iterate.precision << ") as " << order.size()
+              << " tiles, waiting for workers on port " << options.port << std::endl;
+
+    std::vector<std::thread> connections;
+    std::thread acceptor([&] {
+        while (true) {
+            int fd = accept(listener, nullptr, nullptr);
+            if (fd < 0) {
+                if (errno == EINTR) continue;
+                return; // listener got shut down, render is done
+            }
+            std::cout << "Worker connected" << std::endl;
+            connections.emplace_back(serveWorker, fd, std::cref(jobMessage), std::ref(queue), std::ref(*map));
+        }
+    });
+
+    for (int left = queue.waitDone(1.0); left > 0; left = queue.waitDone(1.0)) {
+        std::cout << "\r" << order.size() - left << " / " << order.size() << " tiles" << std::flush;
+    }
+    std::cout << "\r" << order.size() << " / " << order.size() << " tiles" << std::endl;
+    shutdown(listener, SHUT_RDWR);
+    close(listener);
+    acceptor.join();
+    for (std::thread& connection : connections) connection.join();
+
+    if (!options.map.empty()) {
+        if (!map->flush()) {
+            std::cerr << "writing " << options.map << " failed" << std::endl;
+            return 1;
+        }
+        std::cout << "Wrote " << options.map << std::endl;
+    }
+    if (options.out.empty()) return 0;
+
+    // Colored a row of tiles at a time, straight out of the map
+    std::unique_ptr<ImageWriter> writer = openImageWriter(options.out, view.width, view.height);
+    if (!writer) {
+        std::cerr << "cant create " << options.out << std::endl;
+        return 1;
+    }
+    Palette palette;
+    palette.scheme = options.scheme;
+    palette.update(view.maxIter);
+    ColorizeFn colorizeRun = activeColorize();
+
+    int t = map->tileSize();
+    std::vector<uint32_t> pixels(static_cast<size_t>(t) * view.width);
+    bool ok = true;
+    for (int ty = 0; ty < tilesY && ok; ++ty) {
+        int rows = std::min(t, view.height - ty * t);
+        pool.parallelFor(rows, [&](int r) {
+            for (int tx = 0; tx < tilesX; ++tx) {
+                int columns = std::min(t, view.width - tx * t);
+                colorizeRun(map->tile(tx, ty) + r * t, columns, palette.colors.data(), palette.maxIter,
+                            pixels.data() + static_cast<size_t>(r) * view.width + tx * t);
+            }
+        });
+        ok = writer->writeRows(pixels.data(), rows, view.width * 4);
+    }
+    if (!writer->finish() || !ok) {
+        std::cerr << "writing " << options.out << " failed" << std::endl;
+        return 1;
+    }
+    std::cout << "Wrote " << options.out << std::endl;
+    return 0;
+}
+
+int main(int argc, char** argv) {
+    Options options;
+    if (!parseOptions(argc, argv, options)) {
+        printUsage(argv[0]);
+        return 1;
+    }
+    return options.port > 0 ? runCoordinator(options) : runWorker(options);
+}
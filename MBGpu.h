@@ -0,0 +1,418 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <type_traits>
+#include <SDL2/SDL.h>
+#include <GL/glcorearb.h>
+#include "MBKernels.h"
+#include "MBPalette.h"
+#include "MBRender.h"
+
+/*
+    The same escape time loop as the cpu kernels, as an OpenGL compute shader, writing straight
+    into the texture SDL draws from. Nothing comes back to the cpu: the counts stay in a buffer on
+    the gpu (so a palette change is one more tiny dispatch), and the colors get stored into the
+    texture itself, no SDL_LockTexture / upload at all.
+
+    Needs SDL's opengl renderer and a GL 4.3 context (compute shaders). Every GL function is
+    looked up through SDL_GL_GetProcAddress, so there is nothing extra to link. SDL keeps its own
+    idea of the GL state, so we flush its queued drawing first and put back the program and
+    texture binding it expects afterwards.
+
+    Two precisions:
+      float        while pixels are at least FLOAT_MIN_ULPS_PER_PIXEL float ulps apart, like the
+                   cpu float kernels
+      float-float  a pair of floats per number (same tricks as the cpu double-double, one level
+                   down), about 46 bits. Consumer gpus run real doubles at 1/32 the rate or worse,
+                   so this is the fast way to get to roughly double precision.
+    Anything deeper than float-float can resolve goes back to the cpu path (doubles, then
+    double-double / perturbation).
+*/
+
+const int GPU_GROUP_SIZE = 16;  // local size of both shaders, in each direction
+const int GPU_BAND_ROWS = 64;   // rows per dispatch, keeps a high maxIter dispatch from tripping the driver watchdog
+const double GPU_FLOAT_FLOAT_MIN_ULPS_PER_PIXEL = 256.0;
+
+enum class GpuPrecision { None, Float, FloatFloat };
+
+inline const char* gpuPrecisionName(GpuPrecision precision) {
+    switch (precision) {
+        case GpuPrecision::None: return "cpu";
+        case GpuPrecision::Float: return "float";
+        case GpuPrecision::FloatFloat: return "float-float";
+    }
+    return "?";
+}
+
+// What the gpu would need for view, None if it cant
+inline GpuPrecision gpuPrecisionFor(const View& view) {
+    double magnitude = std::max(viewExtent(view), 2.0);
+    double spacing = std::min(view.stepX(), view.stepY());
+    if (spacing >= FLOAT_MIN_ULPS_PER_PIXEL * magnitude * 1.1920929e-07) return GpuPrecision::Float;
+    if (spacing >= GPU_FLOAT_FLOAT_MIN_ULPS_PER_PIXEL * magnitude * 1.4210855e-14) return GpuPrecision::FloatFloat; // FLT_EPSILON^2
+    return GpuPrecision::None;
+}
+
+// Counts for rows firstRow.. of the frame. Same loop and same counts as the naive cpu version,
+// with the cardioid / bulb check up front.
+const char* const GPU_ITERATE_SHADER = R"(#version 430
+layout(local_size_x = 16, local_size_y = 16) in;
+layout(std430, binding = 0) writeonly buffer Counts { uint counts[]; };
+
+uniform ivec2 size;
+uniform int firstRow;
+uniform int maxIter;
+uniform int floatFloat;
+uniform vec4 center;    // x, x low part, y, y low part
+uniform vec4 pixelStep; // same split
+
+// Error free sum and product, precise so the compiler doesnt "simplify" the error terms away
+vec2 twoSum(float a, float b) {
+    precise float s = a + b;
+    precise float v = s - a;
+    precise float e = (a - (s - v)) + (b - v);
+    return vec2(s, e);
+}
+vec2 quickTwoSum(float a, float b) {
+    precise float s = a + b;
+    precise float e = b - (s - a);
+    return vec2(s, e);
+}
+vec2 ffAdd(vec2 a, vec2 b) {
+    vec2 s = twoSum(a.x, b.x);
+    precise float e = s.y + a.y + b.y;
+    return quickTwoSum(s.x, e);
+}
+// Dekker's split into two 12 bit halves, so the product error comes out of plain multiplies.
+// fma() would be shorter but GLSL doesnt promise it is fused, and llvmpipe for one doesnt
+vec2 split(float a) {
+    precise float c = 4097.0 * a;
+    precise float h = c - (c - a);
+    precise float l = a - h;
+    return vec2(h, l);
+}
+vec2 ffMul(vec2 a, vec2 b) {
+    precise float p = a.x * b.x;
+    vec2 as = split(a.x), bs = split(b.x);
+    precise float e = ((as.x * bs.x - p) + as.x * bs.y + as.y * bs.x) + as.y * bs.y + (a.x * b.y + a.y * b.x);
+    return quickTwoSum(p, e);
+}
+
+bool insideMainBulbs(float x, float y) {
+    float xq = x - 0.25;
+    float q = xq * xq + y * y;
+    return q * (q + xq) <= 0.25 * y * y || (x + 1.0) * (x + 1.0) + y * y <= 0.0625;
+}
+
+uint iterateFloat(float x, float y) {
+    float zr = 0.0, zi = 0.0;
+    int n = 0;
+    for (; n < maxIter; ++n) {
+        float zr2 = zr * zr, zi2 = zi * zi;
+        if (zr2 + zi2 > 4.0) break;
+        zi = 2.0 * zr * zi + y;
+        zr = zr2 - zi2 + x;
+    }
+    return uint(n);
+}
+
+uint iterateFloatFloat(vec2 x, vec2 y) {
+    vec2 zr = vec2(0.0), zi = vec2(0.0);
+    int n = 0;
+    for (; n < maxIter; ++n) {
+        vec2 zr2 = ffMul(zr, zr), zi2 = ffMul(zi, zi);
+        if (zr2.x + zi2.x > 4.0) break;
+        vec2 zri = ffMul(zr, zi);
+        zi = ffAdd(ffAdd(zri, zri), y);
+        zr = ffAdd(ffAdd(zr2, -zi2), x);
+    }
+    return uint(n);
+}
+
+void main() {
+    ivec2 p = ivec2(gl_GlobalInvocationID.xy) + ivec2(0, firstRow);
+    if (p.x >= size.x || p.y >= size.y) return;
+
+    // The pixel offset is exact in a float, the step isnt: a plain float step is off by ~1e-5 pixels
+    // at the frame edge, which is plenty to change counts near the boundary at float-float depths
+    vec2 x = ffAdd(center.xy, ffMul(vec2(float(p.x) - float(size.x) * 0.5, 0.0), pixelStep.xy));
+    vec2 y = ffAdd(center.zw, ffMul(vec2(float(p.y) - float(size.y) * 0.5, 0.0), pixelStep.zw));
+
+    uint n;
+    if (insideMainBulbs(x.x, y.x)) {
+        n = uint(maxIter);
+    } else if (floatFloat != 0) {
+        n = iterateFloatFloat(x, y);
+    } else {
+        n = iterateFloat(x.x, y.x);
+    }
+    counts[p.y * size.x + p.x] = n;
+}
+)";
+
+// Counts through the palette into the texture. IMAGE_TYPE gets filled in for whatever kind of
+// texture SDL made.
+const char* const GPU_COLORIZE_SHADER = R"(#version 430
+layout(local_size_x = 16, local_size_y = 16) in;
+layout(std430, binding = 0) readonly buffer Counts { uint counts[]; };
+layout(std430, binding = 1) readonly buffer Colors { uint colors[]; };
+layout(rgba8, binding = 0) writeonly uniform IMAGE_TYPE image;
+
+uniform ivec2 size;
+uniform int maxIter;
+
+void main() {
+    ivec2 p = ivec2(gl_GlobalInvocationID.xy);
+    if (p.x >= size.x || p.y >= size.y) return;
+    uint c = colors[min(counts[p.y * size.x + p.x], uint(maxIter))];
+    // Same RGBA8888 words as the cpu palette, red in the top byte
+    imageStore(image, p, vec4((c >> 24) & 255u, (c >> 16) & 255u, (c >> 8) & 255u, 255u) / 255.0);
+}
+)";
+
+class GpuRenderer {
+public:
+    ~GpuRenderer() {
+        SDL_GL_BindTexture(texture, nullptr, nullptr);
+        if (iterateProgram) gl.DeleteProgram(iterateProgram);
+        if (colorizeProgram) gl.DeleteProgram(colorizeProgram);
+        if (buffers[0]) gl.DeleteBuffers(2, buffers);
+        SDL_GL_UnbindTexture(texture);
+    }
+
+    GpuRenderer(const GpuRenderer&) = delete;
+    GpuRenderer& operator=(const GpuRenderer&) = delete;
+
+    // Null (with why in error) if renderer isnt SDL's opengl one or the context cant do compute
+    static std::unique_ptr<GpuRenderer> create(SDL_Renderer* renderer, SDL_Texture* texture, int width, int height, std::string& error) {
+        std::unique_ptr<GpuRenderer> gpu(new GpuRenderer());
+        gpu->renderer = renderer;
+        gpu->texture = texture;
+        gpu->width = width;
+        gpu->height = height;
+
+        // Only works on GL textures, and makes SDL's context current on the way
+        float texW = 0, texH = 0;
+        if (SDL_GL_BindTexture(texture, &texW, &texH) != 0) {
+            error = "renderer isnt opengl";
+            return nullptr;
+        }
+        bool ok = gpu->setUp(texW, error);
+        SDL_GL_UnbindTexture(texture);
+        if (!ok) return nullptr;
+        return gpu;
+    }
+
+    // Computes view into the counts buffer and colors it into the texture. The texture is ready to
+    // draw afterwards, the gpu just might still be busy on it.
+    void render(const View& view, const Palette& palette, GpuPrecision precision) {
+        begin();
+        gl.UseProgram(iterateProgram);
+        gl.BindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, buffers[0]);
+
+        // Center and step split into a float and the float of what is left over
+        auto split = [&](const char* name, double x, double y) {
+            float hx = static_cast<float>(x), hy = static_cast<float>(y);
+            gl.Uniform4f(gl.GetUniformLocation(iterateProgram, name), hx, static_cast<float>(x - hx), hy, static_cast<float>(y - hy));
+        };
+        split("center", view.offsetX, view.offsetY);
+        split("pixelStep", view.stepX(), view.stepY());
+        gl.Uniform2i(gl.GetUniformLocation(iterateProgram, "size"), width, height);
+        gl.Uniform1i(gl.GetUniformLocation(iterateProgram, "maxIter"), view.maxIter);
+        gl.Uniform1i(gl.GetUniformLocation(iterateProgram, "floatFloat"), precision == GpuPrecision::FloatFloat ? 1 : 0);
+
+        GLint firstRow = gl.GetUniformLocation(iterateProgram, "firstRow");
+        for (int row = 0; row < height; row += GPU_BAND_ROWS) {
+            gl.Uniform1i(firstRow, row);
+            gl.DispatchCompute(groups(width), groups(std::min(GPU_BAND_ROWS, height - row)), 1);
+            gl.Flush();
+        }
+        gl.MemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+
+        colorize(palette);
+        end();
+    }
+
+    // Only the colors changed, the counts from the last render are still on the gpu
+    void recolor(const Palette& palette) {
+        begin();
+        colorize(palette);
+        end();
+    }
+
+private:
+    GpuRenderer() = default;
+
+    // The GL 4.3 calls we use, looked up at startup
+    struct Functions {
+        PFNGLGETSTRINGPROC GetString;
+        PFNGLGETINTEGERVPROC GetIntegerv;
+        PFNGLCREATESHADERPROC CreateShader;
+        PFNGLSHADERSOURCEPROC ShaderSource;
+        PFNGLCOMPILESHADERPROC CompileShader;
+        PFNGLGETSHADERIVPROC GetShaderiv;
+        PFNGLGETSHADERINFOLOGPROC GetShaderInfoLog;
+        PFNGLDELETESHADERPROC DeleteShader;
+        PFNGLCREATEPROGRAMPROC CreateProgram;
+        PFNGLATTACHSHADERPROC AttachShader;
+        PFNGLLINKPROGRAMPROC LinkProgram;
+        PFNGLGETPROGRAMIVPROC GetProgramiv;
+        PFNGLGETPROGRAMINFOLOGPROC GetProgramInfoLog;
+        PFNGLDELETEPROGRAMPROC DeleteProgram;
+        PFNGLUSEPROGRAMPROC UseProgram;
+        PFNGLGETUNIFORMLOCATIONPROC GetUniformLocation;
+        PFNGLUNIFORM1IPROC Uniform1i;
+        PFNGLUNIFORM2IPROC Uniform2i;
+        PFNGLUNIFORM4FPROC Uniform4f;
+        PFNGLGENBUFFERSPROC GenBuffers;
+        PFNGLDELETEBUFFERSPROC DeleteBuffers;
+        PFNGLBINDBUFFERPROC BindBuffer;
+        PFNGLBINDBUFFERBASEPROC BindBufferBase;
+        PFNGLBUFFERDATAPROC BufferData;
+        PFNGLBINDIMAGETEXTUREPROC BindImageTexture;
+        PFNGLDISPATCHCOMPUTEPROC DispatchCompute;
+        PFNGLMEMORYBARRIERPROC MemoryBarrier;
+        PFNGLFLUSHPROC Flush;
+    };
+
+    static GLuint groups(int pixels) { return static_cast<GLuint>((pixels + GPU_GROUP_SIZE - 1) / GPU_GROUP_SIZE); }
+
+    bool setUp(float texW, std::string& error) {
+        bool all = true;
+        auto load = [&](auto& function, const char* name) {
+            function = reinterpret_cast<typename std::remove_reference<decltype(function)>::type>(SDL_GL_GetProcAddress(name));
+            all = all && function;
+        };
+        load(gl.GetString, "glGetString");
+        load(gl.GetIntegerv, "glGetIntegerv");
+        load(gl.CreateShader, "glCreateShader");
+        load(gl.ShaderSource, "glShaderSource");
+        load(gl.CompileShader, "glCompileShader");
+        load(gl.GetShaderiv, "glGetShaderiv");
+        load(gl.GetShaderInfoLog, "glGetShaderInfoLog");
+        load(gl.DeleteShader, "glDeleteShader");
+        load(gl.CreateProgram, "glCreateProgram");
+        load(gl.AttachShader, "glAttachShader");
+        load(gl.LinkProgram, "glLinkProgram");
+        load(gl.GetProgramiv, "glGetProgramiv");
+        load(gl.GetProgramInfoLog, "glGetProgramInfoLog");
+        load(gl.DeleteProgram, "glDeleteProgram");
+        load(gl.UseProgram, "glUseProgram");
+        load(gl.GetUniformLocation, "glGetUniformLocation");
+        load(gl.Uniform1i, "glUniform1i");
+        load(gl.Uniform2i, "glUniform2i");
+        load(gl.Uniform4f, "glUniform4f");
+        load(gl.GenBuffers, "glGenBuffers");
+        load(gl.DeleteBuffers, "glDeleteBuffers");
+        load(gl.BindBuffer, "glBindBuffer");
+        load(gl.BindBufferBase, "glBindBufferBase");
+        load(gl.BufferData, "glBufferData");
+        load(gl.BindImageTexture, "glBindImageTexture");
+        load(gl.DispatchCompute, "glDispatchCompute");
+        load(gl.MemoryBarrier, "glMemoryBarrier");
+        load(gl.Flush, "glFlush");
+        // Drivers hand out pointers for functions the context doesnt have, so check the version too
+        GLint major = 0, minor = 0;
+        if (all) {
+            gl.GetIntegerv(GL_MAJOR_VERSION, &major);
+            gl.GetIntegerv(GL_MINOR_VERSION, &minor);
+        }
+        if (!all || major * 10 + minor < 43) {
+            error = std::string("no compute shaders (needs GL 4.3, have ") + (all ? reinterpret_cast<const char*>(gl.GetString(GL_VERSION)) : "?") + ")";
+            return false;
+        }
+
+        // SDL reports texture coordinates in pixels for rectangle textures, 0..1 for plain 2D ones
+        bool rectangle = texW > 1.5f;
+        GLint name = 0;
+        gl.GetIntegerv(rectangle ? GL_TEXTURE_BINDING_RECTANGLE : GL_TEXTURE_BINDING_2D, &name);
+        textureName = static_cast<GLuint>(name);
+
+        std::string colorizeSource = GPU_COLORIZE_SHADER;
+        colorizeSource.replace(colorizeSource.find("IMAGE_TYPE"), 10, rectangle ? "image2DRect" : "image2D");
+        iterateProgram = compile(GPU_ITERATE_SHADER, error);
+        colorizeProgram = iterateProgram ? compile(colorizeSource.c_str(), error) : 0;
+        if (!colorizeProgram) return false;
+
+        gl.GenBuffers(2, buffers);
+        gl.BindBuffer(GL_SHADER_STORAGE_BUFFER, buffers[0]);
+        gl.BufferData(GL_SHADER_STORAGE_BUFFER, static_cast<GLsizeiptr>(width) * height * sizeof(uint32_t), nullptr, GL_DYNAMIC_DRAW);
+        gl.BindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+        return true;
+    }
+
+    GLuint compile(const char* source, std::string& error) {
+        GLuint shader = gl.CreateShader(GL_COMPUTE_SHADER);
+        gl.ShaderSource(shader, 1, &source, nullptr);
+        gl.CompileShader(shader);
+        GLint ok = 0;
+        gl.GetShaderiv(shader, GL_COMPILE_STATUS, &ok);
+        char log[1024] = "";
+        if (!ok) {
+            gl.GetShaderInfoLog(shader, sizeof(log), nullptr, log);
+            gl.DeleteShader(shader);
+            error = std::string("shader didnt compile: ") + log;
+            return 0;
+        }
+
+        GLuint program = gl.CreateProgram();
+        gl.AttachShader(program, shader);
+        gl.LinkProgram(program);
+        gl.DeleteShader(shader);
+        gl.GetProgramiv(program, GL_LINK_STATUS, &ok);
+        if (!ok) {
+            gl.GetProgramInfoLog(program, sizeof(log), nullptr, log);
+            gl.DeleteProgram(program);
+            error = std::string("shader didnt link: ") + log;
+            return 0;
+        }
+        return program;
+    }
+
+    // Everything SDL queued goes out first, and we remember what it had bound
+    void begin() {
+        SDL_RenderFlush(renderer);
+        SDL_GL_BindTexture(texture, nullptr, nullptr);
+        gl.GetIntegerv(GL_CURRENT_PROGRAM, &sdlProgram);
+    }
+
+    void end() {
+        gl.BindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, 0);
+        gl.BindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, 0);
+        gl.UseProgram(static_cast<GLuint>(sdlProgram));
+        SDL_GL_UnbindTexture(texture);
+    }
+
+    void colorize(const Palette& palette) {
+        gl.UseProgram(colorizeProgram);
+        gl.BindBuffer(GL_SHADER_STORAGE_BUFFER, buffers[1]);
+        gl.BufferData(GL_SHADER_STORAGE_BUFFER, static_cast<GLsizeiptr>(palette.colors.size() * sizeof(uint32_t)), palette.colors.data(),
+                      GL_DYNAMIC_DRAW);
+        gl.BindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+        gl.BindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, buffers[0]);
+        gl.BindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, buffers[1]);
+        gl.BindImageTexture(0, textureName, 0, GL_FALSE, 0, GL_WRITE_ONLY, GL_RGBA8);
+        gl.Uniform2i(gl.GetUniformLocation(colorizeProgram, "size"), width, height);
+        gl.Uniform1i(gl.GetUniformLocation(colorizeProgram, "maxIter"), palette.maxIter);
+        gl.DispatchCompute(groups(width), groups(height), 1);
+        // SDL samples the texture next
+        gl.MemoryBarrier(GL_TEXTURE_FETCH_BARRIER_BIT | GL_TEXTURE_UPDATE_BARRIER_BIT);
+    }
+
+    Functions gl = {};
+    SDL_Renderer* renderer = nullptr;
+    SDL_Texture* texture = nullptr;
+    GLuint textureName = 0;
+    int width = 0;
+    int height = 0;
+    GLuint iterateProgram = 0;
+    GLuint colorizeProgram = 0;
+    GLuint buffers[2] = {0, 0}; // counts, palette
+    GLint sdlProgram = 0;
+};
@@ -0,0 +1,340 @@
+#include <algorithm>
+#include <atomic>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+#include "MBAntialias.h"
+#include "MBBigFixed.h"
+#include "MBImageWriter.h"
+#include "MBIterationMap.h"
+#include "MBKernels.h"
+#include "MBPalette.h"
+#include "MBRender.h"
+#include "MBThreadPool.h"
+
+/*
+    Renders straight to a file, no window (and no SDL) needed. Meant for render nodes: posters way
+    bigger than the screen, or lots of thumbnails from a script.
+
+    The image is done in strips of rows. While the pool computes and colors one strip, the main
+    thread compresses and writes out the one before it, so the only memory in use is two strips
+    no matter how big the image is.
+
+    With --map the raw counts also go into an iteration map file (MBIterationMap.h), tile by tile
+    as each strip of tiles finishes, for recoloring later or opening in MBThreads.
+
+    With --aa every strip gets a second pass once it is in, supersampling just the pixels on the
+    boundary (MBAntialias.h). Those need their neighbours above and below, so each strip also
+    computes the row on either side of it.
+
+    g++ -O2 -o MBHeadless MBHeadless.cpp -pthread -lz
+    ./MBHeadless --size 32768 32768 --center -0.743643887037158704752191506114774 0.131825904205311970493132056385139 --zoom 1e6 --out poster.png
+*/
+
+const int DEFAULT_STRIP_ROWS = 64;
+
+struct Options {
+    int width = 800;
+    int height = 600;
+    const char* centerX = "-0.5";
+    const char* centerY = "0";
+    double zoom = 1.0;
+    int maxIter = 1000;
+    int stripRows = DEFAULT_STRIP_ROWS;
+    int threads = 0; // 0: one per core
+    PaletteScheme scheme = PaletteScheme::Sine;
+    bool perturbation = true;
+    bool smooth = false;
+    int antialias = 1; // samples per axis for boundary pixels, 1 is off
+    std::string out;
+    std::string map;
+};
+
+void printUsage(const char* program) {
+    std::cerr << "usage: " << program << " --out FILE.png|FILE.raw and/or --map FILE.mbmap [options]\n"
+              << "  --size W H         image size in pixels (800 600)\n"
+              << "  --center X Y       view center, any number of digits (-0.5 0)\n"
+              << "  --zoom Z           1 shows -2..2 on both axes (1)\n"
+              << "  --iter N           max iterations (1000)\n"
+              << "  --palette NAME     sine, fire or gray (sine)\n"
+              << "  --strip-rows N     rows computed per strip, bounds memory use (" << DEFAULT_STRIP_ROWS << ")\n"
+              << "  --threads N        worker threads (one per core)\n"
+              << "  --double-double    double-double instead of perturbation for deep zooms\n"
+              << "  --smooth           smooth colors instead of one band per iteration count\n"
+              << "  --aa N             N x N samples for pixels on the boundary, up to " << AA_MAX_SAMPLES << " (off)\n"
+              << "  --map FILE         also save the iteration counts as a tiled map (strips become one tile high)\n"
+              << "raw output is RGBA bytes, row after row, no header" << std::endl;
+}
+
+// False (after saying why) if the command line doesnt make sense
+bool parseOptions(int argc, char** argv, Options& options) {
+    for (int a = 1; a < argc; ++a) {
+        std::string arg = argv[a];
+        // How many values the option takes, checked before anything reads them
+        auto values = [&](int n) {
+            if (a + n < argc) return true;
+            std::cerr << arg << " needs " << n << " value" << (n > 1 ? "s" : "") << std::endl;
+            return false;
+        };
+
+        if (arg == "--size") {
+            if (!values(2)) return false;
+            options.width = std::atoi(argv[++a]);
+            options.height = std::atoi(argv[++a]);
+        } else if (arg == "--center") {
+            if (!values(2)) return false;
+            options.centerX = argv[++a];
+            options.centerY = argv[++a];
+        } else if (arg == "--zoom") {
+            if (!values(1)) return false;
+            options.zoom = std::atof(argv[++a]);
+        } else if (arg == "--iter") {
+            if (!values(1)) return false;
+            options.maxIter = std::atoi(argv[++a]);
+        } else if (arg == "--palette") {
+            if (!values(1)) return false;
+            std::string name = argv[++a];
+            bool found = false;
+            for (int k = 0; k < PALETTE_SCHEME_COUNT && !found; ++k) {
+                options.scheme = static_cast<PaletteScheme>(k);
+                found = name == paletteSchemeName(options.scheme);
+            }
+            if (!found) {
+                std::cerr << "unknown palette " << name << std::endl;
+                return false;
+            }
+        } else if (arg == "--strip-rows") {
+            if (!values(1)) return false;
+            options.stripRows = std::atoi(argv[++a]);
+        } else if (arg == "--threads") {
+            if (!values(1)) return false;
+            options.threads = std::atoi(argv[++a]);
+        } else if (arg == "--double-double") {
+            options.perturbation = false;
+        } else if (arg == "--smooth") {
+            options.smooth = true;
+        } else if (arg == "--aa") {
+            if (!values(1)) return false;
+            options.antialias = std::atoi(argv[++a]);
+        } else if (arg == "--out") {
+            if (!values(1)) return false;
+            options.out = argv[++a];
+        } else if (arg == "--map") {
+            if (!values(1)) return false;
+            options.map = argv[++a];
+        } else {
+            std::cerr << "unknown option " << arg << std::endl;
+            return false;
+        }
+    }
+
+    if (options.out.empty() && options.map.empty()) {
+        std::cerr << "no --out or --map file given" << std::endl;
+        return false;
+    }
+    if (options.width <= 0 || options.height <= 0 || options.maxIter <= 0 || options.stripRows <= 0 || options.threads < 0) {
+        std::cerr << "size, iterations and strip rows have to be positive" << std::endl;
+        return false;
+    }
+    if (options.antialias < 1 || options.antialias > AA_MAX_SAMPLES) {
+        std::cerr << "--aa goes from 1 (off) to " << AA_MAX_SAMPLES << std::endl;
+        return false;
+    }
+    if (!(options.zoom > 0.0 && options.zoom <= MAX_ZOOM)) {
+        std::cerr << "zoom has to be between 0 and " << MAX_ZOOM << std::endl;
+        return false;
+    }
+    return true;
+}
+
+int main(int argc, char** argv) {
+    Options options;
+    if (!parseOptions(argc, argv, options)) {
+        printUsage(argv[0]);
+        return 1;
+    }
+
+    View view;
+    view.width = options.width;
+    view.height = options.height;
+    view.zoom = options.zoom;
+    view.maxIter = options.maxIter;
+
+    BigFixed centerX, centerY;
+    if (!BigFixed::parse(options.centerX, centerX) || !BigFixed::parse(options.centerY, centerY)) {
+        std::cerr << "center has to be two decimal numbers" << std::endl;
+        return 1;
+    }
+    view.setCenter(centerX, centerY);
+
+    RenderSettings settings;
+    settings.perturbation = options.perturbation;
+
+    Palette palette;
+    palette.scheme = options.scheme;
+    palette.update(view.maxIter);
+
+    std::unique_ptr<ImageWriter> writer;
+    if (!options.out.empty()) {
+        writer = openImageWriter(options.out, view.width, view.height);
+        if (!writer) {
+            std::cerr << "cant create " << options.out << std::endl;
+            return 1;
+        }
+    }
+
+    int threads = options.threads > 0 ? options.threads : std::max(1u, std::thread::hardware_concurrency());
+    // The main thread is busy writing while a strip computes, so it doesnt count as a worker
+    ThreadPool pool(threads);
+
+    std::cout << "Rendering " << view.width << "x" << view.height << " with the " << activeKernel().name << " kernel on "
+              << threads << " threads" << std::endl;
+
+    // Same kernel for every strip, so a deep zoom does its reference orbit once
+    FrameKernel iterate = iterateFor(view, settings);
+    ColorizeFn colorizeRun = activeColorize();
+
+    // Sub pixel samples are closer together than pixels, which can take more precision
+    bool antialias = options.antialias > 1 && writer;
+    View fineView = view;
+    fineView.width *= options.antialias;
+    fineView.height *= options.antialias;
+    FrameKernel sampler = antialias ? iterateFor(fineView, settings) : iterate;
+    std::atomic<long long> supersampled(0);
+
+    std::unique_ptr<IterationMap> map;
+    if (!options.map.empty()) {
+        map = IterationMap::create(options.map, view, iterate.precision);
+        if (!map) {
+            std::cerr << "cant create " << options.map << std::endl;
+            return 1;
+        }
+        // A strip is then exactly one row of tiles, and can mark them done as soon as it is in
+        options.stripRows = map->tileSize();
+    }
+    IterationMap* mapOut = map.get();
+
+    int stripRows = std::min(options.stripRows, view.height);
+    int strips = (view.height + stripRows - 1) / stripRows;
+    size_t stripPixels = static_cast<size_t>(stripRows) * view.width;
+    // Counts have a row to spare at either end, for the rows around the strip (only filled in with --aa)
+    size_t stripCountsSize = stripPixels + 2 * static_cast<size_t>(view.width);
+    std::vector<uint32_t> counts[2] = {std::vector<uint32_t>(stripCountsSize), std::vector<uint32_t>(stripCountsSize)};
+    std::vector<uint32_t> pixels[2] = {std::vector<uint32_t>(stripPixels), std::vector<uint32_t>(stripPixels)};
+    // Smooth counts and distance estimates, one strip at a time is enough since they only go into colors
+    std::vector<float> smooth[2], distance[2];
+    if (options.smooth) {
+        for (int k = 0; k < 2; ++k) {
+            smooth[k].resize(stripPixels);
+            distance[k].resize(stripPixels);
+        }
+    }
+
+    auto rowsIn = [&](int strip) { return std::min(stripRows, view.height - strip * stripRows); };
+
+    // Each task is a band of rows of the strip: compute, then color while it is still in cache
+    auto startStrip = [&](int strip) {
+        int firstRow = strip * stripRows;
+        int rows = rowsIn(strip);
+        uint32_t* stripCounts = counts[strip % 2].data() + view.width;
+        uint32_t* stripPixels = pixels[strip % 2].data();
+        int bands = (rows + BAND_ROWS - 1) / BAND_ROWS;
+        bool rowAbove = antialias && firstRow > 0;
+        bool rowBelow = antialias && firstRow + rows < view.height;
+
+        bool color = writer != nullptr;
+        float* stripSmooth = options.smooth ? smooth[strip % 2].data() : nullptr;
+        float* stripDistance = options.smooth ? distance[strip % 2].data() : nullptr;
+
+        return pool.submit(bands, [=, &view, &iterate, &palette](int band) {
+            if (band == 0 && rowAbove) computeRow(iterate, view, firstRow - 1, 0, view.width, stripCounts - view.width);
+            if (band == bands - 1 && rowBelow) computeRow(iterate, view, firstRow + rows, 0, view.width, stripCounts + static_cast<size_t>(rows) * view.width);
+
+            for (int r = band * BAND_ROWS; r < std::min((band + 1) * BAND_ROWS, rows); ++r) {
+                size_t rowStart = static_cast<size_t>(r) * view.width;
+                uint32_t* rowCounts = stripCounts + rowStart;
+                uint32_t* rowPixels = stripPixels + rowStart;
+                if (stripSmooth) {
+                    iterate(view, firstRow + r, 0, 0, 1, view.width, rowCounts, stripSmooth + rowStart, stripDistance + rowStart);
+                    if (color) colorizeSmooth(stripSmooth + rowStart, view.width, palette.colors.data(), palette.maxIter, rowPixels);
+                } else {
+                    computeRow(iterate, view, firstRow + r, 0, view.width, rowCounts);
+                    if (color) colorizeRun(rowCounts, view.width, palette.colors.data(), palette.maxIter, rowPixels);
+                }
+                // Cut the row up over the tiles it crosses
+                if (mapOut) {
+                    int t = mapOut->tileSize();
+                    for (int tx = 0; tx * t < view.width; ++tx) {
+                        int n = std::min(t, view.width - tx * t);
+                        std::memcpy(mapOut->tile(tx, strip) + r * t, rowCounts + tx * t, n * sizeof(uint32_t));
+                    }
+                }
+            }
+        });
+    };
+
+    // Second pass over a finished strip, redoing the pixels on the boundary
+    auto antialiasStrip = [&](int strip) {
+        int firstRow = strip * stripRows;
+        int rows = rowsIn(strip);
+        const uint32_t* stripCounts = counts[strip % 2].data() + view.width;
+        const float* stripDistance = options.smooth ? distance[strip % 2].data() : nullptr;
+        uint32_t* stripPixels = pixels[strip % 2].data();
+        int bands = (rows + BAND_ROWS - 1) / BAND_ROWS;
+
+        return pool.submit(bands, [=, &view, &sampler, &palette, &options, &supersampled](int band) {
+            long long redone = 0;
+            for (int r = band * BAND_ROWS; r < std::min((band + 1) * BAND_ROWS, rows); ++r) {
+                size_t rowStart = static_cast<size_t>(r) * view.width;
+                const uint32_t* row = stripCounts + rowStart;
+                const uint32_t* above = firstRow + r > 0 ? row - view.width : nullptr;
+                const uint32_t* below = firstRow + r + 1 < view.height ? row + view.width : nullptr;
+                redone += antialiasRow(sampler, view, firstRow + r, above, row, below, stripDistance ? stripDistance + rowStart : nullptr,
+                                       palette, options.smooth, options.antialias, stripPixels + rowStart);
+            }
+            supersampled += redone;
+        });
+    };
+
+    bool ok = true;
+    auto job = startStrip(0);
+    for (int strip = 0; strip < strips && ok; ++strip) {
+        pool.wait(job);
+        // Goes into this strip's buffers only, so the next strip can compute alongside it
+        std::shared_ptr<ThreadPool::Job> pass = antialias ? antialiasStrip(strip) : nullptr;
+        if (strip + 1 < strips) job = startStrip(strip + 1);
+        if (pass) pool.wait(pass);
+
+        if (map) {
+            for (int tx = 0; tx < map->tilesX(); ++tx) map->markTileDone(tx, strip);
+        }
+        if (writer) ok = writer->writeRows(pixels[strip % 2].data(), rowsIn(strip), view.width * 4);
+    }
+    // Dont leave a strip running into buffers that are about to go away
+    pool.wait(job);
+
+    if (writer) {
+        ok = writer->finish() && ok;
+        if (!ok) {
+            std::cerr << "writing " << options.out << " failed" << std::endl;
+            return 1;
+        }
+        std::cout << "Wrote " << options.out << std::endl;
+    }
+    if (antialias) {
+        double share = 100.0 * supersampled.load() / (static_cast<double>(view.width) * view.height);
+        std::cout << "Supersampled " << supersampled.load() << " pixels (" << share << "%) with " << options.antialias << "x"
+                  << options.antialias << " samples each" << std::endl;
+    }
+    if (map) {
+        if (!map->flush()) {
+            std::cerr << "writing " << options.map << " failed" << std::endl;
+            return 1;
+        }
+        std::cout << "Wrote " << options.map << " (" << iterate.precision << ")" << std::endl;
+    }
+    return 0;
+}
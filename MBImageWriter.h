@@ -0,0 +1,168 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <string>
+#include <vector>
+#include <zlib.h>
+
+/*
+    Writing images a few rows at a time, so a huge render never has to sit in memory all at once.
+    Rows come in as the same RGBA8888 words the texture uses (see packRGBA), top row first.
+
+    PNG goes through zlib (link with -lz): the IDAT data is one deflate stream, and every time the
+    output buffer fills up it goes out as its own IDAT chunk. Raw is just the RGBA bytes with no
+    header, for piping into other tools (convert -size WxH -depth 8 rgba:file.raw out.tif).
+*/
+class ImageWriter {
+public:
+    virtual ~ImageWriter() = default;
+
+    // rows full rows of width pixels, each row bytesPerRow apart. False once the file cant be written.
+    virtual bool writeRows(const uint32_t* pixels, int rows, int bytesPerRow) = 0;
+    // Flushes everything and closes the file, false if any of it went wrong
+    virtual bool finish() = 0;
+};
+
+// Bytes in memory order r, g, b(, a) for one row of packed RGBA words
+inline void unpackRow(const uint32_t* pixels, int width, bool alpha, uint8_t* out) {
+    for (int j = 0; j < width; ++j) {
+        uint32_t c = pixels[j];
+        *out++ = static_cast<uint8_t>(c >> 24);
+        *out++ = static_cast<uint8_t>(c >> 16);
+        *out++ = static_cast<uint8_t>(c >> 8);
+        if (alpha) *out++ = static_cast<uint8_t>(c);
+    }
+}
+
+class RawWriter : public ImageWriter {
+public:
+    RawWriter(FILE* file, int width) : file(file), width(width), line(static_cast<size_t>(width) * 4) {}
+    ~RawWriter() override { if (file) std::fclose(file); }
+
+    bool writeRows(const uint32_t* pixels, int rows, int bytesPerRow) override {
+        for (int i = 0; i < rows && ok; ++i) {
+            unpackRow(pixels + static_cast<size_t>(i) * (bytesPerRow / 4), width, true, line.data());
+            ok = std::fwrite(line.data(), 1, line.size(), file) == line.size();
+        }
+        return ok;
+    }
+
+    bool finish() override {
+        ok = std::fclose(file) == 0 && ok;
+        file = nullptr;
+        return ok;
+    }
+
+private:
+    FILE* file;
+    int width;
+    std::vector<uint8_t> line;
+    bool ok = true;
+};
+
+// 8 bit RGB, no alpha (it is always opaque anyway), no interlacing, filter type 0 on every row
+class PngWriter : public ImageWriter {
+public:
+    PngWriter(FILE* file, int width, int height) : file(file), width(width), line(1 + static_cast<size_t>(width) * 3), out(OUT_CHUNK) {
+        deflateInit(&stream, Z_DEFAULT_COMPRESSION);
+        streamOpen = true;
+
+        static const uint8_t signature[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n'};
+        ok = std::fwrite(signature, 1, sizeof(signature), file) == sizeof(signature);
+
+        uint8_t header[13];
+        putBigEndian(header, static_cast<uint32_t>(width));
+        putBigEndian(header + 4, static_cast<uint32_t>(height));
+        header[8] = 8;  // bits per channel
+        header[9] = 2;  // RGB
+        header[10] = 0; // deflate
+        header[11] = 0; // adaptive filtering (we only ever pick None)
+        header[12] = 0; // no interlace
+        writeChunk("IHDR", header, sizeof(header));
+    }
+
+    ~PngWriter() override {
+        if (streamOpen) deflateEnd(&stream);
+        if (file) std::fclose(file);
+    }
+
+    bool writeRows(const uint32_t* pixels, int rows, int bytesPerRow) override {
+        for (int i = 0; i < rows && ok; ++i) {
+            line[0] = 0; // filter: none
+            unpackRow(pixels + static_cast<size_t>(i) * (bytesPerRow / 4), width, false, line.data() + 1);
+            compress(line.data(), line.size(), Z_NO_FLUSH);
+        }
+        return ok;
+    }
+
+    bool finish() override {
+        compress(nullptr, 0, Z_FINISH);
+        deflateEnd(&stream);
+        streamOpen = false;
+        writeChunk("IEND", nullptr, 0);
+        ok = std::fclose(file) == 0 && ok;
+        file = nullptr;
+        return ok;
+    }
+
+private:
+    static const size_t OUT_CHUNK = 1 << 18; // bytes of compressed data per IDAT chunk
+
+    static void putBigEndian(uint8_t* at, uint32_t value) {
+        at[0] = static_cast<uint8_t>(value >> 24);
+        at[1] = static_cast<uint8_t>(value >> 16);
+        at[2] = static_cast<uint8_t>(value >> 8);
+        at[3] = static_cast<uint8_t>(value);
+    }
+
+    // length, type, data, crc of type + data
+    void writeChunk(const char* type, const uint8_t* data, size_t size) {
+        if (!ok) return;
+        uint8_t length[4], crc[4];
+        putBigEndian(length, static_cast<uint32_t>(size));
+        uLong sum = crc32(0, reinterpret_cast<const Bytef*>(type), 4);
+        if (size > 0) sum = crc32(sum, data, static_cast<uInt>(size));
+        putBigEndian(crc, static_cast<uint32_t>(sum));
+
+        ok = std::fwrite(length, 1, 4, file) == 4 && std::fwrite(type, 1, 4, file) == 4 &&
+             (size == 0 || std::fwrite(data, 1, size, file) == size) && std::fwrite(crc, 1, 4, file) == 4;
+    }
+
+    // Feeds bytes to deflate, every full output buffer becomes an IDAT chunk
+    void compress(const uint8_t* data, size_t size, int flush) {
+        stream.next_in = const_cast<Bytef*>(data);
+        stream.avail_in = static_cast<uInt>(size);
+        int result;
+        do {
+            stream.next_out = out.data() + pending;
+            stream.avail_out = static_cast<uInt>(out.size() - pending);
+            result = deflate(&stream, flush);
+            pending = out.size() - stream.avail_out;
+            if (pending == out.size() || (flush == Z_FINISH && pending > 0)) {
+                writeChunk("IDAT", out.data(), pending);
+                pending = 0;
+            }
+        } while (ok && (stream.avail_in > 0 || (flush == Z_FINISH && result != Z_STREAM_END)));
+    }
+
+    FILE* file;
+    int width;
+    std::vector<uint8_t> line;
+    std::vector<uint8_t> out;
+    size_t pending = 0;
+    z_stream stream = {};
+    bool streamOpen = false;
+    bool ok = true;
+};
+
+// PNG if path ends in .png, raw RGBA otherwise. Null if the file cant be created.
+inline std::unique_ptr<ImageWriter> openImageWriter(const std::string& path, int width, int height) {
+    FILE* file = std::fopen(path.c_str(), "wb");
+    if (!file) return nullptr;
+
+    bool png = path.size() >= 4 && path.compare(path.size() - 4, 4, ".png") == 0;
+    if (png) return std::unique_ptr<ImageWriter>(new PngWriter(file, width, height));
+    return std::unique_ptr<ImageWriter>(new RawWriter(file, width));
+}
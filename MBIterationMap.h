@@ -0,0 +1,274 @@
+#pragma once
+
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "MBBigFixed.h"
+#include "MBRender.h"
+#include "MBThreadPool.h"
+
+/*
+    Iteration counts saved to disk, so a huge render can be recolored (or looked at again) without
+    computing any of it a second time.
+
+    Layout, all little endian:
+        header          IterationMapHeader, the view it was rendered for and how
+        tile table      one byte per tile, 1 once the tile is complete
+        tiles           from the first page boundary after the table, every tile tileSize x tileSize
+                        counts row after row, tile after tile going right then down. Tiles hanging
+                        off the right / bottom edge are padded to full size.
+
+    The whole file gets mmap'd, nothing is read up front. The renderer writes into the mapping
+    directly and the OS pages tiles in (and out) as they are touched, so a gigapixel map costs
+    about as much memory as whatever part of it is being worked on. Because every finished tile
+    is flagged in the table, a map can be opened and looked at while it is still being rendered.
+*/
+
+const char ITERATION_MAP_MAGIC[8] = {'M', 'B', 'I', 'T', 'M', 'A', 'P', '\0'};
+const uint32_t ITERATION_MAP_VERSION = 1;
+const uint32_t ITERATION_MAP_COUNTS = 0; // uint32 iteration counts, maxIter means inside the set
+const int ITERATION_MAP_TILE_SIZE = 256;
+
+struct IterationMapHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t valueType;
+    uint32_t width;
+    uint32_t height;
+    uint32_t tileSize;
+    uint32_t maxIter;
+    double zoom;
+    double offsetX; // the center rounded to double, for tools that dont care about BigFixed
+    double offsetY;
+    uint32_t centerX[BigFixed::LIMBS];
+    uint32_t centerY[BigFixed::LIMBS];
+    char precision[16]; // what iterateFor picked, see FrameKernel
+    uint64_t tileTableOffset;
+    uint64_t dataOffset;
+};
+
+class IterationMap {
+public:
+    ~IterationMap() {
+        if (base) munmap(base, size);
+        if (fd >= 0) close(fd);
+    }
+
+    IterationMap(const IterationMap&) = delete;
+    IterationMap& operator=(const IterationMap&) = delete;
+
+    // New map for view at path (replacing whatever was there), every tile still missing.
+    // Null if the file cant be made.
+    static std::unique_ptr<IterationMap> create(const std::string& path, const View& view, const char* precision,
+                                                int tileSize = ITERATION_MAP_TILE_SIZE) {
+        IterationMapHeader header = {};
+        std::memcpy(header.magic, ITERATION_MAP_MAGIC, sizeof(header.magic));
+        header.version = ITERATION_MAP_VERSION;
+        header.valueType = ITERATION_MAP_COUNTS;
+        header.width = static_cast<uint32_t>(view.width);
+        header.height = static_cast<uint32_t>(view.height);
+        header.tileSize = static_cast<uint32_t>(tileSize);
+        header.maxIter = static_cast<uint32_t>(view.maxIter);
+        header.zoom = view.zoom;
+        header.offsetX = view.offsetX;
+        header.offsetY = view.offsetY;
+        view.centerX.toWords(header.centerX);
+        view.centerY.toWords(header.centerY);
+        std::strncpy(header.precision, precision, sizeof(header.precision) - 1);
+
+        uint64_t tiles = tileCount(header);
+        uint64_t page = static_cast<uint64_t>(sysconf(_SC_PAGESIZE));
+        header.tileTableOffset = sizeof(IterationMapHeader);
+        header.dataOffset = (header.tileTableOffset + tiles + page - 1) / page * page;
+        uint64_t fileSize = header.dataOffset + tiles * tileSize * tileSize * sizeof(uint32_t);
+
+        int fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) return nullptr;
+        // Sparse, tiles only take up disk once something is written into them
+        if (ftruncate(fd, static_cast<off_t>(fileSize)) != 0) {
+            close(fd);
+            return nullptr;
+        }
+
+        std::unique_ptr<IterationMap> map = mapFile(fd, fileSize, true);
+        if (map) std::memcpy(map->base, &header, sizeof(header));
+        return map;
+    }
+
+    // Existing map, read only. Null if it cant be opened or isnt a map we understand.
+    static std::unique_ptr<IterationMap> open(const std::string& path) {
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) return nullptr;
+
+        struct stat info;
+        if (fstat(fd, &info) != 0 || static_cast<uint64_t>(info.st_size) < sizeof(IterationMapHeader)) {
+            close(fd);
+            return nullptr;
+        }
+
+        // Sampled zoomed out views jump all over the file, read ahead would mostly load pages nobody wants
+        std::unique_ptr<IterationMap> map = mapFile(fd, static_cast<uint64_t>(info.st_size), false);
+        if (!map) return nullptr;
+        madvise(map->base, map->size, MADV_RANDOM);
+
+        const IterationMapHeader& header = map->header();
+        bool good = std::memcmp(header.magic, ITERATION_MAP_MAGIC, sizeof(header.magic)) == 0 &&
+                    header.version == ITERATION_MAP_VERSION && header.valueType == ITERATION_MAP_COUNTS &&
+                    header.tileSize > 0 && header.width > 0 && header.height > 0 &&
+                    header.tileTableOffset + tileCount(header) <= header.dataOffset &&
+                    header.dataOffset + tileCount(header) * header.tileSize * header.tileSize * sizeof(uint32_t) <= map->size;
+        if (!good) return nullptr;
+        return map;
+    }
+
+    const IterationMapHeader& header() const { return *reinterpret_cast<const IterationMapHeader*>(base); }
+
+    // The view the counts were rendered for
+    View view() const {
+        const IterationMapHeader& h = header();
+        View v;
+        v.width = static_cast<int>(h.width);
+        v.height = static_cast<int>(h.height);
+        v.zoom = h.zoom;
+        v.maxIter = static_cast<int>(h.maxIter);
+        v.setCenter(BigFixed::fromWords(h.centerX), BigFixed::fromWords(h.centerY));
+        return v;
+    }
+
+    int tileSize() const { return static_cast<int>(header().tileSize); }
+    int tilesX() const { return static_cast<int>((header().width + header().tileSize - 1) / header().tileSize); }
+    int tilesY() const { return static_cast<int>((header().height + header().tileSize - 1) / header().tileSize); }
+
+    // Counts of tile (tx, ty), tileSize per row
+    uint32_t* tile(int tx, int ty) { return tileData(tx, ty); }
+    const uint32_t* tile(int tx, int ty) const { return tileData(tx, ty); }
+
+    // Flags go in after the counts, so whoever sees one set also sees the counts behind it
+    bool tileDone(int tx, int ty) const {
+        bool done = table()[ty * tilesX() + tx] != 0;
+        std::atomic_thread_fence(std::memory_order_acquire);
+        return done;
+    }
+    void markTileDone(int tx, int ty) {
+        std::atomic_thread_fence(std::memory_order_release);
+        table()[ty * tilesX() + tx] = 1;
+    }
+
+    bool complete() const {
+        for (int ty = 0; ty < tilesY(); ++ty) {
+            for (int tx = 0; tx < tilesX(); ++tx) {
+                if (!tileDone(tx, ty)) return false;
+            }
+        }
+        return true;
+    }
+
+    // Count at pixel (row i, column j) of the map
+    uint32_t at(int i, int j) const {
+        int t = tileSize();
+        return tile(j / t, i / t)[(i % t) * t + j % t];
+    }
+
+    // Asks the OS to start reading these tiles in the background
+    void prefetch(int tx, int ty) const {
+        uint64_t page = static_cast<uint64_t>(sysconf(_SC_PAGESIZE));
+        uint64_t start = reinterpret_cast<uintptr_t>(tile(tx, ty)) / page * page;
+        uint64_t end = reinterpret_cast<uintptr_t>(tile(tx, ty) + tileSize() * tileSize());
+        madvise(reinterpret_cast<void*>(start), end - start, MADV_WILLNEED);
+    }
+
+    // Writes everything out (the OS would get to it eventually anyway), false if that failed
+    bool flush() { return msync(base, size, MS_SYNC) == 0; }
+
+private:
+    IterationMap() = default;
+
+    static uint64_t tileCount(const IterationMapHeader& h) {
+        uint64_t across = (h.width + h.tileSize - 1) / h.tileSize;
+        uint64_t down = (h.height + h.tileSize - 1) / h.tileSize;
+        return across * down;
+    }
+
+    static std::unique_ptr<IterationMap> mapFile(int fd, uint64_t size, bool writable) {
+        int protection = writable ? PROT_READ | PROT_WRITE : PROT_READ;
+        void* base = mmap(nullptr, size, protection, MAP_SHARED, fd, 0);
+        if (base == MAP_FAILED) {
+            close(fd);
+            return nullptr;
+        }
+
+        std::unique_ptr<IterationMap> map(new IterationMap());
+        map->fd = fd;
+        map->base = static_cast<uint8_t*>(base);
+        map->size = size;
+        return map;
+    }
+
+    uint8_t* table() const { return base + header().tileTableOffset; }
+
+    uint32_t* tileData(int tx, int ty) const {
+        uint64_t index = static_cast<uint64_t>(ty) * tilesX() + tx;
+        uint64_t tileBytes = static_cast<uint64_t>(tileSize()) * tileSize() * sizeof(uint32_t);
+        return reinterpret_cast<uint32_t*>(base + header().dataOffset + index * tileBytes);
+    }
+
+    int fd = -1;
+    uint8_t* base = nullptr;
+    uint64_t size = 0;
+};
+
+/*
+    Fills iters for view straight from a map, no iterating at all, as long as view is no more
+    zoomed in than the map and lies inside it (with the same maxIter). Each screen pixel takes
+    the nearest map pixel. False if any of that doesnt hold or a tile it needs isnt done yet.
+
+    Runs on the pool so the page faults for tiles that arent in memory yet happen on all the
+    workers at once instead of one after another.
+*/
+inline bool sampleIterationMap(ThreadPool& pool, const IterationMap& map, const View& view, IterationBuffer& iters) {
+    View from = map.view();
+    if (view.maxIter != from.maxIter || view.stepX() < from.stepX() || view.stepY() < from.stepY()) return false;
+
+    // Map column of screen column j is (centerDx + deltaX(j)) / map step + map width / 2, same for rows
+    double centerDx = (view.centerX - from.centerX).toDouble();
+    double centerDy = (view.centerY - from.centerY).toDouble();
+    auto mapColumn = [&](int j) { return static_cast<int>(std::floor((centerDx + view.deltaX(j)) / from.stepX() + from.width / 2.0 + 0.5)); };
+    auto mapRow = [&](int i) { return static_cast<int>(std::floor((centerDy + view.deltaY(i)) / from.stepY() + from.height / 2.0 + 0.5)); };
+
+    int left = mapColumn(0), right = mapColumn(view.width - 1);
+    int top = mapRow(0), bottom = mapRow(view.height - 1);
+    if (left < 0 || top < 0 || right >= from.width || bottom >= from.height) return false;
+
+    int t = map.tileSize();
+    for (int ty = top / t; ty <= bottom / t; ++ty) {
+        for (int tx = left / t; tx <= right / t; ++tx) {
+            if (!map.tileDone(tx, ty)) return false;
+        }
+    }
+
+    if (iters.width != view.width || iters.height != view.height) iters.resize(pool, view.width, view.height);
+    iters.valid = false;
+
+    std::vector<int> columns(view.width);
+    for (int j = 0; j < view.width; ++j) columns[j] = mapColumn(j);
+
+    int bands = (view.height + BAND_ROWS - 1) / BAND_ROWS;
+    pool.parallelFor(bands, [&](int band) {
+        for (int i = band * BAND_ROWS; i < std::min((band + 1) * BAND_ROWS, view.height); ++i) {
+            int r = mapRow(i);
+            uint32_t* row = iters.row(i);
+            for (int j = 0; j < view.width; ++j) row[j] = map.at(r, columns[j]);
+        }
+    });
+
+    iters.view = view;
+    iters.valid = true;
+    return true;
+}
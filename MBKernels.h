@@ -0,0 +1,651 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define MB_X86 1
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#define MB_NEON 1
+#if defined(__linux__)
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#endif
+#endif
+
+/*
+    One kernel interface, many instruction sets.
+
+    Every version computes the same thing: iteration counts for a run of points along a line in
+    the complex plane. What differs is how many doubles fit in a register:
+        scalar  1 lane   fallback for anything we dont know about
+        SSE2    2 lanes  every x86-64 cpu has it
+        AVX2    4 lanes  __m256d + FMA
+        AVX-512 8 lanes  __m512d, uses the k mask registers for the per lane escape test
+        NEON    2 lanes  float64x2_t on ARM (Graviton etc)
+
+    The AVX2 and AVX-512 versions are compiled with target pragmas instead of -mavx2 / -mavx512f
+    for the whole file, so the rest of the program stays plain x86-64. Which one actually runs is
+    decided once at startup from CPUID, so the same binary uses 8 lanes on a Xeon and doesnt die
+    with SIGILL on an older box.
+*/
+
+// Point k of the run is (x0 + k * dx, y0 + k * dy), out[k] gets its iteration count
+using IterateFn = void (*)(double x0, double y0, double dx, double dy, int count, int maxIter, uint32_t* out);
+
+// Same, plus the smooth iteration count and distance estimate of every point (see iterateRunSmooth)
+using IterateSmoothFn = void (*)(double x0, double y0, double dx, double dy, int count, int maxIter, uint32_t* out, float* smooth, float* distance);
+
+// Orbit of the reference point C (the view center) for perturbation, Z_0 = 0 up to the first Z that
+// escaped or Z_maxIter. Worked out in high precision (see MBPerturbation.h) and rounded to doubles,
+// which is fine because |Z| stays around 2 and only the small per pixel deltas need the fine bits.
+struct ReferenceOrbit {
+    std::vector<double> re, im;
+    double centerX = 0.0, centerY = 0.0; // C rounded to double, only good enough for the cardioid test
+
+    // Series approximation (see computeSeries in MBPerturbation.h). Every pixel of the view can
+    // start at iteration skip with
+    //     dz_skip = sum over k of series[k] * (dc / seriesRadius)^(k + 1)
+    // instead of iterating its way there. skip = 0 means no shortcut.
+    int skip = 0;
+    std::vector<double> seriesRe, seriesIm;
+    double seriesRadius = 1.0;
+
+    // Index of the last Z we have
+    int last() const { return static_cast<int>(re.size()) - 1; }
+};
+
+// Double-double version of IterateFn: point k is (x0 + x0Low + k * dx, y0 + y0Low + k * dy), the
+// Low parts carrying the bits of the start point that dont fit in x0 / y0
+using IterateDDFn = void (*)(double x0, double x0Low, double y0, double y0Low, double dx, double dy, int count, int maxIter, uint32_t* out);
+
+// Perturbation version of IterateFn. Point k of the run is C + (x0 + k * dx, y0 + k * dy), so the
+// x0 .. dy here are offsets from the reference point and can be far below a double ulp of C.
+using PerturbFn = void (*)(const ReferenceOrbit& ref, double x0, double y0, double dx, double dy, int count, int maxIter, uint32_t* out);
+
+struct Kernel {
+    const char* name;
+    int lanes;
+    IterateFn iterate;
+    // Same loop in single precision, twice the lanes per register
+    int floatLanes;
+    IterateFn iterateFloat;
+    // Lane refill versions, finished lanes pick up the next pixel instead of idling
+    IterateFn iterateRefill;
+    IterateFn iterateFloatRefill;
+    // Several groups of lanes in flight at once, escape checked every few iterations
+    IterateFn iterateInterleaved;
+    IterateFn iterateFloatInterleaved;
+    // Carry dz/dc along too, for smooth counts and distance estimates
+    IterateSmoothFn iterateSmooth;
+    IterateSmoothFn iterateFloatSmooth;
+    // Mid range zooms, hi + lo pairs of doubles for about 106 bits
+    IterateDDFn iterateDoubleDouble;
+    // Deep zoom, iterates offsets from a ReferenceOrbit instead of absolute coordinates
+    PerturbFn iteratePerturbed;
+};
+
+// Running totals of what the kernels did on the calling thread, for the profiler (see MBStats.h).
+// They only get bumped once per group of lanes, so keeping them costs next to nothing.
+struct KernelCounters {
+    uint64_t laneSteps = 0;  // trips round the iteration loop times lanes per register
+    uint64_t iterations = 0; // how many of those were a lane actually iterating a pixel of the run
+};
+
+inline KernelCounters& kernelCounters() {
+    thread_local KernelCounters counters;
+    return counters;
+}
+
+// Main cardioid and period 2 bulb have closed forms, anything in there is in the set and would
+// just burn through all maxIter iterations
+inline bool inMainCardioidOrBulb(double x, double y) {
+    double xq = x - 0.25;
+    double q = xq * xq + y * y;
+    if (q * (q + xq) <= 0.25 * y * y) return true;
+    return (x + 1.0) * (x + 1.0) + y * y <= 0.0625;
+}
+
+// Plain C++ version, 1 lane at a time
+namespace mb_scalar {
+    struct VecD {
+        static constexpr int LANES = 1;
+        using Scalar = double;
+        using Mask = bool;
+        static constexpr bool FUSED_FMA = false; // fma() here is a plain multiply and add, rounded twice
+        double v;
+
+        static VecD set1(double x) { return {x}; }
+        static VecD ramp(double start, double) { return {start}; }
+        static VecD load(const double* p) { return {p[0]}; }
+    };
+
+    inline VecD add(VecD a, VecD b) { return {a.v + b.v}; }
+    inline VecD sub(VecD a, VecD b) { return {a.v - b.v}; }
+    inline VecD mul(VecD a, VecD b) { return {a.v * b.v}; }
+    inline VecD fma(VecD a, VecD b, VecD c) { return {a.v * b.v + c.v}; }
+    inline bool lessThan(VecD a, VecD b) { return a.v < b.v; }
+    inline bool anyLane(bool m) { return m; }
+    inline VecD incrementWhere(VecD n, bool m, VecD one) { return m ? add(n, one) : n; }
+    inline void storeCounts(VecD n, uint32_t* out, int) { out[0] = static_cast<uint32_t>(n.v); }
+    inline void store(VecD a, double* p) { p[0] = a.v; }
+    inline VecD gather(const double* base, VecD index) { return {base[static_cast<int>(index.v)]}; }
+    // a where the mask is set, b everywhere else
+    inline VecD select(bool m, VecD a, VecD b) { return m ? a : b; }
+    inline bool orMask(bool a, bool b) { return a || b; }
+    inline bool andMask(bool a, bool b) { return a && b; }
+    // One bit per lane, lane 0 in bit 0
+    inline int laneBits(bool m) { return m ? 1 : 0; }
+
+    struct VecF {
+        static constexpr int LANES = 1;
+        using Scalar = float;
+        using Mask = bool;
+        float v;
+
+        static VecF set1(double x) { return {static_cast<float>(x)}; }
+        static VecF ramp(double start, double) { return {static_cast<float>(start)}; }
+        static VecF load(const float* p) { return {p[0]}; }
+    };
+
+    inline VecF add(VecF a, VecF b) { return {a.v + b.v}; }
+    inline VecF sub(VecF a, VecF b) { return {a.v - b.v}; }
+    inline VecF mul(VecF a, VecF b) { return {a.v * b.v}; }
+    inline VecF fma(VecF a, VecF b, VecF c) { return {a.v * b.v + c.v}; }
+    inline bool lessThan(VecF a, VecF b) { return a.v < b.v; }
+    inline VecF incrementWhere(VecF n, bool m, VecF one) { return m ? add(n, one) : n; }
+    inline void storeCounts(VecF n, uint32_t* out, int) { out[0] = static_cast<uint32_t>(n.v); }
+    inline void store(VecF a, float* p) { p[0] = a.v; }
+    // a where the mask is set, b everywhere else
+    inline VecF select(bool m, VecF a, VecF b) { return m ? a : b; }
+
+    #include "MBKernelBody.inc"
+}
+
+#if MB_X86
+// SSE2 is part of x86-64 so this one needs no special flags
+namespace mb_sse2 {
+    struct VecD {
+        static constexpr int LANES = 2;
+        using Scalar = double;
+        using Mask = __m128d;
+        static constexpr bool FUSED_FMA = false; // fma() here is a plain multiply and add, rounded twice
+        __m128d v;
+
+        static VecD set1(double x) { return {_mm_set1_pd(x)}; }
+        static VecD ramp(double start, double step) { return {_mm_set_pd(start + step, start)}; }
+        static VecD load(const double* p) { return {_mm_loadu_pd(p)}; }
+    };
+
+    inline VecD add(VecD a, VecD b) { return {_mm_add_pd(a.v, b.v)}; }
+    inline VecD sub(VecD a, VecD b) { return {_mm_sub_pd(a.v, b.v)}; }
+    inline VecD mul(VecD a, VecD b) { return {_mm_mul_pd(a.v, b.v)}; }
+    inline VecD fma(VecD a, VecD b, VecD c) { return {_mm_add_pd(_mm_mul_pd(a.v, b.v), c.v)}; }
+    inline __m128d lessThan(VecD a, VecD b) { return _mm_cmplt_pd(a.v, b.v); }
+    inline bool anyLane(__m128d m) { return _mm_movemask_pd(m) != 0; }
+    // Mask lanes are all 1s or all 0s, so AND with 1.0 gives 1.0 or 0.0 to add
+    inline VecD incrementWhere(VecD n, __m128d m, VecD one) { return {_mm_add_pd(n.v, _mm_and_pd(m, one.v))}; }
+    inline void storeCounts(VecD n, uint32_t* out, int count) {
+        alignas(16) int32_t tmp[4];
+        _mm_store_si128(reinterpret_cast<__m128i*>(tmp), _mm_cvttpd_epi32(n.v));
+        for (int k = 0; k < count; ++k) out[k] = static_cast<uint32_t>(tmp[k]);
+    }
+    inline void store(VecD a, double* p) { _mm_storeu_pd(p, a.v); }
+    // base[index] per lane, index holds whole numbers
+    inline VecD gather(const double* base, VecD index) {
+        __m128i i = _mm_cvttpd_epi32(index.v);
+        return {_mm_set_pd(base[_mm_cvtsi128_si32(_mm_srli_si128(i, 4))], base[_mm_cvtsi128_si32(i)])};
+    }
+    // a where the mask is set, b everywhere else
+    inline VecD select(__m128d m, VecD a, VecD b) { return {_mm_or_pd(_mm_and_pd(m, a.v), _mm_andnot_pd(m, b.v))}; }
+    inline __m128d orMask(__m128d a, __m128d b) { return _mm_or_pd(a, b); }
+    inline __m128d andMask(__m128d a, __m128d b) { return _mm_and_pd(a, b); }
+    // One bit per lane, lane 0 in bit 0
+    inline int laneBits(__m128d m) { return _mm_movemask_pd(m); }
+
+    struct VecF {
+        static constexpr int LANES = 4;
+        using Scalar = float;
+        using Mask = __m128;
+        __m128 v;
+
+        static VecF set1(double x) { return {_mm_set1_ps(static_cast<float>(x))}; }
+        static VecF ramp(double start, double step) {
+            return {_mm_add_ps(_mm_set1_ps(static_cast<float>(start)), _mm_mul_ps(_mm_set1_ps(static_cast<float>(step)), _mm_set_ps(3.0f, 2.0f, 1.0f, 0.0f)))};
+        }
+        static VecF load(const float* p) { return {_mm_loadu_ps(p)}; }
+    };
+
+    inline VecF add(VecF a, VecF b) { return {_mm_add_ps(a.v, b.v)}; }
+    inline VecF sub(VecF a, VecF b) { return {_mm_sub_ps(a.v, b.v)}; }
+    inline VecF mul(VecF a, VecF b) { return {_mm_mul_ps(a.v, b.v)}; }
+    inline VecF fma(VecF a, VecF b, VecF c) { return {_mm_add_ps(_mm_mul_ps(a.v, b.v), c.v)}; }
+    inline __m128 lessThan(VecF a, VecF b) { return _mm_cmplt_ps(a.v, b.v); }
+    inline bool anyLane(__m128 m) { return _mm_movemask_ps(m) != 0; }
+    inline VecF incrementWhere(VecF n, __m128 m, VecF one) { return {_mm_add_ps(n.v, _mm_and_ps(m, one.v))}; }
+    inline void storeCounts(VecF n, uint32_t* out, int count) {
+        __m128i counts = _mm_cvttps_epi32(n.v);
+        if (count == 4) {
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(out), counts);
+            return;
+        }
+        alignas(16) int32_t tmp[4];
+        _mm_store_si128(reinterpret_cast<__m128i*>(tmp), counts);
+        for (int k = 0; k < count; ++k) out[k] = static_cast<uint32_t>(tmp[k]);
+    }
+    inline void store(VecF a, float* p) { _mm_storeu_ps(p, a.v); }
+    // a where the mask is set, b everywhere else
+    inline VecF select(__m128 m, VecF a, VecF b) { return {_mm_or_ps(_mm_and_ps(m, a.v), _mm_andnot_ps(m, b.v))}; }
+    inline __m128 orMask(__m128 a, __m128 b) { return _mm_or_ps(a, b); }
+    inline __m128 andMask(__m128 a, __m128 b) { return _mm_and_ps(a, b); }
+    // One bit per lane, lane 0 in bit 0
+    inline int laneBits(__m128 m) { return _mm_movemask_ps(m); }
+
+    #include "MBKernelBody.inc"
+}
+
+#if defined(__clang__)
+#pragma clang attribute push(__attribute__((target("avx2,fma"))), apply_to = function)
+#else
+#pragma GCC push_options
+#pragma GCC target("avx2,fma")
+#endif
+namespace mb_avx2 {
+    struct VecD {
+        static constexpr int LANES = 4;
+        using Scalar = double;
+        using Mask = __m256d;
+        static constexpr bool FUSED_FMA = true; // fma() is one rounding, not a multiply and an add
+        __m256d v;
+
+        static VecD set1(double x) { return {_mm256_set1_pd(x)}; }
+        static VecD ramp(double start, double step) {
+            return {_mm256_add_pd(_mm256_set1_pd(start), _mm256_mul_pd(_mm256_set1_pd(step), _mm256_set_pd(3.0, 2.0, 1.0, 0.0)))};
+        }
+        static VecD load(const double* p) { return {_mm256_loadu_pd(p)}; }
+    };
+
+    inline VecD add(VecD a, VecD b) { return {_mm256_add_pd(a.v, b.v)}; }
+    inline VecD sub(VecD a, VecD b) { return {_mm256_sub_pd(a.v, b.v)}; }
+    inline VecD mul(VecD a, VecD b) { return {_mm256_mul_pd(a.v, b.v)}; }
+    inline VecD fma(VecD a, VecD b, VecD c) { return {_mm256_fmadd_pd(a.v, b.v, c.v)}; }
+    inline __m256d lessThan(VecD a, VecD b) { return _mm256_cmp_pd(a.v, b.v, _CMP_LT_OQ); }
+    inline bool anyLane(__m256d m) { return _mm256_movemask_pd(m) != 0; }
+    inline VecD incrementWhere(VecD n, __m256d m, VecD one) { return {_mm256_add_pd(n.v, _mm256_and_pd(m, one.v))}; }
+    inline void storeCounts(VecD n, uint32_t* out, int count) {
+        __m128i counts = _mm256_cvttpd_epi32(n.v);
+        if (count == 4) {
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(out), counts);
+            return;
+        }
+        alignas(16) int32_t tmp[4];
+        _mm_store_si128(reinterpret_cast<__m128i*>(tmp), counts);
+        for (int k = 0; k < count; ++k) out[k] = static_cast<uint32_t>(tmp[k]);
+    }
+    inline void store(VecD a, double* p) { _mm256_storeu_pd(p, a.v); }
+    // base[index] per lane, index holds whole numbers
+    inline VecD gather(const double* base, VecD index) {
+        // Masked form with a zero source, the plain one starts from an undefined register and -Wall complains
+        const __m256d all = _mm256_castsi256_pd(_mm256_set1_epi64x(-1));
+        return {_mm256_mask_i32gather_pd(_mm256_setzero_pd(), base, _mm256_cvttpd_epi32(index.v), all, 8)};
+    }
+    // a where the mask is set, b everywhere else
+    inline VecD select(__m256d m, VecD a, VecD b) { return {_mm256_blendv_pd(b.v, a.v, m)}; }
+    inline __m256d orMask(__m256d a, __m256d b) { return _mm256_or_pd(a, b); }
+    inline __m256d andMask(__m256d a, __m256d b) { return _mm256_and_pd(a, b); }
+    // One bit per lane, lane 0 in bit 0
+    inline int laneBits(__m256d m) { return _mm256_movemask_pd(m); }
+
+    struct VecF {
+        static constexpr int LANES = 8;
+        using Scalar = float;
+        using Mask = __m256;
+        __m256 v;
+
+        static VecF set1(double x) { return {_mm256_set1_ps(static_cast<float>(x))}; }
+        static VecF ramp(double start, double step) {
+            return {_mm256_fmadd_ps(_mm256_set1_ps(static_cast<float>(step)), _mm256_set_ps(7.0f, 6.0f, 5.0f, 4.0f, 3.0f, 2.0f, 1.0f, 0.0f), _mm256_set1_ps(static_cast<float>(start)))};
+        }
+        static VecF load(const float* p) { return {_mm256_loadu_ps(p)}; }
+    };
+
+    inline VecF add(VecF a, VecF b) { return {_mm256_add_ps(a.v, b.v)}; }
+    inline VecF sub(VecF a, VecF b) { return {_mm256_sub_ps(a.v, b.v)}; }
+    inline VecF mul(VecF a, VecF b) { return {_mm256_mul_ps(a.v, b.v)}; }
+    inline VecF fma(VecF a, VecF b, VecF c) { return {_mm256_fmadd_ps(a.v, b.v, c.v)}; }
+    inline __m256 lessThan(VecF a, VecF b) { return _mm256_cmp_ps(a.v, b.v, _CMP_LT_OQ); }
+    inline bool anyLane(__m256 m) { return _mm256_movemask_ps(m) != 0; }
+    inline VecF incrementWhere(VecF n, __m256 m, VecF one) { return {_mm256_add_ps(n.v, _mm256_and_ps(m, one.v))}; }
+    inline void storeCounts(VecF n, uint32_t* out, int count) {
+        __m256i counts = _mm256_cvttps_epi32(n.v);
+        if (count == 8) {
+            _mm256_storeu_si256(reinterpret_cast<__m256i*>(out), counts);
+            return;
+        }
+        alignas(32) int32_t tmp[8];
+        _mm256_store_si256(reinterpret_cast<__m256i*>(tmp), counts);
+        for (int k = 0; k < count; ++k) out[k] = static_cast<uint32_t>(tmp[k]);
+    }
+    inline void store(VecF a, float* p) { _mm256_storeu_ps(p, a.v); }
+    // a where the mask is set, b everywhere else
+    inline VecF select(__m256 m, VecF a, VecF b) { return {_mm256_blendv_ps(b.v, a.v, m)}; }
+    inline __m256 orMask(__m256 a, __m256 b) { return _mm256_or_ps(a, b); }
+    inline __m256 andMask(__m256 a, __m256 b) { return _mm256_and_ps(a, b); }
+    // One bit per lane, lane 0 in bit 0
+    inline int laneBits(__m256 m) { return _mm256_movemask_ps(m); }
+
+    #include "MBKernelBody.inc"
+}
+#if defined(__clang__)
+#pragma clang attribute pop
+#else
+#pragma GCC pop_options
+#endif
+
+#if defined(__clang__)
+#pragma clang attribute push(__attribute__((target("avx512f"))), apply_to = function)
+#else
+#pragma GCC push_options
+#pragma GCC target("avx512f")
+#endif
+namespace mb_avx512 {
+    struct VecD {
+        static constexpr int LANES = 8;
+        using Scalar = double;
+        using Mask = __mmask8;
+        static constexpr bool FUSED_FMA = true; // fma() is one rounding, not a multiply and an add
+        __m512d v;
+
+        static VecD set1(double x) { return {_mm512_set1_pd(x)}; }
+        static VecD ramp(double start, double step) {
+            return {_mm512_fmadd_pd(_mm512_set1_pd(step), _mm512_set_pd(7.0, 6.0, 5.0, 4.0, 3.0, 2.0, 1.0, 0.0), _mm512_set1_pd(start))};
+        }
+        static VecD load(const double* p) { return {_mm512_loadu_pd(p)}; }
+    };
+
+    inline VecD add(VecD a, VecD b) { return {_mm512_add_pd(a.v, b.v)}; }
+    inline VecD sub(VecD a, VecD b) { return {_mm512_sub_pd(a.v, b.v)}; }
+    inline VecD mul(VecD a, VecD b) { return {_mm512_mul_pd(a.v, b.v)}; }
+    inline VecD fma(VecD a, VecD b, VecD c) { return {_mm512_fmadd_pd(a.v, b.v, c.v)}; }
+    // Compares straight into a k register, 1 bit per lane
+    inline __mmask8 lessThan(VecD a, VecD b) { return _mm512_cmp_pd_mask(a.v, b.v, _CMP_LT_OQ); }
+    inline bool anyLane(__mmask8 m) { return m != 0; }
+    inline VecD incrementWhere(VecD n, __mmask8 m, VecD one) { return {_mm512_mask_add_pd(n.v, m, n.v, one.v)}; }
+    inline void storeCounts(VecD n, uint32_t* out, int count) {
+        __m256i counts = _mm512_maskz_cvttpd_epi32(0xFF, n.v);
+        if (count == 8) {
+            _mm256_storeu_si256(reinterpret_cast<__m256i*>(out), counts);
+            return;
+        }
+        alignas(32) int32_t tmp[8];
+        _mm256_store_si256(reinterpret_cast<__m256i*>(tmp), counts);
+        for (int k = 0; k < count; ++k) out[k] = static_cast<uint32_t>(tmp[k]);
+    }
+    inline void store(VecD a, double* p) { _mm512_storeu_pd(p, a.v); }
+    // base[index] per lane, index holds whole numbers
+    inline VecD gather(const double* base, VecD index) {
+        return {_mm512_mask_i32gather_pd(_mm512_setzero_pd(), 0xFF, _mm512_maskz_cvttpd_epi32(0xFF, index.v), base, 8)};
+    }
+    // a where the mask is set, b everywhere else
+    inline VecD select(__mmask8 m, VecD a, VecD b) { return {_mm512_mask_blend_pd(m, b.v, a.v)}; }
+    inline __mmask8 orMask(__mmask8 a, __mmask8 b) { return a | b; }
+    inline __mmask8 andMask(__mmask8 a, __mmask8 b) { return a & b; }
+    // One bit per lane, lane 0 in bit 0
+    inline int laneBits(__mmask8 m) { return m; }
+
+    struct VecF {
+        static constexpr int LANES = 16;
+        using Scalar = float;
+        using Mask = __mmask16;
+        __m512 v;
+
+        static VecF set1(double x) { return {_mm512_set1_ps(static_cast<float>(x))}; }
+        static VecF ramp(double start, double step) {
+            const __m512 lanes = _mm512_set_ps(15.0f, 14.0f, 13.0f, 12.0f, 11.0f, 10.0f, 9.0f, 8.0f, 7.0f, 6.0f, 5.0f, 4.0f, 3.0f, 2.0f, 1.0f, 0.0f);
+            return {_mm512_fmadd_ps(_mm512_set1_ps(static_cast<float>(step)), lanes, _mm512_set1_ps(static_cast<float>(start)))};
+        }
+        static VecF load(const float* p) { return {_mm512_loadu_ps(p)}; }
+    };
+
+    inline VecF add(VecF a, VecF b) { return {_mm512_add_ps(a.v, b.v)}; }
+    inline VecF sub(VecF a, VecF b) { return {_mm512_sub_ps(a.v, b.v)}; }
+    inline VecF mul(VecF a, VecF b) { return {_mm512_mul_ps(a.v, b.v)}; }
+    inline VecF fma(VecF a, VecF b, VecF c) { return {_mm512_fmadd_ps(a.v, b.v, c.v)}; }
+    inline __mmask16 lessThan(VecF a, VecF b) { return _mm512_cmp_ps_mask(a.v, b.v, _CMP_LT_OQ); }
+    inline bool anyLane(__mmask16 m) { return m != 0; }
+    inline VecF incrementWhere(VecF n, __mmask16 m, VecF one) { return {_mm512_mask_add_ps(n.v, m, n.v, one.v)}; }
+    inline void storeCounts(VecF n, uint32_t* out, int count) {
+        __m512i counts = _mm512_maskz_cvttps_epi32(0xFFFF, n.v);
+        // Only write the lanes that belong to this run
+        _mm512_mask_storeu_epi32(out, static_cast<__mmask16>((1u << count) - 1), counts);
+    }
+    inline void store(VecF a, float* p) { _mm512_storeu_ps(p, a.v); }
+    // a where the mask is set, b everywhere else
+    inline VecF select(__mmask16 m, VecF a, VecF b) { return {_mm512_mask_blend_ps(m, b.v, a.v)}; }
+    inline __mmask16 orMask(__mmask16 a, __mmask16 b) { return a | b; }
+    inline __mmask16 andMask(__mmask16 a, __mmask16 b) { return a & b; }
+    // One bit per lane, lane 0 in bit 0
+    inline int laneBits(__mmask16 m) { return m; }
+
+    #include "MBKernelBody.inc"
+}
+#if defined(__clang__)
+#pragma clang attribute pop
+#else
+#pragma GCC pop_options
+#endif
+#endif // MB_X86
+
+#if MB_NEON
+// Advanced SIMD is baseline on aarch64, so like SSE2 no flags needed
+namespace mb_neon {
+    struct VecD {
+        static constexpr int LANES = 2;
+        using Scalar = double;
+        using Mask = uint64x2_t;
+        static constexpr bool FUSED_FMA = true; // fma() is one rounding, not a multiply and an add
+        float64x2_t v;
+
+        static VecD set1(double x) { return {vdupq_n_f64(x)}; }
+        static VecD ramp(double start, double step) {
+            const double lanes[2] = {start, start + step};
+            return {vld1q_f64(lanes)};
+        }
+        static VecD load(const double* p) { return {vld1q_f64(p)}; }
+    };
+
+    inline VecD add(VecD a, VecD b) { return {vaddq_f64(a.v, b.v)}; }
+    inline VecD sub(VecD a, VecD b) { return {vsubq_f64(a.v, b.v)}; }
+    inline VecD mul(VecD a, VecD b) { return {vmulq_f64(a.v, b.v)}; }
+    inline VecD fma(VecD a, VecD b, VecD c) { return {vfmaq_f64(c.v, a.v, b.v)}; }
+    inline uint64x2_t lessThan(VecD a, VecD b) { return vcltq_f64(a.v, b.v); }
+    inline bool anyLane(uint64x2_t m) { return vmaxvq_u32(vreinterpretq_u32_u64(m)) != 0; }
+    inline VecD incrementWhere(VecD n, uint64x2_t m, VecD one) {
+        return {vaddq_f64(n.v, vreinterpretq_f64_u64(vandq_u64(m, vreinterpretq_u64_f64(one.v))))};
+    }
+    inline void storeCounts(VecD n, uint32_t* out, int count) {
+        uint64x2_t counts = vcvtq_u64_f64(n.v);
+        out[0] = static_cast<uint32_t>(vgetq_lane_u64(counts, 0));
+        if (count > 1) out[1] = static_cast<uint32_t>(vgetq_lane_u64(counts, 1));
+    }
+    inline void store(VecD a, double* p) { vst1q_f64(p, a.v); }
+    // base[index] per lane, index holds whole numbers
+    inline VecD gather(const double* base, VecD index) {
+        float64x2_t r = vdupq_n_f64(base[static_cast<int>(vgetq_lane_f64(index.v, 0))]);
+        return {vsetq_lane_f64(base[static_cast<int>(vgetq_lane_f64(index.v, 1))], r, 1)};
+    }
+    // a where the mask is set, b everywhere else
+    inline VecD select(uint64x2_t m, VecD a, VecD b) { return {vbslq_f64(m, a.v, b.v)}; }
+    inline uint64x2_t orMask(uint64x2_t a, uint64x2_t b) { return vorrq_u64(a, b); }
+    inline uint64x2_t andMask(uint64x2_t a, uint64x2_t b) { return vandq_u64(a, b); }
+    // One bit per lane, lane 0 in bit 0
+    inline int laneBits(uint64x2_t m) { return static_cast<int>(vgetq_lane_u64(m, 0) & 1) | static_cast<int>((vgetq_lane_u64(m, 1) & 1) << 1); }
+
+    struct VecF {
+        static constexpr int LANES = 4;
+        using Scalar = float;
+        using Mask = uint32x4_t;
+        float32x4_t v;
+
+        static VecF set1(double x) { return {vdupq_n_f32(static_cast<float>(x))}; }
+        static VecF ramp(double start, double step) {
+            const float lanes[4] = {0.0f, 1.0f, 2.0f, 3.0f};
+            return {vfmaq_f32(vdupq_n_f32(static_cast<float>(start)), vdupq_n_f32(static_cast<float>(step)), vld1q_f32(lanes))};
+        }
+        static VecF load(const float* p) { return {vld1q_f32(p)}; }
+    };
+
+    inline VecF add(VecF a, VecF b) { return {vaddq_f32(a.v, b.v)}; }
+    inline VecF sub(VecF a, VecF b) { return {vsubq_f32(a.v, b.v)}; }
+    inline VecF mul(VecF a, VecF b) { return {vmulq_f32(a.v, b.v)}; }
+    inline VecF fma(VecF a, VecF b, VecF c) { return {vfmaq_f32(c.v, a.v, b.v)}; }
+    inline uint32x4_t lessThan(VecF a, VecF b) { return vcltq_f32(a.v, b.v); }
+    inline bool anyLane(uint32x4_t m) { return vmaxvq_u32(m) != 0; }
+    inline VecF incrementWhere(VecF n, uint32x4_t m, VecF one) {
+        return {vaddq_f32(n.v, vreinterpretq_f32_u32(vandq_u32(m, vreinterpretq_u32_f32(one.v))))};
+    }
+    inline void storeCounts(VecF n, uint32_t* out, int count) {
+        uint32_t tmp[4];
+        vst1q_u32(tmp, vcvtq_u32_f32(n.v));
+        for (int k = 0; k < count; ++k) out[k] = tmp[k];
+    }
+    inline void store(VecF a, float* p) { vst1q_f32(p, a.v); }
+    // a where the mask is set, b everywhere else
+    inline VecF select(uint32x4_t m, VecF a, VecF b) { return {vbslq_f32(m, a.v, b.v)}; }
+    inline uint32x4_t orMask(uint32x4_t a, uint32x4_t b) { return vorrq_u32(a, b); }
+    inline uint32x4_t andMask(uint32x4_t a, uint32x4_t b) { return vandq_u32(a, b); }
+    // One bit per lane, lane 0 in bit 0
+    inline int laneBits(uint32x4_t m) {
+        const uint32x4_t weights = {1, 2, 4, 8};
+        return static_cast<int>(vaddvq_u32(vandq_u32(m, weights)));
+    }
+
+    #include "MBKernelBody.inc"
+}
+#endif // MB_NEON
+
+// Every kernel this binary was built with, whether or not this cpu can run it, best first
+inline const std::vector<Kernel>& allKernels() {
+    static const std::vector<Kernel> kernels = {
+#if MB_X86
+        {"avx512", mb_avx512::VecD::LANES, mb_avx512::iterateDouble, mb_avx512::VecF::LANES, mb_avx512::iterateFloat,
+         mb_avx512::iterateDoubleRefill, mb_avx512::iterateFloatRefill,
+         mb_avx512::iterateDoubleInterleaved, mb_avx512::iterateFloatInterleaved,
+         mb_avx512::iterateDoubleSmooth, mb_avx512::iterateFloatSmooth, mb_avx512::iterateDoubleDouble,
+         mb_avx512::iteratePerturbed},
+        {"avx2", mb_avx2::VecD::LANES, mb_avx2::iterateDouble, mb_avx2::VecF::LANES, mb_avx2::iterateFloat,
+         mb_avx2::iterateDoubleRefill, mb_avx2::iterateFloatRefill,
+         mb_avx2::iterateDoubleInterleaved, mb_avx2::iterateFloatInterleaved,
+         mb_avx2::iterateDoubleSmooth, mb_avx2::iterateFloatSmooth, mb_avx2::iterateDoubleDouble,
+         mb_avx2::iteratePerturbed},
+        {"sse2", mb_sse2::VecD::LANES, mb_sse2::iterateDouble, mb_sse2::VecF::LANES, mb_sse2::iterateFloat,
+         mb_sse2::iterateDoubleRefill, mb_sse2::iterateFloatRefill,
+         mb_sse2::iterateDoubleInterleaved, mb_sse2::iterateFloatInterleaved,
+         mb_sse2::iterateDoubleSmooth, mb_sse2::iterateFloatSmooth, mb_sse2::iterateDoubleDouble,
+         mb_sse2::iteratePerturbed},
+#endif
+#if MB_NEON
+        {"neon", mb_neon::VecD::LANES, mb_neon::iterateDouble, mb_neon::VecF::LANES, mb_neon::iterateFloat,
+         mb_neon::iterateDoubleRefill, mb_neon::iterateFloatRefill,
+         mb_neon::iterateDoubleInterleaved, mb_neon::iterateFloatInterleaved,
+         mb_neon::iterateDoubleSmooth, mb_neon::iterateFloatSmooth, mb_neon::iterateDoubleDouble,
+         mb_neon::iteratePerturbed},
+#endif
+        {"scalar", mb_scalar::VecD::LANES, mb_scalar::iterateDouble, mb_scalar::VecF::LANES, mb_scalar::iterateFloat,
+         mb_scalar::iterateDoubleRefill, mb_scalar::iterateFloatRefill,
+         mb_scalar::iterateDoubleInterleaved, mb_scalar::iterateFloatInterleaved,
+         mb_scalar::iterateDoubleSmooth, mb_scalar::iterateFloatSmooth, mb_scalar::iterateDoubleDouble,
+         mb_scalar::iteratePerturbed},
+    };
+    return kernels;
+}
+
+// Asks the cpu (and the OS, for the wider register state) whether a kernel can run here
+inline bool kernelSupported(const Kernel& kernel) {
+    const char* name = kernel.name;
+#if MB_X86
+    if (std::strcmp(name, "avx512") == 0) return __builtin_cpu_supports("avx512f");
+    if (std::strcmp(name, "avx2") == 0) return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+    if (std::strcmp(name, "sse2") == 0) return true;
+#endif
+#if MB_NEON
+#if defined(__linux__) && defined(HWCAP_ASIMD)
+    if (std::strcmp(name, "neon") == 0) return (getauxval(AT_HWCAP) & HWCAP_ASIMD) != 0;
+#else
+    if (std::strcmp(name, "neon") == 0) return true;
+#endif
+#endif
+    return std::strcmp(name, "scalar") == 0;
+}
+
+// Widest kernel the cpu supports, worked out once. MB_KERNEL=avx2 (etc) in the environment
+// forces a specific one, handy for comparing them on the same machine.
+inline const Kernel& activeKernel() {
+    static const Kernel& picked = [] () -> const Kernel& {
+        const std::vector<Kernel>& kernels = allKernels();
+        if (const char* forced = std::getenv("MB_KERNEL")) {
+            for (const Kernel& kernel : kernels) {
+                if (std::strcmp(kernel.name, forced) == 0 && kernelSupported(kernel)) return kernel;
+            }
+            std::cerr << "MB_KERNEL=" << forced << " is not available here, picking automatically" << std::endl;
+        }
+        for (const Kernel& kernel : kernels) {
+            if (kernelSupported(kernel)) return kernel;
+        }
+        return kernels.back();
+    }();
+    return picked;
+}
+
+// Floats are good enough while the gap between pixels is this many float ulps or more
+const double FLOAT_MIN_ULPS_PER_PIXEL = 1024.0;
+
+// True while float lanes can still tell the pixels apart. pixelSpacing is the smallest step
+// between neighbouring pixels, extent is the largest |x| or |y| anywhere in the view (z itself
+// goes up to 2 before escaping so that is the floor).
+inline bool floatsAreEnough(double pixelSpacing, double extent, int maxIter) {
+    double magnitude = extent > 2.0 ? extent : 2.0;
+    double floatUlp = magnitude * 1.1920929e-07; // FLT_EPSILON, gap between floats around magnitude
+
+    // Counts are kept in float lanes too, they stop being exact past 2^24
+    return maxIter < (1 << 24) && pixelSpacing >= FLOAT_MIN_ULPS_PER_PIXEL * floatUlp;
+}
+
+// Float version while zoomed out enough, double version once pixels get too close together.
+// refill picks the lane refill flavour of whichever precision wins, interleave (unless refill is
+// on) the interleaved one.
+inline IterateFn pickIterate(const Kernel& kernel, double pixelSpacing, double extent, int maxIter, bool refill, bool interleave) {
+    if (floatsAreEnough(pixelSpacing, extent, maxIter)) {
+        return refill ? kernel.iterateFloatRefill : interleave ? kernel.iterateFloatInterleaved : kernel.iterateFloat;
+    }
+    return refill ? kernel.iterateRefill : interleave ? kernel.iterateInterleaved : kernel.iterate;
+}
+
+// Same choice between the smooth versions
+inline IterateSmoothFn pickIterateSmooth(const Kernel& kernel, double pixelSpacing, double extent, int maxIter) {
+    return floatsAreEnough(pixelSpacing, extent, maxIter) ? kernel.iterateFloatSmooth : kernel.iterateSmooth;
+}
+
+// Same idea one level down. Once pixels are only this many double ulps apart the plain double
+// kernels start drawing blocks, and it is time for double-double.
+const double DOUBLE_MIN_ULPS_PER_PIXEL = 256.0;
+
+inline bool needsDoubleDouble(double pixelSpacing, double extent) {
+    double magnitude = extent > 2.0 ? extent : 2.0;
+    double doubleUlp = magnitude * 2.220446049250313e-16; // DBL_EPSILON
+    return pixelSpacing < DOUBLE_MIN_ULPS_PER_PIXEL * doubleUlp;
+}
+
+// And once double-double runs out too (around 1e26 zoom), perturbation
+inline bool needsPerturbation(double pixelSpacing, double extent) {
+    double magnitude = extent > 2.0 ? extent : 2.0;
+    double doubleDoubleUlp = magnitude * 4.93038065763132e-32; // 2^-104
+    return pixelSpacing < DOUBLE_MIN_ULPS_PER_PIXEL * doubleDoubleUlp;
+}
@@ -0,0 +1,267 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+#include "MBKernels.h"
+
+/*
+    Iteration counts to RGBA pixels.
+
+    Working out a color takes three sin() calls, and doing that for every pixel of every frame
+    was a real chunk of frame time at shallow zooms where the iterating itself is cheap. There are
+    only maxIter + 1 different counts though, so every color gets worked out once into a table and
+    colorizing is one lookup per pixel (a gather, 8 or 16 pixels at a time).
+*/
+
+// Same layout the texture uses, SDL_PIXELFORMAT_RGBA8888
+inline uint32_t packRGBA(uint8_t r, uint8_t g, uint8_t b) {
+    return (static_cast<uint32_t>(r) << 24) | (static_cast<uint32_t>(g) << 16) | (static_cast<uint32_t>(b) << 8) | 0xFF;
+}
+
+// A few color schemes to choose from. t goes 0 .. 1 once around the palette.
+enum class PaletteScheme { Sine, Fire, Gray };
+const int PALETTE_SCHEME_COUNT = 3;
+
+inline const char* paletteSchemeName(PaletteScheme scheme) {
+    switch (scheme) {
+        case PaletteScheme::Sine: return "sine";
+        case PaletteScheme::Fire: return "fire";
+        case PaletteScheme::Gray: return "gray";
+    }
+    return "?";
+}
+
+inline uint32_t schemeColor(PaletteScheme scheme, double t) {
+    auto channel = [] (double v) { return static_cast<uint8_t>(255.0 * std::min(std::max(v, 0.0), 1.0)); };
+    switch (scheme) {
+        case PaletteScheme::Fire: // black, red, yellow, white
+            return packRGBA(channel(3.0 * t), channel(3.0 * t - 1.0), channel(3.0 * t - 2.0));
+        case PaletteScheme::Gray: { // dark to light and back, so cycling it doesnt jump
+            uint8_t v = channel(1.0 - std::fabs(2.0 * t - 1.0));
+            return packRGBA(v, v, v);
+        }
+        case PaletteScheme::Sine: // the original, one trip around the color wheel
+        default: {
+            uint8_t r = static_cast<uint8_t>(128.0 + 127.0 * std::sin(6.28318 * t + 0));
+            uint8_t g = static_cast<uint8_t>(128.0 + 127.0 * std::sin(6.28318 * t + 2.09439)); // 2π/3 phase shift
+            uint8_t b = static_cast<uint8_t>(128.0 + 127.0 * std::sin(6.28318 * t + 4.18879)); // 4π/3 phase shift
+            return packRGBA(r, g, b);
+        }
+    }
+}
+
+/*
+    Color for every count 0 .. maxIter.
+
+    The kernels only ever write iteration counts, so everything here (scheme, cycling the colors
+    around, contrast) can change without touching the fractal: rebuilding the table is maxIter + 1
+    colors, and then the colorize pass redoes the texture from the counts we already have.
+*/
+struct Palette {
+    PaletteScheme scheme = PaletteScheme::Sine;
+    double offset = 0.0;   // shifts every color along the palette, 0 .. 1 is once around
+    double contrast = 1.0; // > 1 spreads the colors out over the low counts, < 1 over the high ones
+
+    int maxIter = -1;
+    std::vector<uint32_t> colors;
+
+    void update(int newMaxIter) {
+        if (newMaxIter == maxIter && scheme == builtScheme && offset == builtOffset && contrast == builtContrast) return;
+        maxIter = newMaxIter;
+        builtScheme = scheme;
+        builtOffset = offset;
+        builtContrast = contrast;
+
+        colors.resize(static_cast<size_t>(maxIter) + 1);
+        for (int iter = 0; iter < maxIter; ++iter) {
+            double t = std::pow(static_cast<double>(iter) / maxIter, 1.0 / contrast) + offset;
+            colors[iter] = schemeColor(scheme, t - std::floor(t));
+        }
+        colors[maxIter] = packRGBA(0, 0, 0); // inside the set
+    }
+
+    void nextScheme() { scheme = static_cast<PaletteScheme>((static_cast<int>(scheme) + 1) % PALETTE_SCHEME_COUNT); }
+
+    // Moves the colors along by step, wrapping around
+    void cycle(double step) {
+        offset += step;
+        offset -= std::floor(offset);
+    }
+
+private:
+    PaletteScheme builtScheme = PaletteScheme::Sine;
+    double builtOffset = 0.0;
+    double builtContrast = 1.0;
+};
+
+// count pixels: out[k] = lut[min(counts[k], maxIter)]
+using ColorizeFn = void (*)(const uint32_t* counts, int count, const uint32_t* lut, int maxIter, uint32_t* out);
+
+inline void colorizeScalar(const uint32_t* counts, int count, const uint32_t* lut, int maxIter, uint32_t* out) {
+    uint32_t top = static_cast<uint32_t>(maxIter);
+    for (int k = 0; k < count; ++k) {
+        out[k] = lut[counts[k] < top ? counts[k] : top];
+    }
+}
+
+// a + (b - a) * t for each of the four channels
+inline uint32_t blendRGBA(uint32_t a, uint32_t b, float t) {
+    uint32_t blended = 0;
+    for (int shift = 0; shift < 32; shift += 8) {
+        float from = static_cast<float>((a >> shift) & 0xFF);
+        float to = static_cast<float>((b >> shift) & 0xFF);
+        blended |= static_cast<uint32_t>(from + (to - from) * t + 0.5f) << shift;
+    }
+    return blended;
+}
+
+// Smooth counts (see iterateRunSmooth) to pixels: each one blends the colors of the two counts it
+// falls between, so the steps from one count to the next are gone. maxIter is inside as usual.
+// Plain scalar code, it only runs for output that asked for smooth colors.
+inline void colorizeSmooth(const float* smooth, int count, const uint32_t* lut, int maxIter, uint32_t* out) {
+    for (int k = 0; k < count; ++k) {
+        float s = smooth[k];
+        if (!(s < maxIter)) {
+            out[k] = lut[maxIter];
+            continue;
+        }
+        s = std::max(s, 0.0f);
+        int low = static_cast<int>(s);
+        int high = std::min(low + 1, maxIter - 1);
+        out[k] = blendRGBA(lut[low], lut[high], s - low);
+    }
+}
+
+// The Stream versions below are for output nobody reads back, like the texture SDL uploads from:
+// non-temporal stores skip reading every line in before overwriting it and dont push the counts
+// and the lut out of the cache. Pixels before the first aligned vector go the normal way.
+//
+// Pixels up to the next multiple of bytes in out, at most count
+inline int untilAligned(const uint32_t* out, int count, size_t bytes) {
+    size_t misaligned = reinterpret_cast<uintptr_t>(out) % bytes;
+    if (misaligned % sizeof(uint32_t) != 0) return count;
+    return std::min(count, static_cast<int>((bytes - misaligned) % bytes / sizeof(uint32_t)));
+}
+
+// Row copy with non-temporal stores, for colors worked out ahead that go into the texture
+inline void streamPixels(const uint32_t* from, int count, uint32_t* out) {
+#if MB_X86
+    int k = untilAligned(out, count, 16);
+    std::memcpy(out, from, k * sizeof(uint32_t));
+    for (; k + 4 <= count; k += 4) {
+        _mm_stream_si128(reinterpret_cast<__m128i*>(out + k), _mm_loadu_si128(reinterpret_cast<const __m128i*>(from + k)));
+    }
+    _mm_sfence();
+    std::memcpy(out + k, from + k, (count - k) * sizeof(uint32_t));
+#else
+    std::memcpy(out, from, count * sizeof(uint32_t));
+#endif
+}
+
+#if MB_X86
+#if defined(__clang__)
+#pragma clang attribute push(__attribute__((target("avx2"))), apply_to = function)
+#else
+#pragma GCC push_options
+#pragma GCC target("avx2")
+#endif
+
+inline void colorizeAVX2(const uint32_t* counts, int count, const uint32_t* lut, int maxIter, uint32_t* out) {
+    const __m256i top = _mm256_set1_epi32(maxIter);
+    const __m256i all = _mm256_set1_epi32(-1);
+    int k = 0;
+    for (; k + 8 <= count; k += 8) {
+        __m256i index = _mm256_min_epu32(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(counts + k)), top);
+        __m256i colors = _mm256_mask_i32gather_epi32(_mm256_setzero_si256(), reinterpret_cast<const int*>(lut), index, all, 4);
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + k), colors);
+    }
+    colorizeScalar(counts + k, count - k, lut, maxIter, out + k);
+}
+
+inline void colorizeAVX2Stream(const uint32_t* counts, int count, const uint32_t* lut, int maxIter, uint32_t* out) {
+    const __m256i top = _mm256_set1_epi32(maxIter);
+    const __m256i all = _mm256_set1_epi32(-1);
+    int k = untilAligned(out, count, 32);
+    colorizeScalar(counts, k, lut, maxIter, out);
+    for (; k + 8 <= count; k += 8) {
+        __m256i index = _mm256_min_epu32(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(counts + k)), top);
+        __m256i colors = _mm256_mask_i32gather_epi32(_mm256_setzero_si256(), reinterpret_cast<const int*>(lut), index, all, 4);
+        _mm256_stream_si256(reinterpret_cast<__m256i*>(out + k), colors);
+    }
+    // Streaming stores are weakly ordered, they have to be out before whoever waits on us looks
+    _mm_sfence();
+    colorizeScalar(counts + k, count - k, lut, maxIter, out + k);
+}
+
+#if defined(__clang__)
+#pragma clang attribute pop
+#else
+#pragma GCC pop_options
+#endif
+
+#if defined(__clang__)
+#pragma clang attribute push(__attribute__((target("avx512f"))), apply_to = function)
+#else
+#pragma GCC push_options
+#pragma GCC target("avx512f")
+#endif
+
+inline void colorizeAVX512(const uint32_t* counts, int count, const uint32_t* lut, int maxIter, uint32_t* out) {
+    const __m512i top = _mm512_set1_epi32(maxIter);
+    int k = 0;
+    for (; k + 16 <= count; k += 16) {
+        __m512i index = _mm512_maskz_min_epu32(0xFFFF, _mm512_loadu_si512(counts + k), top);
+        __m512i colors = _mm512_mask_i32gather_epi32(_mm512_setzero_si512(), 0xFFFF, index, lut, 4);
+        _mm512_storeu_si512(out + k, colors);
+    }
+    colorizeScalar(counts + k, count - k, lut, maxIter, out + k);
+}
+
+inline void colorizeAVX512Stream(const uint32_t* counts, int count, const uint32_t* lut, int maxIter, uint32_t* out) {
+    const __m512i top = _mm512_set1_epi32(maxIter);
+    int k = untilAligned(out, count, 64);
+    colorizeScalar(counts, k, lut, maxIter, out);
+    for (; k + 16 <= count; k += 16) {
+        __m512i index = _mm512_maskz_min_epu32(0xFFFF, _mm512_loadu_si512(counts + k), top);
+        __m512i colors = _mm512_mask_i32gather_epi32(_mm512_setzero_si512(), 0xFFFF, index, lut, 4);
+        _mm512_stream_si512(reinterpret_cast<__m512i*>(out + k), colors);
+    }
+    _mm_sfence();
+    colorizeScalar(counts + k, count - k, lut, maxIter, out + k);
+}
+
+#if defined(__clang__)
+#pragma clang attribute pop
+#else
+#pragma GCC pop_options
+#endif
+#endif // MB_X86
+
+// Widest version the active kernel's instruction set allows, so MB_KERNEL applies here too
+inline ColorizeFn activeColorize() {
+    static const ColorizeFn picked = [] () -> ColorizeFn {
+#if MB_X86
+        const char* name = activeKernel().name;
+        if (std::strcmp(name, "avx512") == 0) return colorizeAVX512;
+        if (std::strcmp(name, "avx2") == 0) return colorizeAVX2;
+#endif
+        return colorizeScalar;
+    }();
+    return picked;
+}
+
+// Same pick out of the Stream versions
+inline ColorizeFn activeColorizeStreaming() {
+    static const ColorizeFn picked = [] () -> ColorizeFn {
+#if MB_X86
+        const char* name = activeKernel().name;
+        if (std::strcmp(name, "avx512") == 0) return colorizeAVX512Stream;
+        if (std::strcmp(name, "avx2") == 0) return colorizeAVX2Stream;
+#endif
+        return colorizeScalar;
+    }();
+    return picked;
+}
@@ -0,0 +1,129 @@
+#pragma once
+
+#include <cmath>
+#include <complex>
+#include "MBBigFixed.h"
+#include "MBKernels.h"
+
+/*
+    Deep zoom by perturbation.
+
+    Past a zoom of about 1e11 neighbouring pixels are only a few double ulps apart, and by 1e13 the
+    picture is solid blocks. Doing every pixel in arbitrary precision fixes that but costs orders
+    of magnitude. Instead only one point, the view center C, gets iterated in high precision. Every
+    pixel c = C + dc then only tracks how far its orbit is from C's:
+        z_n = Z_n + dz_n,    dz_n+1 = 2 Z_n dz_n + dz_n^2 + dc
+    dz and dc are tiny, but a double has exponent range to spare, so plain double SIMD works
+    all the way down (see iterateRunPerturbed in the kernels).
+*/
+
+// Iterates C = (cx, cy) in BigFixed and keeps every Z rounded to double
+inline ReferenceOrbit computeReferenceOrbit(const BigFixed& cx, const BigFixed& cy, int maxIter) {
+    ReferenceOrbit ref;
+    ref.centerX = cx.toDouble();
+    ref.centerY = cy.toDouble();
+    ref.re.reserve(maxIter + 1);
+    ref.im.reserve(maxIter + 1);
+    ref.re.push_back(0.0);
+    ref.im.push_back(0.0);
+
+    BigFixed zr, zi;
+    for (int n = 0; n < maxIter; ++n) {
+        BigFixed zri = zr * zi;
+        zr = zr * zr - zi * zi + cx;
+        zi = zri + zri + cy;
+
+        double r = zr.toDouble();
+        double i = zi.toDouble();
+        ref.re.push_back(r);
+        ref.im.push_back(i);
+
+        // Past here Z blows up fast, pixels just rebase when they get to the end
+        if (r * r + i * i >= 4.0) break;
+    }
+    return ref;
+}
+
+// Terms of the series approximation, and how far off it may be (relative to dz) at the probe
+// points before we stop skipping. Way below a pixel, but near the boundary orbits are chaotic enough
+// that anything looser visibly changes counts, and it only costs a few percent of the skip.
+const int SERIES_TERMS = 8;
+const double SERIES_TOLERANCE = 1e-12;
+
+/*
+    Series approximation on top of a reference orbit.
+
+    For small dc the offset after n iterations is a polynomial in dc,
+        dz_n = A1_n dc + A2_n dc^2 + A3_n dc^3 + ...
+    and the coefficients follow from dz_n+1 = 2 Z_n dz_n + dz_n^2 + dc:
+        Ak_n+1 = 2 Z_n Ak_n + sum of Ai_n Aj_n over i + j = k  (+ 1 for k = 1)
+    They only depend on the reference, so one pass along the orbit gives every pixel of the view
+    its dz at some iteration N in a handful of multiplies. At deep zooms the first few thousand
+    iterations (or a lot more) are nearly the same all over the screen, so N can get big.
+
+    dc is scaled by radius (the largest |dc| in the view) first so the coefficients stay around
+    the size of dz instead of overflowing as dc^k underflows.
+
+    How far we can go is checked on probe points around the edge of the view: each one is also
+    iterated the normal way, and the series has to match it to SERIES_TOLERANCE. We also stop
+    before anything that would make a pixel escape or rebase, the kernel handles those.
+*/
+inline void computeSeries(ReferenceOrbit& ref, double radiusX, double radiusY) {
+    using Complex = std::complex<double>;
+    double radius = std::hypot(radiusX, radiusY);
+    ref.skip = 0;
+    ref.seriesRadius = radius;
+    ref.seriesRe.assign(SERIES_TERMS, 0.0);
+    ref.seriesIm.assign(SERIES_TERMS, 0.0);
+
+    // Corners and edge midpoints of the view, written as u = dc / radius
+    std::vector<Complex> probes;
+    for (int py = -1; py <= 1; ++py) {
+        for (int px = -1; px <= 1; ++px) {
+            if (px != 0 || py != 0) probes.emplace_back(px * radiusX / radius, py * radiusY / radius);
+        }
+    }
+    std::vector<Complex> probeDz(probes.size());
+
+    std::vector<Complex> terms(SERIES_TERMS), next(SERIES_TERMS);
+    for (int n = 0; n + 1 < ref.last(); ++n) {
+        Complex z(ref.re[n], ref.im[n]);
+
+        // term k is the coefficient of u^(k + 1)
+        for (int k = 0; k < SERIES_TERMS; ++k) {
+            Complex sum = 2.0 * z * terms[k];
+            for (int i = 0; i <= k - i - 1; ++i) {
+                int j = k - i - 1;
+                sum += (i == j ? 1.0 : 2.0) * terms[i] * terms[j];
+            }
+            if (k == 0) sum += radius;
+            next[k] = sum;
+        }
+        terms.swap(next);
+
+        Complex nextZ(ref.re[n + 1], ref.im[n + 1]);
+        double nextZ2 = std::norm(nextZ);
+        bool good = true;
+        for (size_t p = 0; p < probes.size() && good; ++p) {
+            Complex dc = probes[p] * radius;
+            Complex& dz = probeDz[p];
+            dz = (2.0 * z + dz) * dz + dc;
+
+            Complex approx = 0.0;
+            for (int k = SERIES_TERMS - 1; k >= 0; --k) approx = (approx + terms[k]) * probes[p];
+
+            // Escaping or wanting a rebase anywhere near the probes ends it too, and so does Z going
+            // near 0, where pixels closer to the center than the probes would rebase
+            double dz2 = std::norm(dz);
+            good = std::norm(approx - dz) <= SERIES_TOLERANCE * SERIES_TOLERANCE * dz2 &&
+                   std::norm(nextZ + dz) < 4.0 && std::norm(nextZ + dz) >= dz2 && nextZ2 >= 4.0 * dz2;
+        }
+        if (!good) break;
+
+        ref.skip = n + 1;
+        for (int k = 0; k < SERIES_TERMS; ++k) {
+            ref.seriesRe[k] = terms[k].real();
+            ref.seriesIm[k] = terms[k].imag();
+        }
+    }
+}
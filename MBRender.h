@@ -0,0 +1,644 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <utility>
+#include <vector>
+#include "MBBigFixed.h"
+#include "MBKernels.h"
+#include "MBPerturbation.h"
+#include "MBThreadPool.h"
+
+/*
+    Frame level rendering on top of the kernels: which pixels get computed, in what order, and by
+    which worker. Everything here writes iteration counts into an IterationBuffer, turning those
+    into colors is the caller's business.
+*/
+
+const int BAND_ROWS = 4;        // rows per task handed to the pool by mandelbrotThreads
+const int MS_TILE_SIZE = 64;     // top level tiles the Mariani-Silver renderer hands to the pool
+const int MS_MIN_SIZE = 16;      // below this it is cheaper to just compute the inside than to keep splitting
+
+// Where we are looking. Pixel (row i, column j) maps to
+//     x = (j - width / 2) * 4 / (width * zoom) + offsetX
+//     y = (i - height / 2) * 4 / (height * zoom) + offsetY
+// so at zoom 1 the screen covers -2..2 on both axes around the offset.
+//
+// The real center is centerX / centerY in BigFixed, the offsets are just those rounded to double
+// for the kernels that work on absolute coordinates. Move it with setCenter / pan so the two
+// never disagree.
+struct View {
+    double offsetX = -0.5;
+    double offsetY = 0.0;
+    BigFixed centerX = BigFixed(-0.5);
+    BigFixed centerY;
+    double zoom = 1.0;
+    int maxIter = 1000;
+    int width = 800;
+    int height = 600;
+
+    double stepX() const { return 4.0 / (width * zoom); }
+    double stepY() const { return 4.0 / (height * zoom); }
+    // Offset of a pixel from the center, fine at any zoom
+    double deltaX(double j) const { return (j - width / 2.0) * stepX(); }
+    double deltaY(double i) const { return (i - height / 2.0) * stepY(); }
+    double pixelX(double j) const { return deltaX(j) + offsetX; }
+    double pixelY(double i) const { return deltaY(i) + offsetY; }
+
+    void setCenter(const BigFixed& x, const BigFixed& y) {
+        centerX = x;
+        centerY = y;
+        offsetX = x.toDouble();
+        offsetY = y.toDouble();
+    }
+    void setCenter(double x, double y) { setCenter(BigFixed(x), BigFixed(y)); }
+
+    // Move the center by (dx, dy), which can be way below a double ulp of the center
+    void pan(double dx, double dy) { setCenter(centerX + BigFixed(dx), centerY + BigFixed(dy)); }
+
+    bool operator==(const View& other) const {
+        return centerX == other.centerX && centerY == other.centerY && zoom == other.zoom &&
+               maxIter == other.maxIter && width == other.width && height == other.height;
+    }
+    bool operator!=(const View& other) const { return !(*this == other); }
+};
+
+// Deepest zoom we go to. Past this the BigFixed center runs out of bits.
+const double MAX_ZOOM = 1e100;
+
+enum class Strategy {
+    Bands,          // every pixel, rows of the screen pulled off the pool (mandelbrotThreads)
+    MarianiSilver,  // only tile borders, flood fill tiles whose border is one solid count
+};
+
+inline const char* strategyName(Strategy strategy) {
+    switch (strategy) {
+        case Strategy::Bands: return "bands";
+        case Strategy::MarianiSilver: return "mariani-silver";
+    }
+    return "?";
+}
+
+// Knobs that change how a frame gets computed, not what it looks like
+struct RenderSettings {
+    bool laneRefill = false;  // finished SIMD lanes grab the next pixel instead of waiting for their group
+    bool interleave = false;  // groups of lanes side by side (see iterateRunInterleaved), only wins on slow views
+    Strategy strategy = Strategy::Bands;
+    bool progressive = true;  // interactive viewer shows coarse passes first (see startProgressivePass)
+    // Perturbation as soon as doubles run out. Off means double-double kernels until those run out
+    // too (about 1e26), which needs no reference orbit but is a few times slower per pixel.
+    bool perturbation = true;
+    bool tileCache = true;    // interactive viewer puts frames together from cached tiles (see MBTileCache.h)
+    bool zoomPreview = true;  // stretch the last frame onto the new view while it computes (see reprojectFrame)
+    bool gpu = true;          // interactive viewer computes on the gpu whenever it has the precision (see MBGpu.h)
+};
+
+// Part of the screen, in pixels
+struct Rect {
+    int top, left, height, width;
+};
+
+const size_t FRAME_ALIGN = 4096; // frame buffers start on a page, so no page is shared by two NUMA nodes' bands that doesnt have to be
+
+// Page aligned, and new elements are left as they are instead of zeroed. That way the pages of a
+// big buffer arent touched until whoever fills them in first, which is what decides the NUMA node
+// they end up on (see IterationBuffer::resize).
+template <typename T>
+struct FrameAllocator {
+    using value_type = T;
+
+    FrameAllocator() = default;
+    template <typename U>
+    FrameAllocator(const FrameAllocator<U>&) {}
+
+    T* allocate(size_t n) { return static_cast<T*>(::operator new(n * sizeof(T), std::align_val_t(FRAME_ALIGN))); }
+    void deallocate(T* p, size_t) { ::operator delete(p, std::align_val_t(FRAME_ALIGN)); }
+
+    template <typename U>
+    void construct(U* p) { ::new (static_cast<void*>(p)) U; }
+    template <typename U, typename... Args>
+    void construct(U* p, Args&&... args) { ::new (static_cast<void*>(p)) U(std::forward<Args>(args)...); }
+
+    template <typename U>
+    bool operator==(const FrameAllocator<U>&) const { return true; }
+    template <typename U>
+    bool operator!=(const FrameAllocator<U>&) const { return false; }
+};
+
+// Iteration count for every pixel of a frame, row after row. It remembers which view the counts
+// belong to, so the next frame can reuse whatever is still on screen.
+//
+// Rows stay the layout (every kernel, the pan shift and the colorizers work on runs along a row),
+// but since the pool hands out bands of whole rows, a band is one contiguous block of counts anyway.
+struct IterationBuffer {
+    int width = 0;
+    int height = 0;
+    std::vector<uint32_t, FrameAllocator<uint32_t>> counts;
+    View view;
+    bool valid = false; // counts hold a complete frame of view
+
+    void resize(int w, int h) {
+        width = w;
+        height = h;
+        counts.assign(static_cast<size_t>(w) * h, 0);
+        valid = false;
+    }
+
+    // Same, but a new buffer gets zeroed on the pool, in bands like the renderers use. The pool
+    // gives the same rows to the same NUMA node every frame, so this first touch puts every page
+    // next to the workers that compute (and colorize) those rows from then on.
+    void resize(ThreadPool& pool, int w, int h) {
+        width = w;
+        height = h;
+        valid = false;
+        size_t size = static_cast<size_t>(w) * h;
+        if (counts.size() != size) {
+            // A fresh allocation, growing in place would copy (and so touch) the old part here
+            decltype(counts)().swap(counts);
+            counts.resize(size);
+        }
+
+        int bands = (h + BAND_ROWS - 1) / BAND_ROWS;
+        pool.parallelFor(bands, [this](int band) {
+            int top = band * BAND_ROWS;
+            int rows = std::min(BAND_ROWS, height - top);
+            std::memset(row(top), 0, static_cast<size_t>(rows) * width * sizeof(uint32_t));
+        });
+    }
+
+    uint32_t* row(int i) { return counts.data() + static_cast<size_t>(i) * width; }
+    const uint32_t* row(int i) const { return counts.data() + static_cast<size_t>(i) * width; }
+    uint32_t& at(int i, int j) { return counts[static_cast<size_t>(i) * width + j]; }
+};
+
+// Reference orbit at the center of view, with the series approximation for its size. Every pass
+// of a progressive render and every strip of a pan asks for it, so the last one gets kept around
+// instead of being recomputed each time. Zooming in place only redoes the series.
+inline std::shared_ptr<const ReferenceOrbit> referenceFor(const View& view) {
+    static std::mutex m;
+    static std::shared_ptr<const ReferenceOrbit> last;
+    static View lastView;
+
+    std::lock_guard<std::mutex> lock(m);
+    bool sameOrbit = last && lastView.centerX == view.centerX && lastView.centerY == view.centerY && lastView.maxIter == view.maxIter;
+    if (sameOrbit && lastView == view) return last;
+
+    auto ref = sameOrbit ? std::make_shared<ReferenceOrbit>(*last)
+                         : std::make_shared<ReferenceOrbit>(computeReferenceOrbit(view.centerX, view.centerY, view.maxIter));
+    computeSeries(*ref, std::abs(view.deltaX(0)), std::abs(view.deltaY(0)));
+    last = ref;
+    lastView = view;
+    return last;
+}
+
+// Whatever computes the pixels of one view. Either a plain kernel on absolute coordinates, or the
+// perturbation kernel on offsets from the center once doubles cant tell the pixels apart anymore.
+struct FrameKernel {
+    IterateFn iterate = nullptr;
+    IterateSmoothFn smooth = nullptr; // same precision as iterate, when that is set
+    IterateDDFn doubleDouble = nullptr;
+    PerturbFn perturbed = nullptr;
+    std::shared_ptr<const ReferenceOrbit> reference;
+    const char* precision = "double"; // float, double, double-double or perturbation
+
+    // count pixels from (row i, column j), going stepI rows and stepJ columns further each time.
+    // Positions in between pixels are fine too, for sub pixel samples.
+    void operator()(const View& view, double i, double j, double stepI, double stepJ, int count, uint32_t* out) const {
+        if (perturbed) {
+            perturbed(*reference, view.deltaX(j), view.deltaY(i), stepJ * view.stepX(), stepI * view.stepY(), count, view.maxIter, out);
+        } else if (doubleDouble) {
+            // Start point worked out in BigFixed, pixelX / pixelY would round it to a double
+            double x0, x0Low, y0, y0Low;
+            (view.centerX + BigFixed(view.deltaX(j))).toDoubleDouble(x0, x0Low);
+            (view.centerY + BigFixed(view.deltaY(i))).toDoubleDouble(y0, y0Low);
+            doubleDouble(x0, x0Low, y0, y0Low, stepJ * view.stepX(), stepI * view.stepY(), count, view.maxIter, out);
+        } else {
+            iterate(view.pixelX(j), view.pixelY(i), stepJ * view.stepX(), stepI * view.stepY(), count, view.maxIter, out);
+        }
+    }
+
+    // Same pixels, plus their smooth counts and distance estimates (see iterateRunSmooth). Only the
+    // float and double kernels carry dz/dc. Deeper than that the smooth value is just the count
+    // and the distance is -1, for dont know.
+    void operator()(const View& view, double i, double j, double stepI, double stepJ, int count, uint32_t* out, float* smoothOut, float* distance) const {
+        if (smooth) {
+            smooth(view.pixelX(j), view.pixelY(i), stepJ * view.stepX(), stepI * view.stepY(), count, view.maxIter, out, smoothOut, distance);
+            return;
+        }
+        (*this)(view, i, j, stepI, stepJ, count, out);
+        for (int k = 0; k < count; ++k) {
+            smoothOut[k] = static_cast<float>(out[k]);
+            distance[k] = -1.0f;
+        }
+    }
+};
+
+// Largest |x| or |y| anywhere in view
+inline double viewExtent(const View& view) {
+    return std::max(std::abs(view.offsetX), std::abs(view.offsetY)) + 2.0 / view.zoom;
+}
+
+// True once plain doubles cant tell the pixels of view apart anymore
+inline bool isDeep(const View& view) {
+    return needsDoubleDouble(std::min(view.stepX(), view.stepY()), viewExtent(view));
+}
+
+// Kernel for this view: floats while zoomed out, then doubles, then perturbation or (if that is
+// turned off) double-doubles for as long as they hold out. Refill flavour if asked for (only
+// floats and doubles have one).
+inline FrameKernel iterateFor(const View& view, const RenderSettings& settings) {
+    FrameKernel kernel;
+    double extent = viewExtent(view);
+    double spacing = std::min(view.stepX(), view.stepY());
+
+    bool deep = needsDoubleDouble(spacing, extent);
+    if (deep && (settings.perturbation || needsPerturbation(spacing, extent))) {
+        kernel.perturbed = activeKernel().iteratePerturbed;
+        kernel.reference = referenceFor(view);
+        kernel.precision = "perturbation";
+    } else if (deep) {
+        kernel.doubleDouble = activeKernel().iterateDoubleDouble;
+        kernel.precision = "double-double";
+    } else {
+        const Kernel& active = activeKernel();
+        kernel.iterate = pickIterate(active, spacing, extent, view.maxIter, settings.laneRefill, settings.interleave);
+        kernel.smooth = pickIterateSmooth(active, spacing, extent, view.maxIter);
+        bool single = kernel.iterate == active.iterateFloat || kernel.iterate == active.iterateFloatRefill ||
+                      kernel.iterate == active.iterateFloatInterleaved;
+        kernel.precision = single ? "float" : "double";
+    }
+    return kernel;
+}
+
+// count pixels of row i starting at column j
+inline void computeRow(const FrameKernel& iterate, const View& view, int i, int j, int count, uint32_t* out) {
+    iterate(view, i, j, 0, 1, count, out);
+}
+
+// count pixels of column j starting at row i
+inline void computeColumn(const FrameKernel& iterate, const View& view, int i, int j, int count, IterationBuffer& iters) {
+    uint32_t column[MS_TILE_SIZE];
+    for (int done = 0; done < count; done += MS_TILE_SIZE) {
+        int chunk = std::min(MS_TILE_SIZE, count - done);
+        iterate(view, i + done, j, 1, 0, chunk, column);
+        for (int k = 0; k < chunk; ++k) iters.at(i + done + k, j) = column[k];
+    }
+}
+
+// Every pixel of area, bands of rows pulled off the pool
+inline void mandelbrotThreads(ThreadPool& pool, const RenderSettings& settings, const View& view, IterationBuffer& iters, Rect area) {
+    FrameKernel iterate = iterateFor(view, settings);
+    int bands = (area.height + BAND_ROWS - 1) / BAND_ROWS;
+
+    pool.parallelFor(bands, [&](int band) {
+        int startY = area.top + band * BAND_ROWS;
+        int endY = std::min(startY + BAND_ROWS, area.top + area.height);
+        for (int i = startY; i < endY; ++i) {
+            computeRow(iterate, view, i, area.left, area.width, iters.row(i) + area.left);
+        }
+    });
+}
+
+// Rect (top, left, h, w) whose border is already in iters. If the whole border is one count, the
+// inside is too: the set is connected, so no detail can hide in there without touching the border.
+// Otherwise compute a cross through the middle and do the same for the four quarters.
+inline void marianiSilverSplit(const FrameKernel& iterate, const View& view, IterationBuffer& iters, int top, int left, int h, int w) {
+    if (h <= 2 || w <= 2) return; // no inside left
+
+    uint32_t first = iters.at(top, left);
+    bool uniform = true;
+    for (int j = left; j < left + w && uniform; ++j) {
+        uniform = iters.at(top, j) == first && iters.at(top + h - 1, j) == first;
+    }
+    for (int i = top; i < top + h && uniform; ++i) {
+        uniform = iters.at(i, left) == first && iters.at(i, left + w - 1) == first;
+    }
+
+    if (uniform) {
+        for (int i = top + 1; i < top + h - 1; ++i) {
+            std::fill(iters.row(i) + left + 1, iters.row(i) + left + w - 1, first);
+        }
+        return;
+    }
+
+    if (h <= MS_MIN_SIZE || w <= MS_MIN_SIZE) {
+        for (int i = top + 1; i < top + h - 1; ++i) {
+            computeRow(iterate, view, i, left + 1, w - 2, iters.row(i) + left + 1);
+        }
+        return;
+    }
+
+    // The middle row and column become the shared borders of the four quarters
+    int midRow = top + h / 2;
+    int midCol = left + w / 2;
+    computeRow(iterate, view, midRow, left + 1, w - 2, iters.row(midRow) + left + 1);
+    computeColumn(iterate, view, top + 1, midCol, midRow - top - 1, iters);
+    computeColumn(iterate, view, midRow + 1, midCol, top + h - 2 - midRow, iters);
+
+    marianiSilverSplit(iterate, view, iters, top, left, midRow - top + 1, midCol - left + 1);
+    marianiSilverSplit(iterate, view, iters, top, midCol, midRow - top + 1, left + w - midCol);
+    marianiSilverSplit(iterate, view, iters, midRow, left, top + h - midRow, midCol - left + 1);
+    marianiSilverSplit(iterate, view, iters, midRow, midCol, top + h - midRow, left + w - midCol);
+}
+
+// Cut area into tiles for the pool, each worker computes its tile's border and subdivides from there
+inline void mandelbrotMarianiSilver(ThreadPool& pool, const FrameKernel& iterate, const View& view, IterationBuffer& iters, Rect area) {
+    int tilesX = (area.width + MS_TILE_SIZE - 1) / MS_TILE_SIZE;
+    int tilesY = (area.height + MS_TILE_SIZE - 1) / MS_TILE_SIZE;
+
+    pool.parallelFor(tilesX * tilesY, [&](int tile) {
+        int top = area.top + (tile / tilesX) * MS_TILE_SIZE;
+        int left = area.left + (tile % tilesX) * MS_TILE_SIZE;
+        int h = std::min(MS_TILE_SIZE, area.top + area.height - top);
+        int w = std::min(MS_TILE_SIZE, area.left + area.width - left);
+
+        computeRow(iterate, view, top, left, w, iters.row(top) + left);
+        if (h > 1) computeRow(iterate, view, top + h - 1, left, w, iters.row(top + h - 1) + left);
+        if (h > 2) {
+            computeColumn(iterate, view, top + 1, left, h - 2, iters);
+            if (w > 1) computeColumn(iterate, view, top + 1, left + w - 1, h - 2, iters);
+        }
+
+        marianiSilverSplit(iterate, view, iters, top, left, h, w);
+    });
+}
+
+inline void mandelbrotMarianiSilver(ThreadPool& pool, const RenderSettings& settings, const View& view, IterationBuffer& iters, Rect area) {
+    mandelbrotMarianiSilver(pool, iterateFor(view, settings), view, iters, area);
+}
+
+inline void renderArea(ThreadPool& pool, const RenderSettings& settings, const View& view, IterationBuffer& iters, Rect area) {
+    if (area.width <= 0 || area.height <= 0) return;
+
+    switch (settings.strategy) {
+        case Strategy::Bands:
+            mandelbrotThreads(pool, settings, view, iters, area);
+            break;
+        case Strategy::MarianiSilver:
+            mandelbrotMarianiSilver(pool, settings, view, iters, area);
+            break;
+    }
+}
+
+// If going from one view to the other is a pure pan by a whole number of pixels, how far the
+// picture moved (positive shiftX means the new view is further right, so pixels move left)
+inline bool panShift(const View& from, const View& to, int& shiftX, int& shiftY) {
+    if (from.zoom != to.zoom || from.maxIter != to.maxIter || from.width != to.width || from.height != to.height) return false;
+
+    double sx = (to.centerX - from.centerX).toDouble() / to.stepX();
+    double sy = (to.centerY - from.centerY).toDouble() / to.stepY();
+    shiftX = static_cast<int>(std::lround(sx));
+    shiftY = static_cast<int>(std::lround(sy));
+
+    // Anything off the pixel grid would put every reused pixel slightly in the wrong place
+    const double gridTolerance = 1e-3;
+    return std::abs(sx - shiftX) < gridTolerance && std::abs(sy - shiftY) < gridTolerance;
+}
+
+// Move the counts so that new (i, j) = old (i + shiftY, j + shiftX). Whatever slides in from
+// outside is garbage until it gets computed.
+inline void shiftCounts(IterationBuffer& iters, int shiftX, int shiftY) {
+    int w = iters.width;
+    int h = iters.height;
+    int copyWidth = w - std::abs(shiftX);
+    int srcCol = std::max(shiftX, 0);
+    int dstCol = std::max(-shiftX, 0);
+
+    // Walk rows in the direction that never overwrites a row we still need to read
+    if (shiftY >= 0) {
+        for (int i = 0; i + shiftY < h; ++i) {
+            std::memmove(iters.row(i) + dstCol, iters.row(i + shiftY) + srcCol, copyWidth * sizeof(uint32_t));
+        }
+    } else {
+        for (int i = h - 1; i + shiftY >= 0; --i) {
+            std::memmove(iters.row(i) + dstCol, iters.row(i + shiftY) + srcCol, copyWidth * sizeof(uint32_t));
+        }
+    }
+}
+
+// True if iters holds a finished frame that view is a whole pixel pan of (or the very same view)
+inline bool canReuse(const IterationBuffer& iters, const View& view, int& shiftX, int& shiftY) {
+    return iters.valid && panShift(iters.view, view, shiftX, shiftY) &&
+           std::abs(shiftX) < view.width && std::abs(shiftY) < view.height;
+}
+
+inline bool canReuse(const IterationBuffer& iters, const View& view) {
+    int shiftX, shiftY;
+    return canReuse(iters, view, shiftX, shiftY);
+}
+
+// Fill iters for view with whichever strategy the settings ask for. When the last frame in iters
+// is the same view panned by whole pixels, the overlap gets moved over in memory and only the
+// strip that scrolled into view gets computed.
+inline void renderFrame(ThreadPool& pool, const RenderSettings& settings, const View& view, IterationBuffer& iters) {
+    if (iters.width != view.width || iters.height != view.height) iters.resize(pool, view.width, view.height);
+
+    int shiftX = 0;
+    int shiftY = 0;
+    bool reuse = canReuse(iters, view, shiftX, shiftY);
+
+    // Valid goes off while we work so a half done frame never counts as reusable
+    iters.valid = false;
+
+    if (!reuse) {
+        renderArea(pool, settings, view, iters, {0, 0, view.height, view.width});
+    } else if (shiftX != 0 || shiftY != 0) {
+        shiftCounts(iters, shiftX, shiftY);
+
+        // Rows that came in at the top or bottom, full width
+        int newRows = std::abs(shiftY);
+        int rowTop = shiftY > 0 ? view.height - newRows : 0;
+        renderArea(pool, settings, view, iters, {rowTop, 0, newRows, view.width});
+
+        // Columns that came in at the side, only for the rows that were kept
+        int newCols = std::abs(shiftX);
+        int keptTop = shiftY > 0 ? 0 : newRows;
+        int colLeft = shiftX > 0 ? view.width - newCols : 0;
+        renderArea(pool, settings, view, iters, {keptTop, colLeft, view.height - newRows, newCols});
+    }
+
+    iters.view = view;
+    iters.valid = true;
+}
+
+// Progressive mode: 1 pixel in 8x8 first, then every 4th, every 2nd and finally all of them,
+// each pass filling blocks so the screen always has a full (if blocky) picture to show
+const int PROGRESSIVE_STEPS[] = {8, 4, 2, 1};
+const int PROGRESSIVE_PASSES = sizeof(PROGRESSIVE_STEPS) / sizeof(PROGRESSIVE_STEPS[0]);
+
+// Bumped every time the view changes. Render tasks remember the value they started with and give
+// up as soon as it moves on, so a stale frame never holds up the new one.
+using Generation = std::atomic<uint64_t>;
+
+// Starts pass number pass of a progressive render on the pool and returns without waiting.
+// Rows on the pass grid get computed (skipping pixels the coarser passes already did) and every
+// grid pixel gets spread over its step x step block. Returns the job so the caller can poll it.
+inline std::shared_ptr<ThreadPool::Job> startProgressivePass(ThreadPool& pool, const RenderSettings& settings, const View& view,
+                                                             IterationBuffer& iters, int pass, const Generation& generation, uint64_t current) {
+    if (iters.width != view.width || iters.height != view.height) iters.resize(pool, view.width, view.height);
+    // Not reusable until the last pass is in, but the counts are for this view from now on
+    iters.valid = false;
+    iters.view = view;
+
+    FrameKernel iterate = iterateFor(view, settings);
+    int step = PROGRESSIVE_STEPS[pass];
+    bool firstPass = pass == 0;
+    int gridRows = (view.height + step - 1) / step;
+    int bands = (gridRows + BAND_ROWS - 1) / BAND_ROWS;
+
+    return pool.submit(bands, [=, &iters, &generation](int band) {
+        std::vector<uint32_t> scratch(view.width);
+
+        for (int r = band * BAND_ROWS; r < std::min((band + 1) * BAND_ROWS, gridRows); ++r) {
+            if (generation.load() != current) return;
+
+            int i = r * step;
+            uint32_t* row = iters.row(i);
+
+            // Rows that were on the coarser grid already have every other pixel, only fill in the gaps
+            bool coarseRow = !firstPass && i % (2 * step) == 0;
+            int first = coarseRow ? step : 0;
+            int stride = coarseRow ? 2 * step : step;
+            int count = first < view.width ? (view.width - first + stride - 1) / stride : 0;
+
+            iterate(view, i, first, 0, stride, count, scratch.data());
+            for (int k = 0; k < count; ++k) row[first + k * stride] = scratch[k];
+
+            // Spread each grid pixel over its block, those rows are not on this grid so nobody else touches them
+            if (step > 1) {
+                int blockRows = std::min(step, view.height - i);
+                for (int j = 0; j < view.width; j += step) {
+                    int blockCols = std::min(step, view.width - j);
+                    uint32_t value = row[j];
+                    for (int b = 0; b < blockRows; ++b) {
+                        std::fill(iters.row(i + b) + j, iters.row(i + b) + j + blockCols, value);
+                    }
+                }
+            }
+        }
+    });
+}
+
+/*
+    Zoom preview: when the view changes by something other than a whole pixel pan, the last frame
+    gets stretched onto the new view right away (nearest pixel, the counts dont blend: halfway
+    between an escaping pixel and one inside the set is not a count of anything), and the real
+    pixels replace it as the workers get to them.
+
+    Where the new pixel grid lines up with the old one (zooming in by 1.1 puts every 11th column
+    and row right on an old pixel, by 2 every other one) those counts are already exact and
+    dont get computed again.
+*/
+
+// New pixels that sit exactly on old ones: every colStride-th column from firstCol, on every
+// rowStride-th row from firstRow. A stride of 0 means nothing lines up.
+struct GridMatch {
+    int firstCol = 0, colStride = 0;
+    int firstRow = 0, rowStride = 0;
+
+    bool exact(int i, int j) const {
+        return colStride > 0 && rowStride > 0 && i >= firstRow && (i - firstRow) % rowStride == 0 &&
+               j >= firstCol && (j - firstCol) % colStride == 0;
+    }
+};
+
+// Old pixel position of new pixel k along one axis is start + scale * k. Finds the new pixels
+// landing on whole old pixels, if they are evenly spread over the whole axis (anything else, like
+// zooming out past the old frame, just doesnt get matched).
+inline void matchAxis(double start, double scale, int count, int oldCount, int& first, int& stride) {
+    const double gridTolerance = 1e-3;
+    first = 0;
+    stride = 0;
+
+    std::vector<int> hits;
+    for (int k = 0; k < count; ++k) {
+        double p = start + scale * k;
+        double nearest = std::round(p);
+        if (std::abs(p - nearest) < gridTolerance && nearest >= 0 && nearest < oldCount) hits.push_back(k);
+    }
+    if (hits.size() < 2) return;
+
+    int step = hits[1] - hits[0];
+    for (size_t h = 2; h < hits.size(); ++h) {
+        if (hits[h] - hits[h - 1] != step) return;
+    }
+    if (hits.front() >= step || hits.back() + step < count) return;
+
+    first = hits.front();
+    stride = step;
+}
+
+// Stretches whatever picture of from.view is in from (finished or not, it is only a preview) onto
+// view in to. Only a finished frame has exact pixels to keep though. False if the iteration
+// counts dont match up.
+inline bool reprojectFrame(const IterationBuffer& from, const View& view, IterationBuffer& to, GridMatch& match) {
+    const View& old = from.view;
+    if (from.width != old.width || from.height != old.height || from.counts.empty() || old.maxIter != view.maxIter) return false;
+
+    // Old column of new column j is startX + scaleX * j, same for rows
+    double scaleX = view.stepX() / old.stepX();
+    double scaleY = view.stepY() / old.stepY();
+    double startX = ((view.centerX - old.centerX).toDouble() + view.deltaX(0)) / old.stepX() + old.width / 2.0;
+    double startY = ((view.centerY - old.centerY).toDouble() + view.deltaY(0)) / old.stepY() + old.height / 2.0;
+
+    match = GridMatch();
+    if (from.valid) {
+        matchAxis(startX, scaleX, view.width, old.width, match.firstCol, match.colStride);
+        matchAxis(startY, scaleY, view.height, old.height, match.firstRow, match.rowStride);
+    }
+
+    std::vector<int> columns(view.width);
+    for (int j = 0; j < view.width; ++j) {
+        long c = std::lround(startX + scaleX * j);
+        columns[j] = static_cast<int>(std::min(std::max(c, 0L), static_cast<long>(old.width - 1)));
+    }
+
+    to.width = view.width;
+    to.height = view.height;
+    to.counts.resize(static_cast<size_t>(view.width) * view.height);
+    for (int i = 0; i < view.height; ++i) {
+        long r = std::lround(startY + scaleY * i);
+        const uint32_t* src = from.row(static_cast<int>(std::min(std::max(r, 0L), static_cast<long>(old.height - 1))));
+        uint32_t* dst = to.row(i);
+        for (int j = 0; j < view.width; ++j) dst[j] = src[columns[j]];
+    }
+    to.view = view;
+    to.valid = false;
+    return true;
+}
+
+// Starts computing every pixel of view that match doesnt already cover, bands of rows on the pool,
+// straight over the preview in iters. Gives up on the generation moving on, like the progressive passes.
+inline std::shared_ptr<ThreadPool::Job> startRefine(ThreadPool& pool, const RenderSettings& settings, const View& view,
+                                                    IterationBuffer& iters, GridMatch match, const Generation& generation, uint64_t current) {
+    FrameKernel iterate = iterateFor(view, settings);
+    int bands = (view.height + BAND_ROWS - 1) / BAND_ROWS;
+
+    return pool.submit(bands, [=, &iters, &generation](int band) {
+        std::vector<uint32_t> scratch(view.width);
+
+        for (int i = band * BAND_ROWS; i < std::min((band + 1) * BAND_ROWS, view.height); ++i) {
+            if (generation.load() != current) return;
+
+            uint32_t* row = iters.row(i);
+            if (!match.exact(i, match.firstCol)) {
+                computeRow(iterate, view, i, 0, view.width, row);
+                continue;
+            }
+
+            // Row with exact pixels on it: every other column class mod the stride, one strided run each
+            int stride = match.colStride;
+            for (int c = 0; c < stride; ++c) {
+                if (c == match.firstCol % stride) continue;
+                int count = (view.width - c + stride - 1) / stride;
+                iterate(view, i, c, 0, stride, count, scratch.data());
+                for (int k = 0; k < count; ++k) row[c + k * stride] = scratch[k];
+            }
+        }
+    });
+}
@@ -0,0 +1,611 @@
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <cerrno>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <future>
+#include <iostream>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+#include "MBBigFixed.h"
+#include "MBImageWriter.h"
+#include "MBKernels.h"
+#include "MBPalette.h"
+#include "MBRender.h"
+#include "MBThreadPool.h"
+#include "MBTileCache.h"
+
+/*
+    Serves rendered images over plain HTTP, for web front ends:
+
+        GET /tile?x=-0.5&y=0&zoom=1&width=256&height=256&iter=1000&palette=sine&priority=0
+
+    x / y is the center (any number of digits), zoom / width / height / iter mean the same as in
+    MBHeadless, higher priority goes first. The answer is a PNG. GET /stats says how it is doing.
+
+    Every connection gets a thread that only parses and answers (at most MAX_CONNECTIONS of them),
+    the rendering all happens on one shared pool fed by a single dispatcher thread:
+      - answers already sent once come out of a cache of encoded images right away
+      - a request for something already queued or being rendered waits for that one instead of
+        being rendered twice
+      - the rest queue up by priority. The dispatcher takes everything waiting (up to BATCH_MAX
+        requests or BATCH_MAX_PIXELS) as one batch and computes all of it in one go on the pool,
+        so lots of small tiles keep every worker busy. No need to wait around collecting a batch:
+        whatever comes in while one batch renders is the next batch.
+      - requests that are exactly on the tile grid (zoom a power of 2, see onTileGrid), which is
+        what a slippy map front end asks for, go through the iteration tile cache. Neighbouring
+        requests at one zoom share tiles, and those only get computed once per batch.
+
+    g++ -O2 -o MBServer MBServer.cpp -pthread -lz
+    ./MBServer --port 8080
+*/
+
+const int DEFAULT_PORT = 8080;
+const int BATCH_MAX = 64;                              // requests rendered together
+const size_t BATCH_MAX_PIXELS = size_t(16) << 20;      // and their pixels, 64 MB of counts
+const int MAX_QUEUED = 4096;                           // past this new requests get a 503
+const size_t RESPONSE_CACHE_BYTES = size_t(64) << 20;  // encoded images kept for repeat requests
+const int MAX_SIDE = 4096;                             // biggest width / height anyone can ask for
+const size_t MAX_REQUEST_PIXELS = size_t(8) << 20;     // and width * height, not both at once
+const int MAX_REQUEST_ITER = 1000000;
+const size_t MAX_HEADER_BYTES = 16 << 10;
+const int MAX_CONNECTIONS = 256;                       // open at once, past this a 503 and closed
+const int IDLE_TIMEOUT_SECONDS = 30;                   // stalled clients give their slot back
+
+struct Response {
+    int status;
+    std::string type;
+    std::string body;
+};
+using ResponsePtr = std::shared_ptr<const Response>;
+
+ResponsePtr textResponse(int status, const std::string& text) {
+    return std::make_shared<Response>(Response{status, "text/plain", text + "\n"});
+}
+
+// What a tile request asks for, and the string two requests for the same image share
+struct TileRequest {
+    View view;
+    PaletteScheme scheme = PaletteScheme::Sine;
+    int priority = 0;
+
+    std::string key() const {
+        // The center exactly, as the BigFixed words in hex
+        uint32_t words[2 * BigFixed::LIMBS];
+        view.centerX.toWords(words);
+        view.centerY.toWords(words + BigFixed::LIMBS);
+        std::string key;
+        char part[96];
+        for (uint32_t word : words) {
+            std::snprintf(part, sizeof(part), "%08x", word);
+            key += part;
+        }
+        std::snprintf(part, sizeof(part), " %.17g %d %d %d %d", view.zoom, view.width, view.height, view.maxIter, static_cast<int>(scheme));
+        return key + part;
+    }
+};
+
+// Value of %xx and + escapes in a query string
+std::string urlDecode(const std::string& text) {
+    std::string out;
+    for (size_t k = 0; k < text.size(); ++k) {
+        if (text[k] == '+') {
+            out += ' ';
+        } else if (text[k] == '%' && k + 2 < text.size()) {
+            out += static_cast<char>(std::strtol(text.substr(k + 1, 2).c_str(), nullptr, 16));
+            k += 2;
+        } else {
+            out += text[k];
+        }
+    }
+    return out;
+}
+
+std::map<std::string, std::string> parseQuery(const std::string& query) {
+    std::map<std::string, std::string> values;
+    size_t start = 0;
+    while (start < query.size()) {
+        size_t end = query.find('&', start);
+        if (end == std::string::npos) end = query.size();
+        std::string pair = query.substr(start, end - start);
+        size_t equals = pair.find('=');
+        if (equals != std::string::npos) values[urlDecode(pair.substr(0, equals))] = urlDecode(pair.substr(equals + 1));
+        start = end + 1;
+    }
+    return values;
+}
+
+// False (with error set) if the query doesnt describe an image we are willing to render
+bool parseTileRequest(const std::string& query, TileRequest& request, std::string& error) {
+    std::map<std::string, std::string> values = parseQuery(query);
+    auto value = [&](const char* name, const char* fallback) {
+        auto it = values.find(name);
+        return it != values.end() ? it->second : std::string(fallback);
+    };
+
+    BigFixed centerX, centerY;
+    if (!BigFixed::parse(value("x", "-0.5").c_str(), centerX) || !BigFixed::parse(value("y", "0").c_str(), centerY)) {
+        error = "x and y have to be decimal numbers";
+        return false;
+    }
+    request.view.setCenter(centerX, centerY);
+    request.view.zoom = std::atof(value("zoom", "1").c_str());
+    request.view.width = std::atoi(value("width", "256").c_str());
+    request.view.height = std::atoi(value("height", "256").c_str());
+    request.view.maxIter = std::atoi(value("iter", "1000").c_str());
+    request.priority = std::atoi(value("priority", "0").c_str());
+
+    std::string palette = value("palette", "sine");
+    bool found = false;
+    for (int k = 0; k < PALETTE_SCHEME_COUNT && !found; ++k) {
+        request.scheme = static_cast<PaletteScheme>(k);
+        found = palette == paletteSchemeName(request.scheme);
+    }
+    if (!found) {
+        error = "unknown palette " + palette;
+        return false;
+    }
+    if (request.view.width <= 0 || request.view.height <= 0 || request.view.width > MAX_SIDE || request.view.height > MAX_SIDE) {
+        error = "width and height have to be 1.." + std::to_string(MAX_SIDE);
+        return false;
+    }
+    if (static_cast<size_t>(request.view.width) * request.view.height > MAX_REQUEST_PIXELS) {
+        error = "width * height has to be at most " + std::to_string(MAX_REQUEST_PIXELS);
+        return false;
+    }
+    if (request.view.maxIter <= 0 || request.view.maxIter > MAX_REQUEST_ITER) {
+        error = "iter has to be 1.." + std::to_string(MAX_REQUEST_ITER);
+        return false;
+    }
+    if (!(request.view.zoom > 0.0 && request.view.zoom <= MAX_ZOOM)) {
+        error = "zoom has to be between 0 and 1e100";
+        return false;
+    }
+    return true;
+}
+
+// Encoded images by request key, least recently used goes first once there are budget bytes
+class ResponseCache {
+public:
+    explicit ResponseCache(size_t budgetBytes) : budget(budgetBytes) {}
+
+    ResponsePtr find(const std::string& key) {
+        std::lock_guard<std::mutex> lock(m);
+        auto it = index.find(key);
+        if (it == index.end()) return nullptr;
+        order.splice(order.begin(), order, it->second);
+        return it->second->second;
+    }
+
+    void insert(const std::string& key, ResponsePtr response) {
+        std::lock_guard<std::mutex> lock(m);
+        if (index.count(key)) return;
+        used += response->body.size();
+        order.emplace_front(key, std::move(response));
+        index[key] = order.begin();
+        while (used > budget && order.size() > 1) {
+            used -= order.back().second->body.size();
+            index.erase(order.back().first);
+            order.pop_back();
+        }
+    }
+
+private:
+    size_t budget;
+    size_t used = 0;
+    std::list<std::pair<std::string, ResponsePtr>> order; // most recently used first
+    std::unordered_map<std::string, std::list<std::pair<std::string, ResponsePtr>>::iterator> index;
+    std::mutex m;
+};
+
+struct ServerStats {
+    std::atomic<uint64_t> requests{0};
+    std::atomic<uint64_t> cacheHits{0};  // answered from the response cache
+    std::atomic<uint64_t> shared{0};     // waited on an identical request already queued or rendering
+    std::atomic<uint64_t> rendered{0};
+    std::atomic<uint64_t> batches{0};
+    std::atomic<uint64_t> fromTiles{0};  // rendered requests put together from the tile cache
+    std::atomic<uint64_t> tilesComputed{0};
+    std::atomic<uint64_t> rejected{0};
+};
+
+// Colors and PNG encodes iters into memory
+ResponsePtr encodePng(const IterationBuffer& iters, PaletteScheme scheme) {
+    Palette palette;
+    palette.scheme = scheme;
+    palette.update(iters.view.maxIter);
+    ColorizeFn colorizeRun = activeColorize();
+
+    char* data = nullptr;
+    size_t size = 0;
+    FILE* file = open_memstream(&data, &size);
+    if (!file) return textResponse(500, "out of memory");
+
+    bool ok;
+    {
+        PngWriter writer(file, iters.width, iters.height);
+        std::vector<uint32_t> pixels(iters.width);
+        ok = true;
+        for (int i = 0; i < iters.height && ok; ++i) {
+            colorizeRun(iters.row(i), iters.width, palette.colors.data(), palette.maxIter, pixels.data());
+            ok = writer.writeRows(pixels.data(), 1, iters.width * 4);
+        }
+        ok = writer.finish() && ok;
+    }
+    auto response = std::make_shared<Response>(Response{200, "image/png", std::string(data, size)});
+    std::free(data);
+    if (!ok) return textResponse(500, "encoding failed");
+    return response;
+}
+
+/*
+    Queue of requests waiting to be rendered and the thread that renders them. Each distinct image
+    is one Pending, everyone who asked for it waits on its future.
+*/
+class Scheduler {
+public:
+    Scheduler(ThreadPool& pool, ServerStats& stats) : pool(pool), stats(stats), responses(RESPONSE_CACHE_BYTES) {
+        dispatcher = std::thread(&Scheduler::dispatchLoop, this);
+    }
+
+    ~Scheduler() {
+        {
+            std::lock_guard<std::mutex> lock(m);
+            stopping = true;
+        }
+        cv.notify_all();
+        dispatcher.join();
+    }
+
+    // The image for request, once it is there
+    std::shared_future<ResponsePtr> request(const TileRequest& request) {
+        std::string key = request.key();
+        if (ResponsePtr cached = responses.find(key)) {
+            stats.cacheHits++;
+            return ready(cached);
+        }
+
+        std::lock_guard<std::mutex> lock(m);
+        // Could have gone from pending into the cache since the look above
+        if (ResponsePtr cached = responses.find(key)) {
+            stats.cacheHits++;
+            return ready(cached);
+        }
+        auto it = pending.find(key);
+        if (it != pending.end()) {
+            stats.shared++;
+            std::shared_ptr<Pending> waiting = it->second;
+            // Someone more urgent wants it too, move it up if it hasnt started yet
+            if (request.priority > waiting->request.priority && queue.erase(waiting)) {
+                waiting->request.priority = request.priority;
+                queue.insert(waiting);
+            }
+            return waiting->result;
+        }
+        if (static_cast<int>(queue.size()) >= MAX_QUEUED) {
+            stats.rejected++;
+            return ready(textResponse(503, "too many requests queued"));
+        }
+
+        auto waiting = std::make_shared<Pending>();
+        waiting->request = request;
+        waiting->key = key;
+        waiting->order = nextOrder++;
+        waiting->result = waiting->promise.get_future().share();
+        pending[key] = waiting;
+        queue.insert(waiting);
+        cv.notify_one();
+        return waiting->result;
+    }
+
+    size_t queued() {
+        std::lock_guard<std::mutex> lock(m);
+        return queue.size();
+    }
+
+private:
+    struct Pending {
+        TileRequest request;
+        std::string key;
+        uint64_t order; // first come first served within one priority
+        std::promise<ResponsePtr> promise;
+        std::shared_future<ResponsePtr> result;
+    };
+
+    struct ByPriority {
+        bool operator()(const std::shared_ptr<Pending>& a, const std::shared_ptr<Pending>& b) const {
+            if (a->request.priority != b->request.priority) return a->request.priority > b->request.priority;
+            return a->order < b->order;
+        }
+    };
+
+    static std::shared_future<ResponsePtr> ready(ResponsePtr response) {
+        std::promise<ResponsePtr> promise;
+        promise.set_value(std::move(response));
+        return promise.get_future().share();
+    }
+
+    void dispatchLoop() {
+        while (true) {
+            std::vector<std::shared_ptr<Pending>> batch;
+            {
+                std::unique_lock<std::mutex> lock(m);
+                cv.wait(lock, [&] { return stopping || !queue.empty(); });
+                if (stopping) break;
+                // Always at least one, the request cap keeps that one under the batch cap too
+                size_t pixels = 0;
+                while (!queue.empty() && static_cast<int>(batch.size()) < BATCH_MAX) {
+                    const View& view = (*queue.begin())->request.view;
+                    size_t size = static_cast<size_t>(view.width) * view.height;
+                    if (!batch.empty() && pixels + size > BATCH_MAX_PIXELS) break;
+                    pixels += size;
+                    batch.push_back(*queue.begin());
+                    queue.erase(queue.begin());
+                }
+            }
+
+            std::vector<ResponsePtr> results = render(batch);
+
+            // Into the cache before leaving pending, so a request coming in between finds one of them
+            for (size_t r = 0; r < batch.size(); ++r) {
+                if (results[r]->status == 200) responses.insert(batch[r]->key, results[r]);
+            }
+            std::lock_guard<std::mutex> lock(m);
+            for (size_t r = 0; r < batch.size(); ++r) {
+                pending.erase(batch[r]->key);
+                batch[r]->promise.set_value(results[r]);
+            }
+        }
+
+        // Nobody gets left hanging on shutdown
+        std::lock_guard<std::mutex> lock(m);
+        for (auto& entry : pending) entry.second->promise.set_value(textResponse(503, "shutting down"));
+        pending.clear();
+        queue.clear();
+    }
+
+    // Computes and encodes a whole batch, every step of it spread over the pool
+    std::vector<ResponsePtr> render(const std::vector<std::shared_ptr<Pending>>& batch) {
+        stats.batches++;
+        stats.rendered += batch.size();
+        int count = static_cast<int>(batch.size());
+        std::vector<IterationBuffer> iters(count);
+
+        // Tiles every grid request of the batch needs, each one only once
+        std::vector<bool> gridded(count);
+        std::vector<TileKey> missing;
+        std::unordered_set<TileKey, TileKeyHash> seen;
+        for (int r = 0; r < count; ++r) {
+            const View& view = batch[r]->request.view;
+            gridded[r] = onTileGrid(view);
+            if (!gridded[r]) continue;
+            for (const TileKey& key : missingTiles(tiles, view)) {
+                if (seen.insert(key).second) missing.push_back(key);
+            }
+        }
+        stats.tilesComputed += missing.size();
+
+        // Anything else gets computed directly, bands of rows of all of them in one job
+        RenderSettings settings;
+        std::vector<FrameKernel> kernels(count);
+        std::vector<std::pair<int, int>> bands; // request, first row
+        for (int r = 0; r < count; ++r) {
+            if (gridded[r]) continue;
+            const View& view = batch[r]->request.view;
+            iters[r].resize(view.width, view.height);
+            kernels[r] = iterateFor(view, settings);
+            for (int i = 0; i < view.height; i += BAND_ROWS) bands.emplace_back(r, i);
+        }
+
+        Generation generation{0};
+        auto tileJob = startMissingTiles(pool, settings, tiles, missing, generation, 0);
+        auto bandJob = pool.submit(static_cast<int>(bands.size()), [&](int b) {
+            int r = bands[b].first;
+            const View& view = batch[r]->request.view;
+            for (int i = bands[b].second; i < std::min(bands[b].second + BAND_ROWS, view.height); ++i) {
+                computeRow(kernels[r], view, i, 0, view.width, iters[r].row(i));
+            }
+        });
+        pool.wait(tileJob);
+        pool.wait(bandJob);
+
+        for (int r = 0; r < count; ++r) {
+            const View& view = batch[r]->request.view;
+            if (gridded[r]) {
+                // Only misses if the batch needed more tiles than the cache holds
+                if (composeFromTiles(pool, tiles, view, iters[r])) {
+                    stats.fromTiles++;
+                } else {
+                    renderFrame(pool, settings, view, iters[r]);
+                }
+            }
+            iters[r].view = view;
+        }
+
+        std::vector<ResponsePtr> results(count);
+        pool.parallelFor(count, [&](int r) { results[r] = encodePng(iters[r], batch[r]->request.scheme); });
+        return results;
+    }
+
+    ThreadPool& pool;
+    ServerStats& stats;
+    ResponseCache responses;
+    TileCache tiles;
+
+    std::set<std::shared_ptr<Pending>, ByPriority> queue;
+    std::unordered_map<std::string, std::shared_ptr<Pending>> pending; // queued or rendering, by key
+    uint64_t nextOrder = 0;
+    bool stopping = false;
+    std::mutex m;
+    std::condition_variable cv;
+    std::thread dispatcher;
+};
+
+bool sendAll(int fd, const char* data, size_t size) {
+    while (size > 0) {
+        ssize_t sent = send(fd, data, size, MSG_NOSIGNAL);
+        if (sent <= 0) return false;
+        data += sent;
+        size -= static_cast<size_t>(sent);
+    }
+    return true;
+}
+
+bool sendResponse(int fd, const Response& response, bool keepAlive) {
+    const char* reason = response.status == 200 ? "OK" : response.status == 400 ? "Bad Request" : response.status == 404 ? "Not Found"
+                       : response.status == 503 ? "Service Unavailable" : "Internal Server Error";
+    char header[256];
+    int length = std::snprintf(header, sizeof(header),
+                               "HTTP/1.1 %d %s\r\nContent-Type: %s\r\nContent-Length: %zu\r\nAccess-Control-Allow-Origin: *\r\n"
+                               "Connection: %s\r\n\r\n",
+                               response.status, reason, response.type.c_str(), response.body.size(), keepAlive ? "keep-alive" : "close");
+    return sendAll(fd, header, static_cast<size_t>(length)) && sendAll(fd, response.body.data(), response.body.size());
+}
+
+std::string statsJson(const ServerStats& stats, Scheduler& scheduler) {
+    char json[512];
+    std::snprintf(json, sizeof(json),
+                  "{\"requests\": %llu, \"cache_hits\": %llu, \"shared\": %llu, \"rendered\": %llu, \"batches\": %llu, "
+                  "\"from_tiles\": %llu, \"tiles_computed\": %llu, \"rejected\": %llu, \"queued\": %zu, \"kernel\": \"%s\"}\n",
+                  static_cast<unsigned long long>(stats.requests.load()), static_cast<unsigned long long>(stats.cacheHits.load()),
+                  static_cast<unsigned long long>(stats.shared.load()), static_cast<unsigned long long>(stats.rendered.load()),
+                  static_cast<unsigned long long>(stats.batches.load()), static_cast<unsigned long long>(stats.fromTiles.load()),
+                  static_cast<unsigned long long>(stats.tilesComputed.load()), static_cast<unsigned long long>(stats.rejected.load()),
+                  scheduler.queued(), activeKernel().name);
+    return json;
+}
+
+// Connections being served right now, for MAX_CONNECTIONS
+std::atomic<int> openConnections(0);
+
+// One client, as many requests as it sends on the connection (HTTP/1.1 keep-alive)
+void serveConnection(int fd, Scheduler& scheduler, ServerStats& stats) {
+    // Gives the slot back however the connection ends
+    struct Slot {
+        ~Slot() { openConnections--; }
+    } slot;
+
+    std::string buffer;
+    char chunk[4096];
+    bool keepAlive = true;
+
+    while (keepAlive) {
+        size_t end;
+        while ((end = buffer.find("\r\n\r\n")) == std::string::npos) {
+            ssize_t got = recv(fd, chunk, sizeof(chunk), 0);
+            if (got <= 0 || buffer.size() > MAX_HEADER_BYTES) {
+                close(fd);
+                return;
+            }
+            buffer.append(chunk, static_cast<size_t>(got));
+        }
+        std::string head = buffer.substr(0, end);
+        buffer.erase(0, end + 4); // GET has no body, anything after is the next request
+
+        // Request line, then the only header we care about
+        std::string line = head.substr(0, head.find("\r\n"));
+        size_t space1 = line.find(' ');
+        size_t space2 = line.rfind(' ');
+        std::string lower = head;
+        std::transform(lower.begin(), lower.end(), lower.begin(), [](unsigned char c) { return static_cast<char>(std::tolower(c)); });
+        bool http10 = line.compare(space2 + 1, std::string::npos, "HTTP/1.0") == 0;
+        keepAlive = http10 ? lower.find("connection: keep-alive") != std::string::npos : lower.find("connection: close") == std::string::npos;
+
+        ResponsePtr response;
+        if (space1 == std::string::npos || space2 <= space1 || line.compare(0, space1, "GET") != 0) {
+            response = textResponse(400, "only GET requests");
+            keepAlive = false;
+        } else {
+            std::string target = line.substr(space1 + 1, space2 - space1 - 1);
+            size_t question = target.find('?');
+            std::string path = target.substr(0, question);
+            std::string query = question == std::string::npos ? "" : target.substr(question + 1);
+
+            if (path == "/tile") {
+                stats.requests++;
+                TileRequest request;
+                std::string error;
+                response = parseTileRequest(query, request, error) ? scheduler.request(request).get() : textResponse(400, error);
+            } else if (path == "/stats") {
+                response = std::make_shared<Response>(Response{200, "application/json", statsJson(stats, scheduler)});
+            } else {
+                response = textResponse(404, "GET /tile?x=&y=&zoom=&width=&height=&iter=&palette=&priority= or /stats");
+            }
+        }
+
+        if (!sendResponse(fd, *response, keepAlive)) break;
+    }
+    close(fd);
+}
+
+int main(int argc, char** argv) {
+    int port = DEFAULT_PORT;
+    int threads = 0;
+    for (int a = 1; a < argc; ++a) {
+        std::string arg = argv[a];
+        if (arg == "--port" && a + 1 < argc) {
+            port = std::atoi(argv[++a]);
+        } else if (arg == "--threads" && a + 1 < argc) {
+            threads = std::atoi(argv[++a]);
+        } else {
+            std::cerr << "usage: " << argv[0] << " [--port N] [--threads N]" << std::endl;
+            return 1;
+        }
+    }
+    if (threads <= 0) threads = std::max(1u, std::thread::hardware_concurrency());
+
+    int listener = socket(AF_INET, SOCK_STREAM, 0);
+    int yes = 1;
+    setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+    sockaddr_in address = {};
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_ANY);
+    address.sin_port = htons(static_cast<uint16_t>(port));
+    if (listener < 0 || bind(listener, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0 || listen(listener, SOMAXCONN) != 0) {
+        std::cerr << "Cant listen on port " << port << ": " << std::strerror(errno) << std::endl;
+        return 1;
+    }
+
+    // The dispatcher helps out in wait(), so threads - 1 workers make threads computing
+    ThreadPool pool(threads - 1);
+    ServerStats stats;
+    Scheduler scheduler(pool, stats);
+    std::cout << "Serving on port " << port << " with the " << activeKernel().name << " kernel on " << threads << " threads" << std::endl;
+
+    while (true) {
+        int fd = accept(listener, nullptr, nullptr);
+        if (fd < 0) {
+            if (errno == EINTR) continue;
+            std::cerr << "accept failed: " << std::strerror(errno) << std::endl;
+            break;
+        }
+        timeval idle = {IDLE_TIMEOUT_SECONDS, 0};
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &idle, sizeof(idle));
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &idle, sizeof(idle));
+        if (openConnections.load() >= MAX_CONNECTIONS) {
+            stats.rejected++;
+            sendResponse(fd, *textResponse(503, "too many connections"), false);
+            close(fd);
+            continue;
+        }
+        openConnections++;
+        std::thread(serveConnection, fd, std::ref(scheduler), std::ref(stats)).detach();
+    }
+    close(listener);
+    return 1;
+}
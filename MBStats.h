@@ -0,0 +1,256 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "MBKernels.h"
+#include "MBThreadPool.h"
+
+/*
+    Where the time of a frame goes: per thread how many tasks it ran and how long it was busy,
+    how many iterations the kernels did and how many SIMD lane steps went to waste (lanes that
+    already escaped, or hang past the end of a run, still go round the loop with the others), and
+    how long the main thread spent in SDL locking, coloring, uploading and presenting.
+
+    Hooked into the pool as its TaskObserver, so nothing gets timed while it isnt attached. The
+    kernels bump their counters once per group of lanes either way (see KernelCounters).
+
+    While recording it also keeps every task and phase as an event, and writes them out in the
+    Chrome trace event format: open chrome://tracing or ui.perfetto.dev and load the file.
+*/
+
+enum class Phase { Lock, Colorize, Upload, Present };
+const int PHASE_COUNT = 4;
+
+inline const char* phaseName(Phase phase) {
+    switch (phase) {
+        case Phase::Lock: return "lock";
+        case Phase::Colorize: return "colorize";
+        case Phase::Upload: return "upload";
+        case Phase::Present: return "present";
+    }
+    return "?";
+}
+
+// One frame worth of numbers, everything the overlay and the console line show
+struct FrameStats {
+    double wallMs = 0;
+    double phaseMs[PHASE_COUNT] = {};
+    std::vector<double> busyMs; // per thread, the last one is the main thread helping out in wait()
+    std::vector<uint64_t> tasks;
+    uint64_t iterations = 0;
+    uint64_t laneSteps = 0;
+
+    // Whatever isnt one of the SDL phases: computing, waiting on the pool, handling events
+    double computeMs() const {
+        double rest = wallMs;
+        for (double ms : phaseMs) rest -= ms;
+        return std::max(rest, 0.0);
+    }
+    double wastedFraction() const { return laneSteps > 0 ? 1.0 - static_cast<double>(iterations) / laneSteps : 0.0; }
+};
+
+class Profiler : public ThreadPool::TaskObserver {
+public:
+    using Clock = std::chrono::steady_clock;
+
+    // A slot per worker of pool plus one for the main thread
+    explicit Profiler(const ThreadPool& pool) : slots(pool.size() + 1), frameStart(Clock::now()) {
+        for (auto& slot : slots) slot.reset(new Slot());
+        last.busyMs.resize(slots.size());
+        last.tasks.resize(slots.size());
+        startTotals = totals();
+    }
+
+    int threads() const { return static_cast<int>(slots.size()); }
+
+    void taskStarted(int) override {
+        TaskStart& start = taskStart();
+        start.counters = kernelCounters();
+        start.time = Clock::now();
+    }
+
+    void taskFinished(int thread) override {
+        Clock::time_point end = Clock::now();
+        const TaskStart& start = taskStart();
+        const KernelCounters& counters = kernelCounters();
+
+        Slot& slot = *slots[std::min(thread, threads() - 1)];
+        uint64_t ns = static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(end - start.time).count());
+        slot.tasks.fetch_add(1, std::memory_order_relaxed);
+        slot.busyNs.fetch_add(ns, std::memory_order_relaxed);
+        slot.iterations.fetch_add(counters.iterations - start.counters.iterations, std::memory_order_relaxed);
+        slot.laneSteps.fetch_add(counters.laneSteps - start.counters.laneSteps, std::memory_order_relaxed);
+        if (recording.load(std::memory_order_acquire)) record(slot, "task", start.time, end);
+    }
+
+    // Times a main thread phase for as long as it is in scope, does nothing with a null profiler
+    class Scope {
+    public:
+        Scope(Profiler* profiler, Phase phase) : profiler(profiler), phase(phase) {
+            if (profiler) start = Clock::now();
+        }
+        ~Scope() {
+            if (profiler) profiler->phaseDone(phase, start, Clock::now());
+        }
+
+        Scope(const Scope&) = delete;
+        Scope& operator=(const Scope&) = delete;
+
+    private:
+        Profiler* profiler;
+        Phase phase;
+        Clock::time_point start;
+    };
+
+    void beginFrame() {
+        frameStart = Clock::now();
+        for (int p = 0; p < PHASE_COUNT; ++p) phaseNs[p] = 0;
+        startTotals = totals();
+    }
+
+    // Everything since beginFrame, also kept as last()
+    const FrameStats& endFrame() {
+        Clock::time_point end = Clock::now();
+        std::vector<Totals> now = totals();
+
+        last.wallMs = std::chrono::duration<double, std::milli>(end - frameStart).count();
+        last.iterations = last.laneSteps = 0;
+        for (int p = 0; p < PHASE_COUNT; ++p) last.phaseMs[p] = phaseNs[p] * 1e-6;
+        for (int t = 0; t < threads(); ++t) {
+            last.busyMs[t] = (now[t].busyNs - startTotals[t].busyNs) * 1e-6;
+            last.tasks[t] = now[t].tasks - startTotals[t].tasks;
+            last.iterations += now[t].iterations - startTotals[t].iterations;
+            last.laneSteps += now[t].laneSteps - startTotals[t].laneSteps;
+        }
+        if (recording.load(std::memory_order_acquire)) record(*slots.back(), "frame", frameStart, end);
+        return last;
+    }
+
+    const FrameStats& lastFrame() const { return last; }
+
+    // One line for the console
+    std::string summary() const {
+        double busy = 0, least = 1e300, most = 0;
+        uint64_t tasks = 0;
+        for (int t = 0; t < threads(); ++t) {
+            busy += last.busyMs[t];
+            tasks += last.tasks[t];
+            // The main thread only helps out now and then, it says nothing about the balance
+            if (t + 1 < threads()) {
+                least = std::min(least, last.busyMs[t]);
+                most = std::max(most, last.busyMs[t]);
+            }
+        }
+        if (threads() == 1) least = most = last.busyMs[0];
+
+        char line[256];
+        std::snprintf(line, sizeof(line),
+                      "frame %.1f ms: compute %.1f, lock %.2f, colorize %.2f, upload %.2f, present %.2f | "
+                      "%llu tasks, threads busy %.1f..%.1f ms (avg %.1f) | %.3g iterations, %.0f%% lane steps wasted",
+                      last.wallMs, last.computeMs(), last.phaseMs[0], last.phaseMs[1], last.phaseMs[2], last.phaseMs[3],
+                      static_cast<unsigned long long>(tasks), least, most, busy / threads(), static_cast<double>(last.iterations),
+                      100.0 * last.wastedFraction());
+        return line;
+    }
+
+    bool isRecording() const { return recording.load(); }
+
+    void startRecording() {
+        for (auto& slot : slots) {
+            std::lock_guard<std::mutex> lock(slot->mutex);
+            slot->events.clear();
+        }
+        traceStart = Clock::now();
+        recording.store(true, std::memory_order_release);
+    }
+
+    // Stops recording and writes what it got to path, false if the file cant be written
+    bool stopRecording(const std::string& path) {
+        recording.store(false);
+
+        FILE* file = std::fopen(path.c_str(), "w");
+        if (!file) return false;
+        std::fprintf(file, "{\"traceEvents\": [\n");
+        bool first = true;
+        for (int t = 0; t < threads(); ++t) {
+            std::string name = t + 1 < threads() ? "worker " + std::to_string(t) : "main";
+            std::fprintf(file, "%s  {\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": %d, \"args\": {\"name\": \"%s\"}}",
+                         first ? "" : ",\n", t, name.c_str());
+            first = false;
+
+            std::lock_guard<std::mutex> lock(slots[t]->mutex);
+            for (const Event& event : slots[t]->events) {
+                std::fprintf(file, ",\n  {\"name\": \"%s\", \"ph\": \"X\", \"pid\": 1, \"tid\": %d, \"ts\": %.3f, \"dur\": %.3f}",
+                             event.name, t, event.startNs * 1e-3, event.durationNs * 1e-3);
+            }
+        }
+        std::fprintf(file, "\n]}\n");
+        return std::fclose(file) == 0;
+    }
+
+private:
+    struct Event {
+        const char* name;
+        int64_t startNs; // since startRecording
+        int64_t durationNs;
+    };
+
+    // Written by the thread the slot belongs to, read by the main thread between frames
+    struct Slot {
+        std::atomic<uint64_t> tasks{0};
+        std::atomic<uint64_t> busyNs{0};
+        std::atomic<uint64_t> iterations{0};
+        std::atomic<uint64_t> laneSteps{0};
+        std::mutex mutex; // only ever contended while a trace is being written out
+        std::vector<Event> events;
+    };
+
+    struct Totals {
+        uint64_t tasks, busyNs, iterations, laneSteps;
+    };
+
+    struct TaskStart {
+        Clock::time_point time;
+        KernelCounters counters;
+    };
+
+    static TaskStart& taskStart() {
+        thread_local TaskStart start;
+        return start;
+    }
+
+    std::vector<Totals> totals() const {
+        std::vector<Totals> all(slots.size());
+        for (size_t t = 0; t < slots.size(); ++t) {
+            all[t] = {slots[t]->tasks.load(), slots[t]->busyNs.load(), slots[t]->iterations.load(), slots[t]->laneSteps.load()};
+        }
+        return all;
+    }
+
+    void phaseDone(Phase phase, Clock::time_point start, Clock::time_point end) {
+        phaseNs[static_cast<int>(phase)] += std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count();
+        if (recording.load(std::memory_order_acquire)) record(*slots.back(), phaseName(phase), start, end);
+    }
+
+    void record(Slot& slot, const char* name, Clock::time_point start, Clock::time_point end) {
+        int64_t startNs = std::chrono::duration_cast<std::chrono::nanoseconds>(start - traceStart).count();
+        int64_t durationNs = std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count();
+        std::lock_guard<std::mutex> lock(slot.mutex);
+        slot.events.push_back({name, startNs, durationNs});
+    }
+
+    std::vector<std::unique_ptr<Slot>> slots;
+    Clock::time_point frameStart;
+    Clock::time_point traceStart;
+    std::atomic<bool> recording{false};
+    int64_t phaseNs[PHASE_COUNT] = {};
+    std::vector<Totals> startTotals;
+    FrameStats last;
+};
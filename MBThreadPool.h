@@ -0,0 +1,261 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdlib>
+#include <deque>
+#include <fstream>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#if defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+// CPUs of every NUMA node, out of sysfs. A single node with nothing in it when there is no such
+// thing (or we arent on linux), which turns all the node handling in the pool into no-ops.
+inline std::vector<std::vector<int>> numaNodes() {
+    std::vector<std::vector<int>> nodes;
+#if defined(__linux__)
+    // Node numbers can have holes (node0, node2), so no stopping at the first one missing
+    for (int n = 0; n < 64; ++n) {
+        std::ifstream file("/sys/devices/system/node/node" + std::to_string(n) + "/cpulist");
+        std::string list;
+        if (!std::getline(file, list)) continue;
+
+        // "0-15,32-47"
+        std::vector<int> cpus;
+        for (size_t at = 0; at < list.size();) {
+            size_t end = list.find(',', at);
+            if (end == std::string::npos) end = list.size();
+            std::string range = list.substr(at, end - at);
+            size_t dash = range.find('-');
+            int first = std::atoi(range.c_str());
+            int last = dash == std::string::npos ? first : std::atoi(range.c_str() + dash + 1);
+            for (int cpu = first; cpu <= last; ++cpu) cpus.push_back(cpu);
+            at = end + 1;
+        }
+        if (!cpus.empty()) nodes.push_back(cpus);
+    }
+#endif
+    if (nodes.empty()) nodes.emplace_back();
+    return nodes;
+}
+
+/*
+    Long lived worker pool so we dont pay for creating and joining threads every frame.
+
+    Work is handed out as a job made of small tasks (row bands, tiles...). Instead of giving every
+    thread a fixed slab up front, each worker grabs the next task index from an atomic counter
+    when it finishes its last one. Threads that land on cheap regions just take more tasks, so
+    nobody sits idle while one thread grinds through the inside of the set.
+
+    On a machine with several NUMA nodes the workers get spread over them (pinned to the CPUs of
+    their node, MB_NO_PIN=1 leaves them be), and every job's task indices get split into one
+    contiguous run per node. Workers empty their own node's run first and only then help with
+    the others. Row bands are numbered top to bottom, so the same part of the frame lands on the
+    same node every time, whatever the band size, and the memory for it stays on that node (see
+    IterationBuffer::resize).
+*/
+class ThreadPool {
+public:
+    explicit ThreadPool(int threadCount) {
+        std::vector<std::vector<int>> layout = numaNodes();
+        nodes = static_cast<int>(layout.size());
+        for (int node = 0; node < nodes; ++node) {
+            for (int cpu : layout[node]) {
+                if (cpu >= static_cast<int>(cpuNode.size())) cpuNode.resize(cpu + 1, 0);
+                cpuNode[cpu] = node;
+            }
+        }
+        // Round robin, so a pool smaller than the machine still gets every node's memory bandwidth
+        for (int i = 0; i < threadCount; ++i) workerNode.push_back(i % nodes);
+
+        for (int i = 0; i < threadCount; ++i) {
+            workers.emplace_back(&ThreadPool::workerLoop, this, i);
+        }
+
+#if defined(__linux__)
+        const char* noPin = std::getenv("MB_NO_PIN");
+        if (nodes > 1 && !(noPin && std::atoi(noPin) != 0)) {
+            for (int i = 0; i < threadCount; ++i) {
+                cpu_set_t set;
+                CPU_ZERO(&set);
+                for (int cpu : layout[workerNode[i]]) CPU_SET(cpu, &set);
+                pthread_setaffinity_np(workers[i].native_handle(), sizeof(set), &set);
+            }
+        }
+#endif
+    }
+
+    ~ThreadPool() {
+        {
+            std::lock_guard<std::mutex> lock(m);
+            stopping = true;
+        }
+        cv.notify_all();
+        for (auto& worker : workers) {
+            worker.join();
+        }
+    }
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    int size() const { return static_cast<int>(workers.size()); }
+    int nodeCount() const { return nodes; }
+
+    // Gets told about every task, on the thread that runs it, for profiling (see MBStats.h).
+    // thread is the worker number, or size() for a thread that helps out in wait().
+    struct TaskObserver {
+        virtual ~TaskObserver() = default;
+        virtual void taskStarted(int thread) = 0;
+        virtual void taskFinished(int thread) = 0;
+    };
+
+    // Null to stop watching. Tasks already running may still report to the old one.
+    void setObserver(TaskObserver* watcher) { observer.store(watcher); }
+
+    // count tasks sharing one task function, handed out to whoever is free (nodes first, see above)
+    struct Job {
+        // Task indices next..end-1 are still up for grabs by this node. A cache line each, every
+        // worker of the node hammers on it.
+        struct alignas(64) Run {
+            std::atomic<int> next{0};
+            int end = 0;
+        };
+
+        std::function<void(int)> task;
+        int count = 0;
+        int runCount = 0;
+        std::unique_ptr<Run[]> runs;
+        std::atomic<int> completed{0};
+
+        bool done() const { return completed.load() == count; }
+
+        bool handedOut() const {
+            for (int r = 0; r < runCount; ++r) {
+                if (runs[r].next.load() < runs[r].end) return false;
+            }
+            return true;
+        }
+    };
+
+    // Starts task(0) .. task(taskCount - 1) on the workers and returns right away, so the caller
+    // can keep doing other things (like handling events) while they run
+    std::shared_ptr<Job> submit(int taskCount, std::function<void(int)> task) {
+        auto job = std::make_shared<Job>();
+        job->task = std::move(task);
+        job->count = taskCount > 0 ? taskCount : 0;
+        if (job->count == 0) return job;
+
+        // Node r gets the tasks t with t * runCount / count == r
+        job->runCount = std::min(nodes, job->count);
+        job->runs.reset(new Job::Run[job->runCount]);
+        for (int r = 0; r < job->runCount; ++r) {
+            job->runs[r].next.store(static_cast<int>((static_cast<long long>(r) * job->count + job->runCount - 1) / job->runCount));
+            job->runs[r].end = static_cast<int>((static_cast<long long>(r + 1) * job->count + job->runCount - 1) / job->runCount);
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(m);
+            jobs.push_back(job);
+        }
+        cv.notify_all();
+        return job;
+    }
+
+    // Helps with whatever is left of the job and returns once all of its tasks are done
+    void wait(const std::shared_ptr<Job>& job) {
+        runTasks(*job);
+
+        std::unique_lock<std::mutex> lock(m);
+        doneCv.wait(lock, [&] { return job->done(); });
+    }
+
+    // Runs task(0) .. task(taskCount - 1) on the workers and returns once all of them are done.
+    // The calling thread helps out instead of just waiting.
+    void parallelFor(int taskCount, std::function<void(int)> task) {
+        wait(submit(taskCount, std::move(task)));
+    }
+
+private:
+    // Keep grabbing task indices from the job until there are none left, own node's first
+    void runTasks(Job& job) {
+        if (job.runCount == 0) return; // empty job, never even queued
+        int thread = workerIndex() >= 0 ? workerIndex() : size();
+        int home = homeNode() % job.runCount;
+        for (int k = 0; k < job.runCount; ++k) {
+            Job::Run& run = job.runs[(home + k) % job.runCount];
+            while (true) {
+                int t = run.next.fetch_add(1);
+                if (t >= run.end) break;
+
+                TaskObserver* watcher = observer.load(std::memory_order_relaxed);
+                if (watcher) watcher->taskStarted(thread);
+                job.task(t);
+                if (watcher) watcher->taskFinished(thread);
+
+                if (job.completed.fetch_add(1) + 1 == job.count) {
+                    // Take the lock so the waiter cant miss the wakeup between its check and its wait
+                    std::lock_guard<std::mutex> lock(m);
+                    doneCv.notify_all();
+                }
+            }
+        }
+    }
+
+    // Node of the calling thread. Threads helping out in wait() arent pinned, so for them it is
+    // wherever they happen to run right now.
+    int homeNode() const {
+        if (nodes == 1) return 0;
+        if (workerIndex() >= 0) return workerNode[workerIndex()];
+#if defined(__linux__)
+        int cpu = sched_getcpu();
+        if (cpu >= 0 && cpu < static_cast<int>(cpuNode.size())) return cpuNode[cpu];
+#endif
+        return 0;
+    }
+
+    // Which worker the calling thread is, -1 if it isnt one
+    static int& workerIndex() {
+        thread_local int index = -1;
+        return index;
+    }
+
+    void workerLoop(int index) {
+        workerIndex() = index;
+        while (true) {
+            std::shared_ptr<Job> job;
+            {
+                std::unique_lock<std::mutex> lock(m);
+                cv.wait(lock, [this] { return stopping || !jobs.empty(); });
+                if (stopping) return;
+
+                job = jobs.front();
+                // Everything in this job has been handed out already, drop it from the queue
+                if (job->handedOut()) {
+                    jobs.pop_front();
+                    continue;
+                }
+            }
+            runTasks(*job);
+        }
+    }
+
+    std::vector<std::thread> workers;
+    std::vector<int> workerNode; // NUMA node of every worker
+    std::vector<int> cpuNode;    // and of every cpu
+    int nodes = 1;
+    std::deque<std::shared_ptr<Job>> jobs;
+    std::mutex m;
+    std::condition_variable cv;
+    std::condition_variable doneCv;
+    bool stopping = false;
+    std::atomic<TaskObserver*> observer{nullptr};
+};
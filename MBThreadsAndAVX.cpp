@@ -1,18 +1,29 @@
 #include <thread>
 #include <vector>
+#include <algorithm>
+#include <cstdlib>
 #include <SDL2/SDL.h>
 #include <complex>
+#include <future>
 #include <iostream>
-#include <immintrin.h>
+#include "MBGpu.h"
+#include "MBIterationMap.h"
+#include "MBKernels.h"
+#include "MBPalette.h"
+#include "MBRender.h"
+#include "MBStats.h"
+#include "MBThreadPool.h"
+#include "MBTileCache.h"
 
 /*
     Because the threads dont need to share data here, we dont really need to use mutex
-    We will partition the screen into equal rectangles, 1 for each thread we want. 
+    We cut the screen into thin bands of rows (or tiles, see MBRender.h) and hand them to a thread
+    pool that is made once at startup.
 
-    Not every thread will end at the same time, because since we are dividing the regions on the screen
-    to each thread, some threads will end their loops early in the iterations because they reach 
-    the constraint fast, and some will be taking way longer, thus bottlenecking a bit.
-    Can be solved a bit more with thread pools. 
+    Splitting the screen into 1 big rectangle per thread meant some threads finished early because
+    their region escapes fast, while the ones covering the inside of the set took way longer and
+    bottlenecked the frame. With small bands pulled off a shared counter, whoever is free takes the
+    next band, so the expensive rows get spread over everyone.
 */
 
 const int SCREEN_WIDTH = 800;
@@ -20,101 +31,128 @@ const int SCREEN_HEIGHT = 600;
 const int MAX_ITER = 1000;
 const int THREAD_COUNT = 32; 
 
-struct Color {
-    uint8_t r, g, b;
-};
+// How often color cycling moves the palette along, and how long once around takes
+const int CYCLE_FRAME_MS = 16;
+const double CYCLE_PERIOD_MS = 8000.0;
 
-// Maps an iteration to a color
-Color getColor(int iter) {
-    if (iter == MAX_ITER) {
-        return {0, 0, 0};
-    } else {
-        double t = static_cast<double>(iter) / MAX_ITER;
-        uint8_t r = static_cast<uint8_t>(128.0 + 127.0 * sin(6.28318 * t + 0));
-        uint8_t g = static_cast<uint8_t>(128.0 + 127.0 * sin(6.28318 * t + 2.09439)); // 2π/3 phase shift
-        uint8_t b = static_cast<uint8_t>(128.0 + 127.0 * sin(6.28318 * t + 4.18879)); // 4π/3 phase shift
-        return {r, g, b};
-    }
-}
+// Stats overlay (I key): a bar per thread, then the frame phases, then the lane steps, all this wide
+const int OVERLAY_WIDTH = 240;
+const int OVERLAY_BAR = 4;
+const char* const TRACE_FILE = "mb_trace.json";
 
 // Calculates if a complex number c is in MB set and returns number of iters before leaving set
 int mandelbrot(std::complex<double> c) {
+    // Main cardioid and period 2 bulb are in the set, no need to iterate them at all
+    if (inMainCardioidOrBulb(c.real(), c.imag())) return MAX_ITER;
+
     std::complex<double> z = 0;
     int iter = 0;
 
+    // Brent style cycle detection: remember z every so often (doubling the gap each time) and if
+    // the orbit lands back on it, it is stuck in a cycle and will never escape
+    std::complex<double> saved = 0;
+    int window = 8;
+    int untilSave = window;
+
     while (std::norm(z) <= 4.0 && iter < MAX_ITER) {
         z = z * z + c;
         iter++;
+
+        if (std::norm(z - saved) < 1e-28) return MAX_ITER;
+        if (--untilSave == 0) {
+            window *= 2;
+            untilSave = window;
+            saved = z;
+        }
     }
 
     return iter;
 }
 
-// Defining 64-bit double AVX registers, so each ymm register can fit 4 of them at once to do SIMD
-__m256d _zr, _zi, _ca, _cb, _a, _b, _zr2, _zi2, _two, _four, _mask1;
-
-// 64-bit integer AVX registers
-__m256i _n, _iter, _mask2, _c, _one;
-
-// Calc c in MB set using AVX256 intrinsics, doing 4 different cs at once 
-// Calc c in MB set using AVX256 intrinsics, doing 4 different cs at once
-void mandelbrotAVX(double offsetX, double offsetY, double zoom, const int max_iterations, Uint32* pixels, int bytesPerRow, int startY, int endY) {
-    __m256d _four = _mm256_set1_pd(4.0);
-    __m256d _two = _mm256_set1_pd(2.0);
-    __m256i _one = _mm256_set1_epi64x(1);
-
-    for (int i = startY; i < endY; ++i) {
-        for (int j = 0; j < SCREEN_WIDTH; j += 4) {
-            __m256i _iter = _mm256_set1_epi64x(0);
-            __m256d _ca = _mm256_set_pd(
-                (j + 3 - SCREEN_WIDTH / 2.0) * 4.0 / (SCREEN_WIDTH * zoom) + offsetX,
-                (j + 2 - SCREEN_WIDTH / 2.0) * 4.0 / (SCREEN_WIDTH * zoom) + offsetX,
-                (j + 1 - SCREEN_WIDTH / 2.0) * 4.0 / (SCREEN_WIDTH * zoom) + offsetX,
-                (j + 0 - SCREEN_WIDTH / 2.0) * 4.0 / (SCREEN_WIDTH * zoom) + offsetX
-            );
-            __m256d _cb = _mm256_set1_pd((i - SCREEN_HEIGHT / 2.0) * 4.0 / (SCREEN_HEIGHT * zoom) + offsetY);
-            __m256d _zr = _mm256_setzero_pd();
-            __m256d _zi = _mm256_setzero_pd();
-
-            for (int k = 0; k < max_iterations; ++k) {
-                __m256d _zr2 = _mm256_mul_pd(_zr, _zr);
-                __m256d _zi2 = _mm256_mul_pd(_zi, _zi);
-
-                __m256d _abs = _mm256_add_pd(_zr2, _zi2);
-                __m256d _mask1 = _mm256_cmp_pd(_abs, _four, _CMP_LT_OQ);
-                __m256i _mask2 = _mm256_castpd_si256(_mask1);
-                if (_mm256_testz_si256(_mask2, _mask2)) break;
-
-                _zi = _mm256_add_pd(_mm256_mul_pd(_two, _mm256_mul_pd(_zr, _zi)), _cb);
-                _zr = _mm256_add_pd(_mm256_sub_pd(_zr2, _zi2), _ca);
-
-                _iter = _mm256_add_epi64(_iter, _one);
-            }
+// Turn the iteration counts into texture pixels, bands of rows on the pool again. The colors come
+// out of the palette table, so this is one gather per 8 / 16 pixels instead of three sin() each.
+// Into the texture the stores are non-temporal (streaming), nothing on the cpu reads those back.
+void colorize(ThreadPool& pool, const Palette& palette, const IterationBuffer& iters, Uint32* pixels, int bytesPerRow, bool streaming = true) {
+    ColorizeFn colorizeRun = streaming ? activeColorizeStreaming() : activeColorize();
+    int bands = (iters.height + BAND_ROWS - 1) / BAND_ROWS;
+
+    pool.parallelFor(bands, [&](int band) {
+        int startY = band * BAND_ROWS;
+        int endY = std::min(startY + BAND_ROWS, iters.height);
+        for (int i = startY; i < endY; ++i) {
+            colorizeRun(iters.row(i), iters.width, palette.colors.data(), palette.maxIter, pixels + i * (bytesPerRow / 4));
+        }
+    });
+}
 
-            for (int k = 0; k < 4; ++k) {
-                int iter = reinterpret_cast<int64_t*>(&_iter)[3 - k];
-                Color color = getColor(iter);
-                pixels[i * (bytesPerRow / 4) + j + k] = (color.r << 24) | (color.g << 16) | (color.b << 8) | 0xFF;
-            }
+// Copies a frame that was colorized ahead of time into the locked texture, bands of rows on the
+// pool, since the texture rows can be further apart than the frame's
+void copyRows(ThreadPool& pool, const std::vector<Uint32>& frame, int width, int height, Uint32* pixels, int bytesPerRow) {
+    int bands = (height + BAND_ROWS - 1) / BAND_ROWS;
+
+    pool.parallelFor(bands, [&](int band) {
+        for (int i = band * BAND_ROWS; i < std::min((band + 1) * BAND_ROWS, height); ++i) {
+            streamPixels(frame.data() + static_cast<size_t>(i) * width, width, pixels + i * (bytesPerRow / 4));
         }
-    }
+    });
 }
-void mandelbrotThreads(double offsetX, double offsetY, double zoom, const int max_iterations, Uint32* pixels, int bytesPerRow) {
-    std::vector<std::thread> threads; 
-    int rows_per_thread = SCREEN_HEIGHT / THREAD_COUNT;
 
-    for (int i = 0; i < THREAD_COUNT; ++i) {
-        int startY = i * rows_per_thread;
-        int endY = (i == THREAD_COUNT - 1) ? SCREEN_HEIGHT : (i + 1) * rows_per_thread;
+// The next frame, worked out while the last one is still going up to the screen (see lookAhead in
+// main). Counts and colors both, so all that is left to do with it is copy it into the texture.
+struct FrameSlot {
+    IterationBuffer iters;
+    std::vector<Uint32> pixels;
+    Palette palette;           // its own copy, the main thread can change the real one meanwhile
+    std::future<void> computing;
+    bool fresh = false;        // computed ahead and not shown yet
+};
 
-        threads.emplace_back(mandelbrotAVX, offsetX, offsetY, zoom, max_iterations, pixels, bytesPerRow, startY, endY);
+// No text without SDL_ttf, so the overlay is bars (the numbers go to the console). Every bar is
+// the whole frame time wide:
+//   one per thread   green busy, dark idle (the last one is the main thread)
+//   phases           blue compute, yellow lock, orange colorize, magenta upload, cyan present
+//   lanes            green lane steps that iterated a pixel, red wasted ones
+void drawOverlay(SDL_Renderer* renderer, const FrameStats& stats) {
+    if (stats.wallMs <= 0) return;
+    SDL_SetRenderDrawBlendMode(renderer, SDL_BLENDMODE_BLEND);
+
+    int rows = static_cast<int>(stats.busyMs.size()) + 2;
+    SDL_Rect back = {0, 0, OVERLAY_WIDTH + 8, rows * (OVERLAY_BAR + 1) + 8};
+    SDL_SetRenderDrawColor(renderer, 0x00, 0x00, 0x00, 0xA0);
+    SDL_RenderFillRect(renderer, &back);
+
+    auto segment = [&](int row, double from, double to, Uint8 r, Uint8 g, Uint8 b) {
+        int x0 = static_cast<int>(std::min(from, 1.0) * OVERLAY_WIDTH);
+        int x1 = static_cast<int>(std::min(to, 1.0) * OVERLAY_WIDTH);
+        if (x1 <= x0) return;
+        // A little gap between the thread bars and the other two
+        int y = 4 + row * (OVERLAY_BAR + 1) + (row >= rows - 2 ? 2 : 0);
+        SDL_Rect rect = {4 + x0, y, x1 - x0, OVERLAY_BAR};
+        SDL_SetRenderDrawColor(renderer, r, g, b, 0xFF);
+        SDL_RenderFillRect(renderer, &rect);
+    };
+
+    for (size_t t = 0; t < stats.busyMs.size(); ++t) {
+        double busy = stats.busyMs[t] / stats.wallMs;
+        segment(static_cast<int>(t), 0, busy, 0x30, 0xD0, 0x30);
+        segment(static_cast<int>(t), busy, 1, 0x40, 0x40, 0x40);
     }
 
-    for (auto& thread : threads) {
-        thread.join();
+    static const Uint8 PHASE_COLORS[PHASE_COUNT][3] = {{0xE0, 0xE0, 0x20}, {0xF0, 0x80, 0x10}, {0xD0, 0x30, 0xD0}, {0x20, 0xD0, 0xE0}};
+    double at = stats.computeMs() / stats.wallMs;
+    segment(rows - 2, 0, at, 0x30, 0x60, 0xF0);
+    for (int p = 0; p < PHASE_COUNT; ++p) {
+        double width = stats.phaseMs[p] / stats.wallMs;
+        segment(rows - 2, at, at + width, PHASE_COLORS[p][0], PHASE_COLORS[p][1], PHASE_COLORS[p][2]);
+        at += width;
     }
+
+    double useful = 1.0 - stats.wastedFraction();
+    segment(rows - 1, 0, useful, 0x30, 0xD0, 0x30);
+    segment(rows - 1, useful, 1, 0xE0, 0x30, 0x30);
 }
-int main() {
+
+int main(int argc, char** argv) {
     // Init SDL2
     if (SDL_Init(SDL_INIT_VIDEO) < 0) {
         std::cerr << "SDL could not start! Error: " << SDL_GetError() << std::endl;
@@ -129,8 +167,15 @@ int main() {
         return 1;
     }
 
-    // Create renderer
+    // Create renderer. The gpu backend draws into the texture with OpenGL, so ask for SDL's opengl
+    // renderer (MB_NO_GPU=1 leaves it to SDL) and take whatever else there is if that fails.
+    bool wantGpu = std::getenv("MB_NO_GPU") == nullptr;
+    if (wantGpu) SDL_SetHint(SDL_HINT_RENDER_DRIVER, "opengl");
     SDL_Renderer* renderer = SDL_CreateRenderer(window, -1, SDL_RENDERER_ACCELERATED);
+    if (!renderer && wantGpu) {
+        SDL_SetHint(SDL_HINT_RENDER_DRIVER, "");
+        renderer = SDL_CreateRenderer(window, -1, SDL_RENDERER_ACCELERATED);
+    }
     if (!renderer) {
         std::cerr << "Renderer could not be made! Error: " << SDL_GetError() << std::endl;
         SDL_DestroyWindow(window);
@@ -148,62 +193,244 @@ int main() {
         return 1;
     }
 
+    std::cout << "Using " << activeKernel().name << " kernel (" << activeKernel().lanes << " doubles / "
+              << activeKernel().floatLanes << " floats per register)" << std::endl;
+
+    // Views the gpu has the precision for get computed there, the rest on the cpu as before
+    std::unique_ptr<GpuRenderer> gpu;
+    if (wantGpu) {
+        std::string why;
+        gpu = GpuRenderer::create(renderer, texture, SCREEN_WIDTH, SCREEN_HEIGHT, why);
+        if (gpu) {
+            std::cout << "GPU backend on, G to turn it off" << std::endl;
+        } else {
+            std::cout << "No GPU backend (" << why << "), everything on the cpu" << std::endl;
+        }
+    }
+    bool gpuFrame = false; // the texture holds a gpu frame, its counts are on the gpu and not in iters
+
+    // Workers live for the whole run, every frame just feeds them new bands
+    ThreadPool pool(THREAD_COUNT);
+
+    // Only watches the pool while the overlay is up or a trace is being recorded
+    Profiler profiler(pool);
+    bool overlay = false;
+    auto watching = [&]() -> Profiler* { return overlay || profiler.isRecording() ? &profiler : nullptr; };
+
+    RenderSettings settings;
+    IterationBuffer iters;
+    IterationBuffer preview; // where the zoom preview gets stretched into before it swaps with iters
+    Palette palette;
+
+    // Tiles of views we already saw. MB_TILE_SPILL=dir keeps the ones that fall out of memory on disk.
+    const char* spillDir = std::getenv("MB_TILE_SPILL");
+    TileCache tileCache(TILE_CACHE_BYTES, spillDir ? spillDir : "");
+
     // Initial zoom and position
-    double zoom = 1.0;
-    double offsetX = -0.5;
-    double offsetY = 0.0;
+    View view;
+    view.width = SCREEN_WIDTH;
+    view.height = SCREEN_HEIGHT;
+    view.maxIter = MAX_ITER;
+
+    // MBThreads some.mbmap opens a saved iteration map (see MBHeadless --map). Anything at or
+    // above its resolution then comes straight out of the file, so zooming out over a huge render
+    // is instant. We start out looking at all of it, with its iteration count.
+    std::unique_ptr<IterationMap> map;
+    if (argc > 1) {
+        map = IterationMap::open(argv[1]);
+        if (!map) {
+            std::cerr << "Cant open iteration map " << argv[1] << std::endl;
+        } else {
+            View from = map->view();
+            view.setCenter(from.centerX, from.centerY);
+            view.maxIter = from.maxIter;
+            // Same zoom shows the same area, whatever the pixel count
+            view.zoom = from.zoom;
+            std::cout << "Opened " << from.width << "x" << from.height << " iteration map (" << map->header().precision << ")"
+                      << std::endl;
+        }
+    }
 
     // Main loop flags
     bool quit = false;
     SDL_Event e;
 
-    // Main loop
-    while (!quit) {
-        // Handle events
-        while (SDL_PollEvent(&e) != 0) {
-            if (e.type == SDL_QUIT) {
-                quit = true;
-            } else if (e.type == SDL_KEYDOWN) {
-                switch (e.key.keysym.sym) {
-                    case SDLK_UP:
-                        offsetY -= 0.1 / zoom;
-                        break;
-                    case SDLK_DOWN:
-                        offsetY += 0.1 / zoom;
-                        break;
-                    case SDLK_LEFT:
-                        offsetX -= 0.1 / zoom;
-                        break;
-                    case SDLK_RIGHT:
-                        offsetX += 0.1 / zoom;
-                        break;
-                    case SDLK_PLUS:
-                    case SDLK_EQUALS:
-                        zoom *= 1.1;
-                        break;
-                    case SDLK_MINUS:
-                        zoom /= 1.1;
-                        break;
-                }
-            } else if (e.type == SDL_MOUSEWHEEL) {
-                if (e.wheel.y > 0) { // upscroll
-                    zoom *= 1.1;
-                } else if (e.wheel.y < 0) { // scroll down
-                    zoom /= 1.1;
+    // What the texture currently shows, so we only recompute when the view actually changed
+    View shown;
+    bool haveFrame = false;
+    bool repaint = false; // window got uncovered/resized, put the same texture back up
+    bool recolor = false; // palette changed, redo the texture from the counts we already have
+    bool cycling = false;
+    Uint32 lastCycle = 0;
+
+    // Moves on whenever a render goes stale, see startProgressivePass
+    Generation generation{0};
+    GridMatch match;
+
+    auto handleEvent = [&](const SDL_Event& e) {
+        if (e.type == SDL_QUIT) {
+            quit = true;
+        } else if (e.type == SDL_WINDOWEVENT) {
+            repaint = true;
+        } else if (e.type == SDL_KEYDOWN) {
+            switch (e.key.keysym.sym) {
+                case SDLK_UP:
+                    view.pan(0, -0.1 / view.zoom);
+                    break;
+                case SDLK_DOWN:
+                    view.pan(0, 0.1 / view.zoom);
+                    break;
+                case SDLK_LEFT:
+                    view.pan(-0.1 / view.zoom, 0);
+                    break;
+                case SDLK_RIGHT:
+                    view.pan(0.1 / view.zoom, 0);
+                    break;
+                case SDLK_PLUS:
+                case SDLK_EQUALS:
+                    view.zoom = std::min(view.zoom * 1.1, MAX_ZOOM);
+                    break;
+                case SDLK_MINUS:
+                    view.zoom /= 1.1;
+                    break;
+                case SDLK_l:
+                    settings.laneRefill = !settings.laneRefill;
+                    std::cout << "Lane refill " << (settings.laneRefill ? "on" : "off") << std::endl;
+                    break;
+                case SDLK_v:
+                    settings.interleave = !settings.interleave;
+                    std::cout << "Interleaved kernels " << (settings.interleave ? "on" : "off") << std::endl;
+                    break;
+                case SDLK_m:
+                    settings.strategy = settings.strategy == Strategy::Bands ? Strategy::MarianiSilver : Strategy::Bands;
+                    std::cout << "Rendering with " << strategyName(settings.strategy) << std::endl;
+                    break;
+                case SDLK_d:
+                    settings.perturbation = !settings.perturbation;
+                    std::cout << (settings.perturbation ? "Perturbation" : "Double-double") << " for deep zooms" << std::endl;
+                    break;
+                case SDLK_p:
+                    settings.progressive = !settings.progressive;
+                    std::cout << "Progressive rendering " << (settings.progressive ? "on" : "off") << std::endl;
+                    break;
+                case SDLK_t:
+                    settings.tileCache = !settings.tileCache;
+                    std::cout << "Tile cache " << (settings.tileCache ? "on" : "off") << std::endl;
+                    break;
+                case SDLK_g:
+                    settings.gpu = !settings.gpu;
+                    std::cout << "GPU " << (settings.gpu ? (gpu ? "on" : "on, but there isnt one") : "off") << std::endl;
+                    break;
+                case SDLK_z:
+                    settings.zoomPreview = !settings.zoomPreview;
+                    std::cout << "Zoom preview " << (settings.zoomPreview ? "on" : "off") << std::endl;
+                    break;
+                case SDLK_c:
+                    cycling = !cycling;
+                    lastCycle = SDL_GetTicks();
+                    std::cout << "Color cycling " << (cycling ? "on" : "off") << std::endl;
+                    break;
+                case SDLK_k:
+                    palette.nextScheme();
+                    recolor = true;
+                    std::cout << "Palette " << paletteSchemeName(palette.scheme) << std::endl;
+                    break;
+                case SDLK_LEFTBRACKET:
+                    palette.contrast /= 1.25;
+                    recolor = true;
+                    break;
+                case SDLK_RIGHTBRACKET:
+                    palette.contrast *= 1.25;
+                    recolor = true;
+                    break;
+                case SDLK_i:
+                    overlay = !overlay;
+                    pool.setObserver(watching());
+                    repaint = true;
+                    std::cout << "Stats overlay " << (overlay ? "on" : "off") << std::endl;
+                    break;
+                case SDLK_r:
+                    if (!profiler.isRecording()) {
+                        profiler.startRecording();
+                        std::cout << "Recording a trace, R again to stop" << std::endl;
+                    } else if (profiler.stopRecording(TRACE_FILE)) {
+                        std::cout << "Wrote " << TRACE_FILE << ", open it in chrome://tracing or ui.perfetto.dev" << std::endl;
+                    } else {
+                        std::cerr << "Cant write " << TRACE_FILE << std::endl;
+                    }
+                    pool.setObserver(watching());
+                    break;
+            }
+        } else if (e.type == SDL_MOUSEWHEEL) {
+            if (e.wheel.y > 0) { // upscroll
+                view.zoom = std::min(view.zoom * 1.1, MAX_ZOOM);
+            } else if (e.wheel.y < 0) { // scroll down
+                view.zoom /= 1.1;
+            }
+        }
+    };
+
+    // Frames that are computed in one go (no progressive passes, previews or tiles): the only ones
+    // worth starting early, the others show up bit by bit anyway
+    auto wholeFrame = [&](const View& v) {
+        if (gpu && settings.gpu && gpuPrecisionFor(v) != GpuPrecision::None) return false;
+        if (map || (settings.tileCache && tileCacheCovers(v))) return false;
+        if (settings.zoomPreview && haveFrame && !canReuse(iters, v)) return false;
+        return !settings.progressive || canReuse(iters, v);
+    };
+
+    // Pipelining: once a frame is in the texture, whatever events piled up meanwhile get handled,
+    // and if they moved the view the next frame starts computing (and colorizing, into ahead) on
+    // the pool right away. The main thread then does the upload and the present, which can take a
+    // whole vsync, while the workers are already on the next one.
+    FrameSlot ahead;
+    auto lookAhead = [&]() {
+        if (ahead.computing.valid()) return;
+        SDL_Event next;
+        while (SDL_PollEvent(&next) != 0) handleEvent(next);
+        if (quit || view == iters.view || !wholeFrame(view)) return;
+
+        View target = view;
+        RenderSettings frameSettings = settings;
+        ahead.palette = palette;
+        ahead.palette.update(target.maxIter);
+        ahead.fresh = true;
+        ahead.computing = std::async(std::launch::async, [&pool, &ahead, target, frameSettings] {
+            renderFrame(pool, frameSettings, target, ahead.iters);
+            ahead.pixels.resize(static_cast<size_t>(target.width) * target.height);
+            // Not streamed, copyRows reads these again soon
+            colorize(pool, ahead.palette, ahead.iters, ahead.pixels.data(), target.width * sizeof(Uint32), false);
+        });
+    };
+
+    // Color whatever is in iters into the texture (if asked) and put it on screen. With staged the
+    // colors are already done and just get copied in. pipeline starts on the next frame before the
+    // upload (see lookAhead).
+    auto present = [&](bool upload, const std::vector<Uint32>* staged = nullptr, bool pipeline = false) {
+        Profiler* stats = watching();
+        if (upload) {
+            // Lock texture for manipulation
+            void* pixels;
+            int bytesPerRow;
+            {
+                Profiler::Scope scope(stats, Phase::Lock);
+                SDL_LockTexture(texture, NULL, &pixels, &bytesPerRow);
+            }
+            {
+                Profiler::Scope scope(stats, Phase::Colorize);
+                if (staged) {
+                    copyRows(pool, *staged, iters.width, iters.height, static_cast<Uint32*>(pixels), bytesPerRow);
+                } else {
+                    palette.update(iters.view.maxIter);
+                    colorize(pool, palette, iters, static_cast<Uint32*>(pixels), bytesPerRow);
                 }
             }
+            if (pipeline) lookAhead();
+            Profiler::Scope scope(stats, Phase::Upload);
+            SDL_UnlockTexture(texture);
         }
 
-        // Lock texture for manipulation
-        void* pixels;
-        int bytesPerRow;
-        SDL_LockTexture(texture, NULL, &pixels, &bytesPerRow);
-
-        // Draw mandelbrot and manipulate pixels directly using SIMD
-        Uint32* pixelData = static_cast<Uint32*>(pixels);
-        mandelbrotThreads(offsetX, offsetY, zoom, MAX_ITER, pixelData, bytesPerRow);
-
-        SDL_UnlockTexture(texture);
+        Profiler::Scope scope(stats, Phase::Present);
 
         // Clear screen
         SDL_SetRenderDrawColor(renderer, 0x00, 0x00, 0x00, 0xFF);
@@ -211,11 +438,206 @@ int main() {
 
         // Copy texture to renderer
         SDL_RenderCopy(renderer, texture, NULL, NULL);
+        if (overlay) drawOverlay(renderer, profiler.lastFrame());
 
         // Update screen
         SDL_RenderPresent(renderer);
+    };
+
+    // Main loop
+    while (!quit) {
+        // Handle events. With nothing left to draw, block until the next one shows up instead of
+        // spinning all the cores on identical frames. Color cycling only needs a wakeup every frame.
+        bool idle = haveFrame && view == shown;
+        int pending = !idle ? SDL_PollEvent(&e) : cycling ? SDL_WaitEventTimeout(&e, CYCLE_FRAME_MS) : SDL_WaitEvent(&e);
+        for (; pending != 0; pending = SDL_PollEvent(&e)) {
+            handleEvent(e);
+        }
+
+        if (quit) break;
+
+        if (cycling) {
+            Uint32 now = SDL_GetTicks();
+            palette.cycle((now - lastCycle) / CYCLE_PERIOD_MS);
+            lastCycle = now;
+            recolor = true;
+        }
+
+        bool viewChanged = !haveFrame || view != shown;
+        if (!viewChanged && !repaint && !recolor) continue;
+        bool upload = recolor;
+        repaint = false;
+        recolor = false;
+        // Any cpu path below overwrites the whole texture
+        bool lastWasGpu = gpuFrame;
+        if (viewChanged) gpuFrame = false;
+
+        Profiler* stats = watching();
+        if (stats) stats->beginFrame();
+
+        if (!viewChanged && gpuFrame) {
+            if (upload) {
+                palette.update(shown.maxIter);
+                gpu->recolor(palette);
+            }
+            present(false);
+        } else if (!viewChanged) {
+            // Only the colors changed, one pass over the counts instead of a recompute
+            present(upload);
+        } else if (gpu && settings.gpu && gpuPrecisionFor(view) != GpuPrecision::None) {
+            // Straight into the texture, so nothing to upload. iters keeps the last cpu frame, which
+            // isnt this view anymore.
+            palette.update(view.maxIter);
+            gpu->render(view, palette, gpuPrecisionFor(view));
+            present(false);
+            gpuFrame = true;
+            shown = view;
+            haveFrame = true;
+        } else if (map && sampleIterationMap(pool, *map, view, iters)) {
+            present(true);
+            shown = view;
+            haveFrame = true;
+        } else if (settings.tileCache && tileCacheCovers(view)) {
+            // Only tiles we dont have yet get computed. Meanwhile whatever the cache has (from this
+            // zoom level or the ones around it) goes up right away.
+            View target = view;
+            uint64_t current = ++generation;
+            auto job = startMissingTiles(pool, settings, tileCache, missingTiles(tileCache, target), generation, current);
+            bool stale = false;
+
+            if (!job->done()) {
+                composeFromTiles(pool, tileCache, target, iters);
+                present(true);
+            }
+            while (!job->done()) {
+                if (SDL_WaitEventTimeout(&e, 4) != 0) {
+                    do {
+                        handleEvent(e);
+                    } while (SDL_PollEvent(&e) != 0);
+                }
+                if (quit || view != target) {
+                    // Tiles already done stay cached, the rest gets skipped
+                    ++generation;
+                    stale = true;
+                    break;
+                }
+            }
+            pool.wait(job);
+
+            if (!stale) {
+                composeFromTiles(pool, tileCache, target, iters);
+                present(true);
+                shown = target;
+                haveFrame = true;
+            }
+        } else if (settings.zoomPreview && haveFrame && !lastWasGpu && !canReuse(iters, view) && reprojectFrame(iters, view, preview, match)) {
+            // Old frame stretched onto the new view goes up at once, then the rows get redone over it
+            // (skipping pixels that were already exact) and go up every frame as they come in
+            std::swap(iters, preview);
+            present(true);
+
+            View target = view;
+            uint64_t current = ++generation;
+            auto job = startRefine(pool, settings, target, iters, match, generation, current);
+            bool stale = false;
+            Uint32 lastShown = SDL_GetTicks();
+
+            while (!job->done()) {
+                if (SDL_WaitEventTimeout(&e, 4) != 0) {
+                    do {
+                        handleEvent(e);
+                    } while (SDL_PollEvent(&e) != 0);
+                }
+                if (quit || view != target) {
+                    ++generation;
+                    stale = true;
+                    break;
+                }
+                // Rows still being written just show up half old, half new for a frame
+                if (SDL_GetTicks() - lastShown >= CYCLE_FRAME_MS) {
+                    present(true);
+                    lastShown = SDL_GetTicks();
+                }
+            }
+            pool.wait(job);
+
+            if (!stale) {
+                present(true);
+                iters.valid = true;
+                shown = target;
+                haveFrame = true;
+            }
+        } else if (!settings.progressive || canReuse(iters, view)) {
+            // Pans only compute a thin strip, no point going through the coarse passes for that.
+            // If lookAhead already started on this view it is probably done by now.
+            if (ahead.computing.valid()) ahead.computing.get();
+            bool ready = ahead.fresh && ahead.iters.valid && ahead.iters.view == view;
+            // Cleared before presenting, which might start the next one
+            ahead.fresh = false;
+            if (ready) {
+                // The older frame goes to ahead, as the one the next look ahead reuses. Colors only
+                // get redone if the palette moved on since.
+                std::swap(iters, ahead.iters);
+                const Palette& used = ahead.palette;
+                bool sameColors = used.scheme == palette.scheme && used.offset == palette.offset && used.contrast == palette.contrast;
+                present(true, sameColors ? &ahead.pixels : nullptr, true);
+            } else {
+                renderFrame(pool, settings, view, iters);
+                present(true, nullptr, true);
+            }
+            // Not view, the look ahead might have moved that on already
+            shown = iters.view;
+            haveFrame = true;
+        } else {
+            // Coarse to fine, showing each pass as soon as it is done. The main thread keeps handling
+            // events meanwhile, and if they move the view the rest of this frame gets dropped.
+            View target = view;
+            uint64_t current = ++generation;
+            bool stale = false;
+
+            for (int pass = 0; pass < PROGRESSIVE_PASSES && !stale; ++pass) {
+                auto job = startProgressivePass(pool, settings, target, iters, pass, generation, current);
+                while (!job->done()) {
+                    if (SDL_WaitEventTimeout(&e, 4) != 0) {
+                        do {
+                            handleEvent(e);
+                        } while (SDL_PollEvent(&e) != 0);
+                    }
+                    if (quit || view != target) {
+                        ++generation;
+                        stale = true;
+                        break;
+                    }
+                }
+                // Stale tasks see the new generation and bail out, so this doesnt take long
+                pool.wait(job);
+                if (!stale) present(true);
+            }
+
+            if (!stale) {
+                iters.view = target;
+                iters.valid = true;
+                shown = target;
+                haveFrame = true;
+            }
+        }
+
+        if (stats) {
+            stats->endFrame();
+            // Put the bars for the frame that just finished up over it
+            if (overlay) {
+                if (viewChanged) std::cout << stats->summary() << std::endl;
+                present(false);
+            }
+        }
     }
 
+    // Dont quit under a frame still computing ahead
+    if (ahead.computing.valid()) ahead.computing.get();
+
+    // The gpu backend still has the texture bound and its buffers in the renderer's GL context
+    gpu.reset();
+
     // Destroy texture, renderer, and window
     SDL_DestroyTexture(texture);
     SDL_DestroyRenderer(renderer);
@@ -0,0 +1,302 @@
+#pragma once
+
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "MBRender.h"
+#include "MBThreadPool.h"
+
+/*
+    Cache of already computed pieces of the plane, so zooming in and back out (or panning back and
+    forth) doesnt redo views we just looked at. Same idea as web maps: at zoom level L a tile is
+    TILE_SIZE x TILE_SIZE pixels spaced like a screen at zoom 2^L, and tile (tx, ty) starts at
+    x = tx * TILE_SIZE * step, y = ty * TILE_SIZE * step. The grid is fixed in the plane, so any
+    two views near the same zoom share tiles.
+
+    A frame picks the level nearest its zoom and takes every pixel from the nearest tile pixel, so
+    it is resampled by up to a factor sqrt(2) either way. Only tiles that arent cached yet get
+    computed. While they are, the frame gets put together from neighbouring levels where possible,
+    which gives an instant (blurry or sharp) preview when zooming.
+
+    Tiles are kept most recently used first within TILE_CACHE_BYTES. With MB_TILE_SPILL=dir set,
+    tiles pushed out of memory go to files in dir (up to TILE_SPILL_BYTES all together) and come
+    back from there instead of being recomputed.
+
+    Only for views plain doubles can do: the tile numbers would overflow long before the zooms that
+    need double-double or perturbation, and those would need a reference orbit per tile anyway.
+*/
+
+const int TILE_SIZE = 256;
+const size_t TILE_CACHE_BYTES = size_t(256) << 20;
+const uint64_t TILE_SPILL_BYTES = uint64_t(4) << 30;
+const int TILE_MAX_LEVEL = 40;
+const int TILE_FALLBACK_LEVELS = 3; // how far up or down the preview looks for tiles
+
+struct TileKey {
+    int level;
+    int64_t tx, ty;
+    int maxIter;
+    int width, height; // screen size the level spacing is based on, see tileStepX
+
+    bool operator==(const TileKey& other) const {
+        return level == other.level && tx == other.tx && ty == other.ty && maxIter == other.maxIter &&
+               width == other.width && height == other.height;
+    }
+};
+
+struct TileKeyHash {
+    size_t operator()(const TileKey& key) const {
+        uint64_t h = 1469598103934665603ull;
+        for (uint64_t part : {uint64_t(key.level), uint64_t(key.tx), uint64_t(key.ty), uint64_t(key.maxIter),
+                              uint64_t(key.width), uint64_t(key.height)}) {
+            h = (h ^ part) * 1099511628211ull;
+        }
+        return static_cast<size_t>(h);
+    }
+};
+
+using Tile = std::shared_ptr<const std::vector<uint32_t>>; // TILE_SIZE rows of TILE_SIZE counts
+
+// Pixel spacing of a level, the same as a width x height screen at zoom 2^level
+inline double tileStepX(int level, int width) { return 4.0 / (width * std::ldexp(1.0, level)); }
+inline double tileStepY(int level, int height) { return 4.0 / (height * std::ldexp(1.0, level)); }
+
+inline int tileLevelFor(const View& view) { return static_cast<int>(std::lround(std::log2(view.zoom))); }
+
+// True if view can be put together from tiles
+inline bool tileCacheCovers(const View& view) {
+    return tileLevelFor(view) + TILE_FALLBACK_LEVELS <= TILE_MAX_LEVEL && !isDeep(view);
+}
+
+// True if every pixel of view sits exactly on a pixel of its own level (zoom a power of 2, top
+// left pixel on the tile grid), so putting it together from tiles isnt resampling anything
+inline bool onTileGrid(const View& view) {
+    if (!tileCacheCovers(view) || view.zoom != std::ldexp(1.0, tileLevelFor(view))) return false;
+    double column = view.pixelX(0) / view.stepX();
+    double row = view.pixelY(0) / view.stepY();
+    return std::fabs(column - std::round(column)) < 1e-6 && std::fabs(row - std::round(row)) < 1e-6;
+}
+
+class TileCache {
+public:
+    explicit TileCache(size_t budgetBytes = TILE_CACHE_BYTES, std::string spillDir = "")
+        : budget(budgetBytes), spillDir(std::move(spillDir)) {}
+
+    // Null if the tile isnt in memory
+    Tile find(const TileKey& key) {
+        std::lock_guard<std::mutex> lock(m);
+        auto it = index.find(key);
+        if (it == index.end()) return nullptr;
+        order.splice(order.begin(), order, it->second); // now the most recently used
+        return it->second->second;
+    }
+
+    // Tile from the spill directory if it was pushed out there earlier, null otherwise
+    Tile loadSpilled(const TileKey& key) {
+        if (spillDir.empty()) return nullptr;
+        FILE* file = std::fopen(spillPath(key).c_str(), "rb");
+        if (!file) return nullptr;
+
+        auto counts = std::make_shared<std::vector<uint32_t>>(TILE_SIZE * TILE_SIZE);
+        bool ok = std::fread(counts->data(), sizeof(uint32_t), counts->size(), file) == counts->size();
+        std::fclose(file);
+        return ok ? counts : nullptr;
+    }
+
+    void insert(const TileKey& key, Tile tile) {
+        std::vector<std::pair<TileKey, Tile>> evicted;
+        {
+            std::lock_guard<std::mutex> lock(m);
+            if (index.count(key)) return;
+            order.emplace_front(key, std::move(tile));
+            index[key] = order.begin();
+            used += TILE_BYTES;
+
+            while (used > budget && order.size() > 1) {
+                evicted.push_back(std::move(order.back()));
+                index.erase(order.back().first);
+                order.pop_back();
+                used -= TILE_BYTES;
+            }
+        }
+        // Disk writes outside the lock, the other workers dont have to wait for them
+        for (auto& entry : evicted) spill(entry.first, *entry.second);
+    }
+
+    size_t size() {
+        std::lock_guard<std::mutex> lock(m);
+        return order.size();
+    }
+
+private:
+    static const size_t TILE_BYTES = TILE_SIZE * TILE_SIZE * sizeof(uint32_t);
+
+    std::string spillPath(const TileKey& key) const {
+        char name[160];
+        std::snprintf(name, sizeof(name), "/%dx%d_%d_%d_%lld_%lld.tile", key.width, key.height, key.maxIter, key.level,
+                      static_cast<long long>(key.tx), static_cast<long long>(key.ty));
+        return spillDir + name;
+    }
+
+    void spill(const TileKey& key, const std::vector<uint32_t>& counts) {
+        if (spillDir.empty() || spilled.fetch_add(TILE_BYTES) + TILE_BYTES > TILE_SPILL_BYTES) return;
+        FILE* file = std::fopen(spillPath(key).c_str(), "wb");
+        if (!file) return;
+        std::fwrite(counts.data(), sizeof(uint32_t), counts.size(), file);
+        std::fclose(file);
+    }
+
+    size_t budget;
+    size_t used = 0;
+    std::string spillDir;
+    std::atomic<uint64_t> spilled{0};
+
+    std::list<std::pair<TileKey, Tile>> order; // most recently used first
+    std::unordered_map<TileKey, std::list<std::pair<TileKey, Tile>>::iterator, TileKeyHash> index;
+    std::mutex m;
+};
+
+// Which tile pixel every screen column (or row) lands on at one level
+struct TileAxis {
+    std::vector<int64_t> tile;
+    std::vector<int> pixel;
+    int64_t first, last;
+};
+
+// Nearest tile pixel for each of count screen pixels at coordinates start, start + step, ...
+inline TileAxis tileAxis(double start, double step, int count, double tileStep) {
+    TileAxis axis;
+    axis.tile.resize(count);
+    axis.pixel.resize(count);
+    for (int k = 0; k < count; ++k) {
+        int64_t global = static_cast<int64_t>(std::floor((start + k * step) / tileStep + 0.5));
+        int64_t t = global >= 0 ? global / TILE_SIZE : -((-global + TILE_SIZE - 1) / TILE_SIZE);
+        axis.tile[k] = t;
+        axis.pixel[k] = static_cast<int>(global - t * TILE_SIZE);
+    }
+    axis.first = axis.tile.front();
+    axis.last = axis.tile.back();
+    return axis;
+}
+
+inline TileKey tileKey(const View& view, int level, int64_t tx, int64_t ty) {
+    return {level, tx, ty, view.maxIter, view.width, view.height};
+}
+
+// Every tile of view's own level that isnt in memory yet
+inline std::vector<TileKey> missingTiles(TileCache& cache, const View& view) {
+    int level = tileLevelFor(view);
+    TileAxis columns = tileAxis(view.pixelX(0), view.stepX(), view.width, tileStepX(level, view.width));
+    TileAxis rows = tileAxis(view.pixelY(0), view.stepY(), view.height, tileStepY(level, view.height));
+
+    std::vector<TileKey> missing;
+    for (int64_t ty = rows.first; ty <= rows.last; ++ty) {
+        for (int64_t tx = columns.first; tx <= columns.last; ++tx) {
+            TileKey key = tileKey(view, level, tx, ty);
+            if (!cache.find(key)) missing.push_back(key);
+        }
+    }
+    return missing;
+}
+
+// Computes one tile. It is just a screen sized view at zoom 2^level whose center is put so that
+// its top left pixel is the tile's first pixel, so all the kernel picking works as usual.
+inline Tile computeTile(const RenderSettings& settings, const TileKey& key) {
+    double stepX = tileStepX(key.level, key.width);
+    double stepY = tileStepY(key.level, key.height);
+    View tileView;
+    tileView.width = key.width;
+    tileView.height = key.height;
+    tileView.zoom = std::ldexp(1.0, key.level);
+    tileView.maxIter = key.maxIter;
+    tileView.setCenter((key.tx * TILE_SIZE + key.width / 2.0) * stepX, (key.ty * TILE_SIZE + key.height / 2.0) * stepY);
+
+    FrameKernel iterate = iterateFor(tileView, settings);
+    auto counts = std::make_shared<std::vector<uint32_t>>(TILE_SIZE * TILE_SIZE);
+    for (int r = 0; r < TILE_SIZE; ++r) {
+        computeRow(iterate, tileView, r, 0, TILE_SIZE, counts->data() + r * TILE_SIZE);
+    }
+    return counts;
+}
+
+// Starts computing (or loading from the spill directory) the missing tiles, one task each. Tasks
+// that havent started when the generation moves on are skipped, finished ones stay cached.
+inline std::shared_ptr<ThreadPool::Job> startMissingTiles(ThreadPool& pool, const RenderSettings& settings, TileCache& cache,
+                                                          std::vector<TileKey> missing, const Generation& generation, uint64_t current) {
+    int count = static_cast<int>(missing.size());
+    return pool.submit(count, [=, &cache, &generation](int t) {
+        if (generation.load() != current) return;
+        Tile tile = cache.loadSpilled(missing[t]);
+        if (!tile) tile = computeTile(settings, missing[t]);
+        cache.insert(missing[t], std::move(tile));
+    });
+}
+
+/*
+    Puts view together in iters from whatever tiles are in memory. Its own level first, then the
+    levels around it for anything still missing. True if every pixel came from its own level, which
+    is once the missing tiles are in.
+*/
+inline bool composeFromTiles(ThreadPool& pool, TileCache& cache, const View& view, IterationBuffer& iters) {
+    if (iters.width != view.width || iters.height != view.height) iters.resize(pool, view.width, view.height);
+    // Resampled, so not something the exact pan reuse should build on
+    iters.valid = false;
+    iters.view = view;
+
+    int own = tileLevelFor(view);
+    std::vector<uint8_t> filled(static_cast<size_t>(view.width) * view.height, 0);
+    bool complete = false;
+
+    for (int k = 0; k <= 2 * TILE_FALLBACK_LEVELS; ++k) {
+        // own, own - 1, own + 1, own - 2, ...
+        int level = own + (k % 2 == 1 ? -(k + 1) / 2 : k / 2);
+        if (level > TILE_MAX_LEVEL) continue;
+
+        TileAxis columns = tileAxis(view.pixelX(0), view.stepX(), view.width, tileStepX(level, view.width));
+        TileAxis rows = tileAxis(view.pixelY(0), view.stepY(), view.height, tileStepY(level, view.height));
+
+        // Tiles of this level under the screen, null where not cached
+        int64_t across = columns.last - columns.first + 1;
+        int64_t down = rows.last - rows.first + 1;
+        std::vector<Tile> tiles(static_cast<size_t>(across * down));
+        bool any = false, all = true;
+        for (int64_t ty = 0; ty < down; ++ty) {
+            for (int64_t tx = 0; tx < across; ++tx) {
+                Tile tile = cache.find(tileKey(view, level, columns.first + tx, rows.first + ty));
+                any = any || tile;
+                all = all && tile;
+                tiles[ty * across + tx] = std::move(tile);
+            }
+        }
+        if (!any) continue;
+
+        int bands = (view.height + BAND_ROWS - 1) / BAND_ROWS;
+        pool.parallelFor(bands, [&](int band) {
+            for (int i = band * BAND_ROWS; i < std::min((band + 1) * BAND_ROWS, view.height); ++i) {
+                uint32_t* row = iters.row(i);
+                uint8_t* done = filled.data() + static_cast<size_t>(i) * view.width;
+                const Tile* tileRow = tiles.data() + (rows.tile[i] - rows.first) * across;
+                int r = rows.pixel[i] * TILE_SIZE;
+                for (int j = 0; j < view.width; ++j) {
+                    const Tile& tile = tileRow[columns.tile[j] - columns.first];
+                    if (done[j] || !tile) continue;
+                    row[j] = (*tile)[r + columns.pixel[j]];
+                    done[j] = 1;
+                }
+            }
+        });
+
+        if (level == own && all) {
+            complete = true;
+            break;
+        }
+    }
+    return complete;
+}
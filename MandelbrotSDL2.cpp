@@ -7,31 +7,50 @@ const int SCREEN_WIDTH = 800;
 const int SCREEN_HEIGHT = 600;
 const int MAX_ITER = 1000;
 
-struct Color {
-    uint8_t r, g, b;
-};
-
-// Maps an iteration to a color
-Color getColor(int iter) {
-    if (iter == MAX_ITER) {
-        return {0, 0, 0};
-    } else {
-        uint8_t t = iter / MAX_ITER; 
-        uint8_t r = (uint8_t)(128.0 + 127.0 * sin(6.28318 * t + 0));
-        uint8_t g = (uint8_t)(128.0 + 127.0 * sin(6.28318 * t + 2.09439)); // 2π/3 phase shift
-        uint8_t b = (uint8_t)(128.0 + 127.0 * sin(6.28318 * t + 4.18879)); // 4π/3 phase shift
-        return {r, g, b};
+// Every iteration count 0 .. MAX_ITER to an RGBA pixel, worked out once at startup so drawing
+// a pixel is a lookup instead of three sin() calls
+Uint32 palette[MAX_ITER + 1];
+
+void buildPalette() {
+    for (int iter = 0; iter <= MAX_ITER; iter++) {
+        if (iter == MAX_ITER) {
+            palette[iter] = 0xFF;
+            continue;
+        }
+        double t = static_cast<double>(iter) / MAX_ITER;
+        Uint32 r = static_cast<uint8_t>(128.0 + 127.0 * sin(6.28318 * t + 0));
+        Uint32 g = static_cast<uint8_t>(128.0 + 127.0 * sin(6.28318 * t + 2.09439)); // 2π/3 phase shift
+        Uint32 b = static_cast<uint8_t>(128.0 + 127.0 * sin(6.28318 * t + 4.18879)); // 4π/3 phase shift
+        palette[iter] = (r << 24) | (g << 16) | (b << 8) | 0xFF;
     }
 }
 
 // Calculates if a complex number c is in MB set and returns number of iters before leaving set
 int mandelbrot(std::complex<double> c) {
+    // Main cardioid and period 2 bulb are in the set, no need to iterate them at all
+    double xq = c.real() - 0.25;
+    double q = xq * xq + c.imag() * c.imag();
+    if (q * (q + xq) <= 0.25 * c.imag() * c.imag() || std::norm(c + 1.0) <= 0.0625) return MAX_ITER;
+
     std::complex<double> z = 0;
     int iter = 0;
 
+    // Brent style cycle detection: remember z every so often (doubling the gap each time) and if
+    // the orbit lands back on it, it is stuck in a cycle and will never escape
+    std::complex<double> saved = 0;
+    int window = 8;
+    int untilSave = window;
+
     while ((z.real() * z.real() + z.imag() * z.imag()) <= 2 && iter < MAX_ITER) {
         z = z * z + c;
         iter++;
+
+        if (std::norm(z - saved) < 1e-28) return MAX_ITER;
+        if (--untilSave == 0) {
+            window *= 2;
+            untilSave = window;
+            saved = z;
+        }
     }
 
     return iter;
@@ -149,16 +168,9 @@ void mandelbrotAVX(double offsetX, double offsetY, double zoom, const int iterat
 
             // _n now contains number of iterations for a pixel we are processing, which we will visualize
                 
-            Color color1 = getColor(int(_n[3]));
-            Color color2 = getColor(int(_n[2]));
-            Color color3 = getColor(int(_n[1]));
-            Color color4 = getColor(int(_n[0]));
-
-
-            pixels[i * (bytesPerRow / 4) + j + 0] = (color1.r << 24) | (color1.g << 16) | (color1.b << 8) | 0xFF;
-            pixels[i * (bytesPerRow / 4) + j + 1] = (color2.r << 24) | (color2.g << 16) | (color2.b << 8) | 0xFF;
-            pixels[i * (bytesPerRow / 4) + j + 2] = (color3.r << 24) | (color3.g << 16) | (color3.b << 8) | 0xFF;
-            pixels[i * (bytesPerRow / 4) + j + 3] = (color4.r << 24) | (color4.g << 16) | (color4.b << 8) | 0xFF;
+            // Look up all 4 colors at once, _n holds the counts as 64 bit ints (lane 0 is pixel j + 0)
+            __m128i _colors = _mm256_i64gather_epi32(reinterpret_cast<const int*>(palette), _n, 4);
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(pixels + i * (bytesPerRow / 4) + j), _colors);
         }
    }
 }
@@ -166,6 +178,8 @@ void mandelbrotAVX(double offsetX, double offsetY, double zoom, const int iterat
 
 
 int main() {
+    buildPalette();
+
     // Init SDL2
     if (SDL_Init(SDL_INIT_VIDEO) < 0) {
         std::cerr << "SDL could not start! Error: " << SDL_GetError() << std::endl;
@@ -208,12 +222,23 @@ int main() {
     bool quit = false;
     SDL_Event e;
 
+    // View the texture was last drawn with, nothing to recompute while it stays the same
+    bool drawn = false;
+    double drawnZoom = zoom;
+    double drawnOffsetX = offsetX;
+    double drawnOffsetY = offsetY;
+    bool repaint = false;
+
     // Main loop
     while (!quit) {
-        // Handle events
-        while (SDL_PollEvent(&e) != 0) {
+        // Handle events, when the frame is up to date just sleep until the next one comes in
+        bool upToDate = drawn && zoom == drawnZoom && offsetX == drawnOffsetX && offsetY == drawnOffsetY;
+        int pending = upToDate ? SDL_WaitEvent(&e) : SDL_PollEvent(&e);
+        for (; pending != 0; pending = SDL_PollEvent(&e)) {
             if (e.type == SDL_QUIT) {
                 quit = true;
+            } else if (e.type == SDL_WINDOWEVENT) {
+                repaint = true;
             } else if (e.type == SDL_KEYDOWN) {
                 switch (e.key.keysym.sym) {
                     case SDLK_UP:
@@ -245,41 +270,53 @@ int main() {
             }
         }
 
-        // Lock texture for manipulation
-        void* pixels;
-        int bytesPerRow;
-        SDL_LockTexture(texture, NULL, &pixels, &bytesPerRow);
-
-        // Draw mandelbrot and manipulate pixels directly
-        // Uint32* pixelData = static_cast<Uint32*>(pixels);
-        // for (int i = 0; i < SCREEN_HEIGHT; i++) {
-        //     for (int j = 0; j < SCREEN_WIDTH; j++) {
-        //         // Map pixel to complex plane
-
-        //         /*
-        //             j - ScreenWIdth / 2.0 lets us center the x coordinate. Because when we iterate over pixels
-        //             the top left is 0,0 and bottom right is SW - 1, SW - 1. So doing this puts it in range 
-        //             of -SW, SW. 
-
-        //             THen doing * 4 allows us to scale the range by 4 which is useful for next step
-        //             THen doing / (SW * zoom) takes the scaled range and puts it in MB range of -2, 2, and multiplying that by zoom increases or decreases range
-        //             Then adding offset pans the screen left or right
-        //         */
-        //         std::complex<double> c((j - SCREEN_WIDTH / 2.0) * 4.0 / (SCREEN_WIDTH * zoom) + offsetX,
-        //                                (i - SCREEN_HEIGHT / 2.0) * 4.0 / (SCREEN_HEIGHT * zoom) + offsetY);
-        //         int iterations = mandelbrot(c);
-        //         Color color = getColor(iterations);
-
-        //         // Set pixel color bytesPerRow / 4 tells us how many 32 bit colors are in that row, and we increment by them instead of bytes
-        //         pixelData[i * (bytesPerRow / 4) + j] = (color.r << 24) | (color.g << 16) | (color.b << 8) | 0xFF;
-        //     }
-        // }
-
-        // Draw mandelbrot and manipulate pixels directly using simd extensions
-        Uint32* pixelData = static_cast<Uint32*>(pixels);
-        mandelbrotAVX(offsetX, offsetY, zoom, MAX_ITER, pixelData, bytesPerRow);
-
-        SDL_UnlockTexture(texture);
+        if (quit) break;
+
+        bool viewChanged = !drawn || zoom != drawnZoom || offsetX != drawnOffsetX || offsetY != drawnOffsetY;
+        if (!viewChanged && !repaint) continue;
+        repaint = false;
+
+        if (viewChanged) {
+            // Lock texture for manipulation
+            void* pixels;
+            int bytesPerRow;
+            SDL_LockTexture(texture, NULL, &pixels, &bytesPerRow);
+
+            // Draw mandelbrot and manipulate pixels directly
+            // Uint32* pixelData = static_cast<Uint32*>(pixels);
+            // for (int i = 0; i < SCREEN_HEIGHT; i++) {
+            //     for (int j = 0; j < SCREEN_WIDTH; j++) {
+            //         // Map pixel to complex plane
+
+            //         /*
+            //             j - ScreenWIdth / 2.0 lets us center the x coordinate. Because when we iterate over pixels
+            //             the top left is 0,0 and bottom right is SW - 1, SW - 1. So doing this puts it in range 
+            //             of -SW, SW. 
+
+            //             THen doing * 4 allows us to scale the range by 4 which is useful for next step
+            //             THen doing / (SW * zoom) takes the scaled range and puts it in MB range of -2, 2, and multiplying that by zoom increases or decreases range
+            //             Then adding offset pans the screen left or right
+            //         */
+            //         std::complex<double> c((j - SCREEN_WIDTH / 2.0) * 4.0 / (SCREEN_WIDTH * zoom) + offsetX,
+            //                                (i - SCREEN_HEIGHT / 2.0) * 4.0 / (SCREEN_HEIGHT * zoom) + offsetY);
+            //         int iterations = mandelbrot(c);
+
+            //         // Set pixel color bytesPerRow / 4 tells us how many 32 bit colors are in that row, and we increment by them instead of bytes
+            //         pixelData[i * (bytesPerRow / 4) + j] = palette[iterations];
+            //     }
+            // }
+
+            // Draw mandelbrot and manipulate pixels directly using simd extensions
+            Uint32* pixelData = static_cast<Uint32*>(pixels);
+            mandelbrotAVX(offsetX, offsetY, zoom, MAX_ITER, pixelData, bytesPerRow);
+
+            SDL_UnlockTexture(texture);
+
+            drawn = true;
+            drawnZoom = zoom;
+            drawnOffsetX = offsetX;
+            drawnOffsetY = offsetY;
+        }
 
         // Clear screen
         SDL_SetRenderDrawColor(renderer, 0x00, 0x00, 0x00, 0xFF);